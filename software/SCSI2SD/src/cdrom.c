@@ -163,10 +163,15 @@ static void doReadTOC(int MSF, uint8_t track, uint16_t allocationLength)
 		uint32_t len = sizeof(SimpleTOC);
 		memcpy(scsiDev.data, SimpleTOC, len);
 
-		uint32_t capacity = getScsiCapacity(
-			scsiDev.target->cfg->sdSectorStart,
+		uint64_t capacity = getScsiCapacity(
+			scsiDev.target->liveCfg.sdSectorStart,
 			scsiDev.target->liveCfg.bytesPerSector,
-			scsiDev.target->cfg->scsiSectors);
+			scsiDev.target->liveCfg.packed,
+			scsiDev.target->liveCfg.scsiSectors);
+		if (capacity > 0xFFFFFFFF)
+		{
+			capacity = 0xFFFFFFFF;
+		}
 
 		// Replace start of leadout track
 		if (MSF)
@@ -26,6 +26,9 @@
 #include "scsi.h"
 #include "scsiPhy.h"
 #include "disk.h"
+#include "sd.h"
+#include "stats.h"
+#include "trace.h"
 
 #include "../../include/scsi2sd.h"
 #include "../../include/hidpacket.h"
@@ -175,6 +178,72 @@ scsiTestCommand()
 	hidPacket_send(response, sizeof(response));
 }
 
+static void
+statsCommand(const uint8_t* cmd, size_t cmdSize)
+{
+	if ((cmdSize < 4) ||
+		(cmd[1] >= MAX_SCSI_TARGETS) ||
+		(cmd[2] >= CONFIG_STATS_CLASSES))
+	{
+		uint8_t response[] = { CONFIG_STATUS_ERR};
+		hidPacket_send(response, sizeof(response));
+		return;
+	}
+
+	CommandStats* s = &stats[cmd[1]][cmd[2]];
+	uint8_t response[1 + sizeof(CommandStats)];
+	response[0] = CONFIG_STATUS_GOOD;
+	memcpy(response + 1, s, sizeof(CommandStats));
+	hidPacket_send(response, sizeof(response));
+
+	if (cmd[3])
+	{
+		memset(s, 0, sizeof(CommandStats));
+	}
+}
+
+static void
+traceCommand(const uint8_t* cmd, size_t cmdSize)
+{
+#ifdef TRACE_RAM
+	if (cmdSize >= 4)
+	{
+		tracePaused = cmd[1];
+
+		uint32_t first = (((uint32_t)cmd[2]) << 8) | cmd[3];
+		uint32_t records = 0;
+		if (first < TRACE_RAM_SLOTS)
+		{
+			records = TRACE_RAM_SLOTS - first;
+		}
+		if (records > CONFIG_TRACE_RECORDS)
+		{
+			records = CONFIG_TRACE_RECORDS;
+		}
+
+		uint8_t response[
+			1 + sizeof(TraceHeader) + CONFIG_TRACE_RECORDS * sizeof(TraceRecord)];
+		TraceHeader header = { traceCount, TRACE_RAM_SLOTS, 0 };
+		response[0] = CONFIG_STATUS_GOOD;
+		memcpy(response + 1, &header, sizeof(header));
+		memcpy(
+			response + 1 + sizeof(header),
+			traceRing + first,
+			records * sizeof(TraceRecord));
+		hidPacket_send(
+			response,
+			1 + sizeof(header) + records * sizeof(TraceRecord));
+		return;
+	}
+#else
+	(void) cmd;
+	(void) cmdSize;
+#endif
+
+	uint8_t response[] = { CONFIG_STATUS_ERR};
+	hidPacket_send(response, sizeof(response));
+}
+
 static void
 processCommand(const uint8_t* cmd, size_t cmdSize)
 {
@@ -204,6 +273,14 @@ processCommand(const uint8_t* cmd, size_t cmdSize)
 		scsiTestCommand();
 		break;
 
+	case CONFIG_STATS:
+		statsCommand(cmd, cmdSize);
+		break;
+
+	case CONFIG_TRACE:
+		traceCommand(cmd, cmdSize);
+		break;
+
 	case CONFIG_NONE: // invalid
 	default:
 		break;
@@ -325,6 +402,44 @@ void debugPoll()
 		hidBuffer[28] = scsiDev.lastSenseASC;
 		hidBuffer[29] = scsiReadDBxPins();
 
+		hidBuffer[30] = readAhead.hits >> 24;
+		hidBuffer[31] = readAhead.hits >> 16;
+		hidBuffer[32] = readAhead.hits >> 8;
+		hidBuffer[33] = readAhead.hits;
+		hidBuffer[34] = readAhead.misses >> 24;
+		hidBuffer[35] = readAhead.misses >> 16;
+		hidBuffer[36] = readAhead.misses >> 8;
+		hidBuffer[37] = readAhead.misses;
+		hidBuffer[38] = writeCache.hits >> 24;
+		hidBuffer[39] = writeCache.hits >> 16;
+		hidBuffer[40] = writeCache.hits >> 8;
+		hidBuffer[41] = writeCache.hits;
+		hidBuffer[42] = writeCache.misses >> 24;
+		hidBuffer[43] = writeCache.misses >> 16;
+		hidBuffer[44] = writeCache.misses >> 8;
+		hidBuffer[45] = writeCache.misses;
+
+		// SD write latency histogram, each bucket scaled to 1/255ths of
+		// the total. Non-empty buckets show as at least 1.
+		{
+			uint32_t total = 0;
+			int i;
+			for (i = 0; i < SD_LATENCY_BUCKETS; ++i)
+			{
+				total += sdDev.writeLatency.count[i];
+			}
+			for (i = 0; i < SD_LATENCY_BUCKETS; ++i)
+			{
+				uint32_t count = sdDev.writeLatency.count[i];
+				uint32_t scaled = count ? (count * 255) / total : 0;
+				hidBuffer[46 + i] = (count && !scaled) ? 1 : scaled;
+			}
+		}
+		hidBuffer[54] = sdDev.writeLatency.p50_ms;
+		hidBuffer[55] = sdDev.writeLatency.p99_ms;
+		hidBuffer[56] = sdDev.writeLatency.disconnect_ms;
+		hidBuffer[57] = sdDev.writeLatency.earlyStatus_ms;
+
 		hidBuffer[58] = sdDev.capacity >> 24;
 		hidBuffer[59] = sdDev.capacity >> 16;
 		hidBuffer[60] = sdDev.capacity >> 8;
@@ -378,7 +493,10 @@ int isDebugEnabled()
 }
 
 // Public method for storing MODE SELECT results.
-void configSave(int scsiId, uint16_t bytesPerSector)
+// Saves the MODE SELECT parameters of one logical unit. writeCache is the
+// Caching page WCE bit, or -1 to keep the saved value. Nothing is written
+// if they haven't changed.
+void configSave(int scsiId, int lun, uint16_t bytesPerSector, int writeCache)
 {
 	int cfgIdx;
 	for (cfgIdx = 0; cfgIdx < MAX_SCSI_TARGETS; ++cfgIdx)
@@ -392,7 +510,31 @@ void configSave(int scsiId, uint16_t bytesPerSector)
 			uint8_t rowData[CYDEV_FLS_ROW_SIZE];
 			TargetConfig* rowCfgData = (TargetConfig*)&rowData;
 			memcpy(rowCfgData, tgt, sizeof(rowData));
-			rowCfgData->bytesPerSector = bytesPerSector;
+			if (lun > 0)
+			{
+				LunConfig* lunCfg = &rowCfgData->luns[lun - 1];
+				lunCfg->bytesPerSector = bytesPerSector;
+				if (writeCache >= 0)
+				{
+					lunCfg->flags = writeCache ?
+						(lunCfg->flags | CONFIG_LUN_WRITE_CACHE) :
+						(lunCfg->flags & ~CONFIG_LUN_WRITE_CACHE);
+				}
+			}
+			else
+			{
+				rowCfgData->bytesPerSector = bytesPerSector;
+				if (writeCache >= 0)
+				{
+					rowCfgData->flags = writeCache ?
+						(rowCfgData->flags | CONFIG_ENABLE_WRITE_CACHE) :
+						(rowCfgData->flags & ~CONFIG_ENABLE_WRITE_CACHE);
+				}
+			}
+			if (memcmp(rowCfgData, tgt, sizeof(rowData)) == 0)
+			{
+				return;
+			}
 
 			CySetTemp();
 			CyWriteRowData(
@@ -404,6 +546,18 @@ void configSave(int scsiId, uint16_t bytesPerSector)
 	}
 }
 
+// The saved Caching page WCE bit of a logical unit.
+int configWriteCache(const TargetConfig* cfg, int lun)
+{
+	if (lun > 0)
+	{
+		return (cfg->luns[lun - 1].flags & CONFIG_LUN_WRITE_CACHE) ? 1 : 0;
+	}
+	else
+	{
+		return (cfg->flags & CONFIG_ENABLE_WRITE_CACHE) ? 1 : 0;
+	}
+}
 
 const TargetConfig* getConfigByIndex(int i)
 {
@@ -23,7 +23,8 @@
 void configInit(void);
 void debugInit(void);
 void configPoll(void);
-void configSave(int scsiId, uint16_t byesPerSector);
+void configSave(int scsiId, int lun, uint16_t byesPerSector, int writeCache);
+int configWriteCache(const TargetConfig* cfg, int lun);
 
 const TargetConfig* getConfigByIndex(int index);
 const TargetConfig* getConfigById(int scsiId);
@@ -19,19 +19,299 @@
 
 #include "device.h"
 #include "scsi.h"
+#include "crc16.h"
 #include "diagnostic.h"
+#include "disk.h"
+#include "geometry.h"
+#include "sd.h"
+#include "time.h"
 
 #include <string.h>
 
+// Vendor specific page. SEND DIAGNOSTIC with this page runs the SD card
+// benchmark, and RECEIVE DIAGNOSTIC RESULTS returns the results.
+#define DIAG_PAGE_BENCHMARK 0x80
+
 static const uint8 SupportedDiagnosticPages[] =
 {
 0x00, // Page Code
 0x00, // Reserved
-0x02, // Page length
+0x03, // Page length
 0x00, // Support "Supported diagnostic page"
-0x40  // Support "Translate address page"
+0x40, // Support "Translate address page"
+DIAG_PAGE_BENCHMARK
 };
 
+// Each benchmark test times this many SD commands. The self-test only
+// runs the read tests, with fewer commands, as the host is waiting on it.
+#define BENCH_OPS 128
+#define BENCH_SELF_TEST_OPS 16
+#define BENCH_SEQ_SECTORS 16 // 8kB. The lower half of scsiDev.data
+#define BENCH_RANDOM_SECTORS 8 // 4kB
+
+typedef enum
+{
+	BENCH_SEQ_READ,
+	BENCH_SEQ_WRITE,
+	BENCH_RANDOM_READ,
+	BENCH_RANDOM_WRITE,
+	BENCH_TESTS
+} BENCH_TEST;
+
+typedef struct
+{
+	uint32 kBPerSec;
+	uint32 p50_us; // Command latency percentiles.
+	uint32 p99_us;
+	uint32 max_us; // Worst time the card was busy with one command.
+} BenchResult;
+
+static struct
+{
+	uint8 status; // 0 if not run, 1 if passed, 2 if it failed.
+	uint32 sdLBA; // First SD sector of the scratch region.
+	uint32 sdBlocks;
+	BenchResult tests[BENCH_TESTS];
+} bench;
+
+static uint32 benchSeed;
+static uint32 benchRandom()
+{
+	benchSeed = benchSeed * 1103515245 + 12345;
+	uint32 high = benchSeed >> 16;
+	benchSeed = benchSeed * 1103515245 + 12345;
+	return (high << 16) | (benchSeed >> 16);
+}
+
+// Read sdBlocks sectors into scsiDev.data with one CMD18. If checkCRC is
+// set, a sector with a bad CRC is an error. Returns 0 and sets the sense
+// data on error.
+static int benchRead(uint32 sdLBA, uint32 sdBlocks, int checkCRC)
+{
+	transfer.multiBlock = 1;
+	sdReadMultiSectorStart(sdLBA, sdBlocks);
+	while (!sdMultiSectorPrepPoll() && likely(scsiDev.status == GOOD)) {}
+
+	uint32 i;
+	for (i = 0; (i < sdBlocks) && likely(scsiDev.status == GOOD); ++i)
+	{
+		uint8_t* sector = &scsiDev.data[SD_SECTOR_SIZE * i];
+		uint32_t tokenStart = getTime_ms();
+		int started = 0;
+		while (!started &&
+			(elapsedTime_ms(tokenStart) <= SD_READ_TOKEN_TIMEOUT_MS))
+		{
+			started = sdReadSectorDMAStart(sector);
+		}
+		if (unlikely(started <= 0))
+		{
+			sdReadSectorError();
+			break;
+		}
+		while (!sdReadSectorDMAPoll()) {}
+
+		if (checkCRC &&
+			unlikely(crc16(sector, SD_SECTOR_SIZE) != sdReadSectorCRC()))
+		{
+			sdReadSectorError();
+		}
+	}
+	if (likely(scsiDev.status == GOOD))
+	{
+		sdCompleteRead();
+	}
+	return scsiDev.status == GOOD;
+}
+
+// Write sdBlocks sectors from scsiDev.data with one CMD25. Returns 0 and
+// sets the sense data on error.
+static int benchWrite(uint32 sdLBA, uint32 sdBlocks)
+{
+	sdWriteMultiSectorStart(sdLBA, sdBlocks);
+	while (!sdMultiSectorPrepPoll() && likely(scsiDev.status == GOOD)) {}
+
+	uint32 i;
+	for (i = 0; (i < sdBlocks) && likely(scsiDev.status == GOOD); ++i)
+	{
+		sdWriteMultiSectorDMA(&scsiDev.data[SD_SECTOR_SIZE * i]);
+		while (!sdWriteSectorDMAPoll(0) && likely(scsiDev.status == GOOD)) {}
+	}
+
+	if (likely(scsiDev.status == GOOD) && unlikely(sdCompleteCachedWrite()))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = HARDWARE_ERROR;
+		scsiDev.target->sense.asc = WRITE_ERROR_AUTO_REALLOCATION_FAILED;
+		scsiDev.phase = STATUS;
+	}
+	transfer.inProgress = 0;
+	return scsiDev.status == GOOD;
+}
+
+// Time ops commands of one test, up to BENCH_OPS. Writes put back the data
+// that was already on the card, so nothing is lost unless the power fails.
+static int benchRun(BENCH_TEST test, int ops)
+{
+	int random = (test == BENCH_RANDOM_READ) || (test == BENCH_RANDOM_WRITE);
+	int write = (test == BENCH_SEQ_WRITE) || (test == BENCH_RANDOM_WRITE);
+	uint32 opSectors = random ? BENCH_RANDOM_SECTORS : BENCH_SEQ_SECTORS;
+	uint32 slots = bench.sdBlocks / opSectors;
+
+	// Sorted afterwards for the percentiles.
+	uint32_t* latency = (uint32_t*) &scsiDev.data[sizeof(scsiDev.data) / 2];
+	uint64 totalUs = 0;
+
+	int i;
+	for (i = 0; i < ops; ++i)
+	{
+		uint32 slot = random ? (benchRandom() % slots) : (i % slots);
+		uint32 sdLBA = bench.sdLBA + slot * opSectors;
+		if (write && !benchRead(sdLBA, opSectors, 1))
+		{
+			return 0;
+		}
+
+		uint32_t start = getTime_cycles();
+		if (write ?
+			!benchWrite(sdLBA, opSectors) :
+			!benchRead(sdLBA, opSectors, 0))
+		{
+			return 0;
+		}
+		latency[i] = (getTime_cycles() - start) / CYCLES_PER_US;
+		totalUs += latency[i];
+	}
+
+	for (i = 1; i < ops; ++i)
+	{
+		uint32_t value = latency[i];
+		int j = i;
+		while ((j > 0) && (latency[j - 1] > value))
+		{
+			latency[j] = latency[j - 1];
+			--j;
+		}
+		latency[j] = value;
+	}
+
+	BenchResult* result = &bench.tests[test];
+	uint64 bytes = (uint64) ops * opSectors * SD_SECTOR_SIZE;
+	result->kBPerSec = totalUs ? (bytes * 1000000 / 1024 / totalUs) : 0;
+	result->p50_us = latency[ops / 2];
+	result->p99_us = latency[ops * 99 / 100];
+	result->max_us = latency[ops - 1];
+	return 1;
+}
+
+// Run the benchmark on blocks SCSI blocks from lba. 0 blocks means the rest
+// of the target. A self-test only reads. Holds the bus until it's done.
+static void doBenchmark(uint32 lba, uint32 blocks, int selfTest)
+{
+	uint64 capacity = getScsiCapacity(
+		scsiDev.target->liveCfg.sdSectorStart,
+		scsiDev.target->liveCfg.bytesPerSector,
+		scsiDev.target->liveCfg.packed,
+		scsiDev.target->liveCfg.scsiSectors);
+	if (!blocks && (lba < capacity))
+	{
+		blocks = (capacity - lba > 0xFFFFFFFF) ? 0xFFFFFFFF : capacity - lba;
+	}
+	uint32 sdBlocks =
+		SCSIBlocks2SD(
+			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->liveCfg.packed,
+			lba,
+			blocks);
+
+	if (!(blockDev.state & DISK_INITIALISED))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = NOT_READY;
+		scsiDev.target->sense.asc = MEDIUM_NOT_PRESENT;
+		scsiDev.phase = STATUS;
+	}
+	else if (eraseQueue.active || formatFill.active)
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = NOT_READY;
+		scsiDev.target->sense.asc =
+			LOGICAL_UNIT_NOT_READY_OPERATION_IN_PROGRESS;
+		scsiDev.phase = STATUS;
+	}
+	else if ((((uint64) lba) + blocks > capacity) ||
+		(sdBlocks < BENCH_SEQ_SECTORS))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = ILLEGAL_REQUEST;
+		scsiDev.target->sense.asc = INVALID_FIELD_IN_PARAMETER_LIST;
+		scsiDev.phase = STATUS;
+	}
+	else
+	{
+		memset(&bench, 0, sizeof(bench));
+		bench.sdLBA =
+			SCSISector2SD(
+				scsiDev.target->liveCfg.sdSectorStart,
+				scsiDev.target->liveCfg.bytesPerSector,
+				scsiDev.target->liveCfg.packed,
+				lba);
+		bench.sdBlocks = sdBlocks;
+		benchSeed = getTime_cycles();
+
+		// Leave the write tests out if the card shouldn't be written.
+		int readOnly =
+			selfTest ||
+			(blockDev.state & DISK_WP) ||
+			(scsiDev.target->liveCfg.deviceType == CONFIG_OPTICAL);
+		int ops = selfTest ? BENCH_SELF_TEST_OPS : BENCH_OPS;
+
+		int test;
+		bench.status = 1;
+		for (test = 0; (test < BENCH_TESTS) && (bench.status == 1); ++test)
+		{
+			int write =
+				(test == BENCH_SEQ_WRITE) || (test == BENCH_RANDOM_WRITE);
+			if ((!write || !readOnly) && !benchRun(test, ops))
+			{
+				bench.status = 2;
+			}
+		}
+	}
+
+	// RECEIVE DIAGNOSTIC RESULTS returns the page in scsiDev.data[0]
+	scsiDev.data[0] = DIAG_PAGE_BENCHMARK;
+}
+
+// Callback after the SEND DIAGNOSTIC parameter list has been received.
+// The benchmark page has the first SCSI block of the scratch region in
+// bytes 4-7, and the number of blocks in bytes 8-11.
+static void doSendDiagnosticData(void)
+{
+	if ((scsiDev.dataLen >= 12) && (scsiDev.data[0] == DIAG_PAGE_BENCHMARK))
+	{
+		uint32 lba =
+			(((uint32) scsiDev.data[4]) << 24) +
+			(((uint32) scsiDev.data[5]) << 16) +
+			(((uint32) scsiDev.data[6]) << 8) +
+			scsiDev.data[7];
+		uint32 blocks =
+			(((uint32) scsiDev.data[8]) << 24) +
+			(((uint32) scsiDev.data[9]) << 16) +
+			(((uint32) scsiDev.data[10]) << 8) +
+			scsiDev.data[11];
+		doBenchmark(lba, blocks, 0);
+	}
+	scsiDev.phase = STATUS;
+}
+
+static void putBE32(uint8* buf, uint32 value)
+{
+	buf[0] = value >> 24;
+	buf[1] = value >> 16;
+	buf[2] = value >> 8;
+	buf[3] = value;
+}
+
 void scsiSendDiagnostic()
 {
 	// SEND DIAGNOSTIC
@@ -47,6 +327,7 @@ void scsiSendDiagnostic()
 		// Initiator sends us page data.
 		scsiDev.dataLen = paramLength;
 		scsiDev.phase = DATA_OUT;
+		scsiDev.postDataOutHook = doSendDiagnosticData;
 
 		if (scsiDev.dataLen > sizeof (scsiDev.data))
 		{
@@ -61,7 +342,17 @@ void scsiSendDiagnostic()
 	}
 	else
 	{
-		// Default command result will be a status of GOOD anyway.
+		// The self-test is a short sequential and random read of the
+		// whole target. The write tests are only run from the benchmark
+		// page.
+		doBenchmark(0, 0, 1);
+		if ((scsiDev.status == GOOD) && (bench.status != 1))
+		{
+			scsiDev.status = CHECK_CONDITION;
+			scsiDev.target->sense.code = HARDWARE_ERROR;
+			scsiDev.target->sense.asc = LOGICAL_UNIT_FAILED_SELF_TEST;
+			scsiDev.phase = STATUS;
+		}
 	}
 }
 
@@ -120,6 +411,36 @@ void scsiReceiveDiagnostic()
 		scsiDev.dataLen = 14;
 		scsiDev.phase = DATA_IN;
 	}
+	else if (pageCode == DIAG_PAGE_BENCHMARK)
+	{
+		// A 16 byte header, then kB/s, p50, p99 and max latency in us for
+		// sequential read, sequential write, random read and random write.
+		memset(scsiDev.data, 0, 16);
+		scsiDev.data[0] = DIAG_PAGE_BENCHMARK;
+		scsiDev.data[4] = bench.status;
+		scsiDev.data[5] = BENCH_SEQ_SECTORS;
+		scsiDev.data[6] = BENCH_RANDOM_SECTORS;
+		scsiDev.data[7] = BENCH_OPS;
+		putBE32(&scsiDev.data[8], bench.sdLBA);
+		putBE32(&scsiDev.data[12], bench.sdBlocks);
+
+		int len = 16;
+		int test;
+		for (test = 0; test < BENCH_TESTS; ++test)
+		{
+			const BenchResult* result = &bench.tests[test];
+			putBE32(&scsiDev.data[len], result->kBPerSec);
+			putBE32(&scsiDev.data[len + 4], result->p50_us);
+			putBE32(&scsiDev.data[len + 8], result->p99_us);
+			putBE32(&scsiDev.data[len + 12], result->max_us);
+			len += 16;
+		}
+		scsiDev.data[2] = (len - 4) >> 8;
+		scsiDev.data[3] = len - 4;
+
+		scsiDev.dataLen = len;
+		scsiDev.phase = DATA_IN;
+	}
 	else
 	{
 		// error.
@@ -137,7 +458,7 @@ void scsiReceiveDiagnostic()
 
 	{
 		// Set the first byte to indicate LUN presence.
-		if (scsiDev.lun) // We only support lun 0
+		if (!scsiLunEnabled(scsiDev.target, scsiDev.lun))
 		{
 			scsiDev.data[0] = 0x7F;
 		}
@@ -148,16 +469,24 @@ void scsiReadBuffer()
 {
 	// READ BUFFER
 	// Used for testing the speed of the SCSI interface.
-	uint8 mode = scsiDev.data[1] & 7;
+	// The whole of scsiDev.data is available, and is sent in a single DMA
+	// transfer.
+	uint8 mode = scsiDev.cdb[1] & 7;
 
-	int allocLength =
+	uint32 offset =
+		(((uint32) scsiDev.cdb[3]) << 16) +
+		(((uint32) scsiDev.cdb[4]) << 8) +
+		scsiDev.cdb[5];
+
+	uint32 allocLength =
 		(((uint32) scsiDev.cdb[6]) << 16) +
 		(((uint32) scsiDev.cdb[7]) << 8) +
 		scsiDev.cdb[8];
 
 	if (mode == 0)
 	{
-		uint32_t maxSize = MAX_SECTOR_SIZE - 4;
+		// Combined header and data.
+		uint32_t maxSize = sizeof(scsiDev.data) - 4;
 		// 4 byte header
 		scsiDev.data[0] = 0;
 		scsiDev.data[1] = (maxSize >> 16) & 0xff;
@@ -165,7 +494,28 @@ void scsiReadBuffer()
 		scsiDev.data[3] = maxSize & 0xff;
 
 		scsiDev.dataLen =
-			(allocLength > MAX_SECTOR_SIZE) ? MAX_SECTOR_SIZE : allocLength;
+			(allocLength > sizeof(scsiDev.data)) ?
+				sizeof(scsiDev.data) : allocLength;
+		scsiDev.phase = DATA_IN;
+	}
+	else if ((mode == 2) && (offset + allocLength <= sizeof(scsiDev.data)))
+	{
+		// Data only. Start sending from the requested offset.
+		scsiDev.dataPtr = offset;
+		scsiDev.savedDataPtr = offset;
+		scsiDev.dataLen = offset + allocLength;
+		scsiDev.phase = DATA_IN;
+	}
+	else if (mode == 3)
+	{
+		// Descriptor
+		uint32_t maxSize = sizeof(scsiDev.data);
+		scsiDev.data[0] = 0; // Byte offset boundary
+		scsiDev.data[1] = (maxSize >> 16) & 0xff;
+		scsiDev.data[2] = (maxSize >> 8) & 0xff;
+		scsiDev.data[3] = maxSize & 0xff;
+
+		scsiDev.dataLen = (allocLength > 4) ? 4 : allocLength;
 		scsiDev.phase = DATA_IN;
 	}
 	else
@@ -194,9 +544,14 @@ void scsiWriteBuffer()
 {
 	// WRITE BUFFER
 	// Used for testing the speed of the SCSI interface.
-	uint8 mode = scsiDev.data[1] & 7;
+	uint8 mode = scsiDev.cdb[1] & 7;
 
-	int allocLength =
+	uint32 offset =
+		(((uint32) scsiDev.cdb[3]) << 16) +
+		(((uint32) scsiDev.cdb[4]) << 8) +
+		scsiDev.cdb[5];
+
+	uint32 allocLength =
 		(((uint32) scsiDev.cdb[6]) << 16) +
 		(((uint32) scsiDev.cdb[7]) << 8) +
 		scsiDev.cdb[8];
@@ -207,6 +562,15 @@ void scsiWriteBuffer()
 		scsiDev.phase = DATA_OUT;
 		scsiDev.postDataOutHook = doWriteBuffer;
 	}
+	else if ((mode == 2) && (offset + allocLength <= sizeof(scsiDev.data)))
+	{
+		// Data only, stored at the requested offset.
+		scsiDev.dataPtr = offset;
+		scsiDev.savedDataPtr = offset;
+		scsiDev.dataLen = offset + allocLength;
+		scsiDev.phase = DATA_OUT;
+		scsiDev.postDataOutHook = doWriteBuffer;
+	}
 	else
 	{
 		// error.
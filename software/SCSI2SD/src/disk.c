@@ -26,6 +26,7 @@
 #include "debug.h"
 #include "disk.h"
 #include "sd.h"
+#include "crc16.h"
 #include "time.h"
 
 #include <string.h>
@@ -33,6 +34,32 @@
 // Global
 BlockDevice blockDev;
 Transfer transfer;
+ReadAhead readAhead;
+WriteCache writeCache;
+EraseQueue eraseQueue;
+PatternFill formatFill;
+BlockCache blockCache;
+
+static uint8_t cacheData[BLOCK_CACHE_SECTORS][SD_SECTOR_SIZE]
+	__attribute__((aligned(4)));
+
+// Pattern for formatFill. scsiDev.data is reused by other commands.
+static uint8_t formatPattern[SD_SECTOR_SIZE];
+
+// WRITE SAME range, waiting for the data out phase.
+static uint32 writeSameLBA;
+static uint32 writeSameBlocks;
+
+static void doPatternFill(uint64 lba, uint64 blocks, uint8_t* image, int immed);
+static void cacheInvalidate(uint32 sdLBA, uint32 sdEnd);
+
+// True if the current target's SCSI sectors are packed, and don't all start
+// on an SD sector boundary.
+static int isPacked(void)
+{
+	return scsiDev.target->liveCfg.packed &&
+		(scsiDev.target->liveCfg.bytesPerSector % SD_SECTOR_SIZE);
+}
 
 static int doSdInit()
 {
@@ -49,40 +76,128 @@ static int doSdInit()
 	return result;
 }
 
+// Erasing the SD card is the closest we get to writing the initialisation
+// pattern.
+static void doFormatUnitErase(void)
+{
+	if (scsiDev.target->cfg->flags2 & CONFIG_ENABLE_FORMAT_ERASE)
+	{
+		scsiDiskErase(
+			0,
+			getScsiCapacity(
+				scsiDev.target->liveCfg.sdSectorStart,
+				scsiDev.target->liveCfg.bytesPerSector,
+				scsiDev.target->liveCfg.packed,
+				scsiDev.target->liveCfg.scsiSectors));
+	}
+}
+
 // Callback once all data has been read in the data out phase.
 static void doFormatUnitComplete(void)
 {
-	// TODO start writing the initialisation pattern to the SD
-	// card
+	doFormatUnitErase();
 	scsiDev.phase = STATUS;
 }
 
 static void doFormatUnitSkipData(int bytes)
 {
-	// We may not have enough memory to store the initialisation pattern and
-	// defect list data.  Since we're not making use of it yet anyway, just
-	// discard the bytes.
+	// We may not have enough memory to store the defect list data.  Since
+	// we're not making use of it anyway, read it into the second half of the
+	// buffer and discard it.
 	scsiEnterPhase(DATA_OUT);
-	int i;
-	for (i = 0; i < bytes; ++i)
+	while (bytes > 0)
 	{
-		scsiReadByte();
+		int len = bytes < MAX_SECTOR_SIZE ? bytes : MAX_SECTOR_SIZE;
+		scsiRead(&scsiDev.data[MAX_SECTOR_SIZE], len);
+		scsiDev.cmdDataBytes += len;
+		bytes -= len;
 	}
 }
 
 // Callback from the data out phase.
 static void doFormatUnitPatternHeader(void)
 {
+	int immed = scsiDev.data[1] & 0x02;
 	int defectLength =
 		((((uint16_t)scsiDev.data[2])) << 8) +
 			scsiDev.data[3];
 
+	int ipModifier = scsiDev.data[4] >> 6;
+	int patternType = scsiDev.data[4 + 1];
 	int patternLength =
 		((((uint16_t)scsiDev.data[4 + 2])) << 8) +
 		scsiDev.data[4 + 3];
 
-		doFormatUnitSkipData(defectLength + patternLength);
-		doFormatUnitComplete();
+	// Keep the pattern in the first half of the buffer.
+	int keep = patternLength < MAX_SECTOR_SIZE ? patternLength : MAX_SECTOR_SIZE;
+	scsiEnterPhase(DATA_OUT);
+	if (keep > 0)
+	{
+		scsiRead(scsiDev.data, keep);
+		scsiDev.cmdDataBytes += keep;
+	}
+	doFormatUnitSkipData(patternLength - keep + defectLength);
+
+	if ((ipModifier != 0) || (patternType > 1))
+	{
+		// We can't write the LBA into each block.
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = ILLEGAL_REQUEST;
+		scsiDev.target->sense.asc = INVALID_FIELD_IN_PARAMETER_LIST;
+		scsiDev.phase = STATUS;
+		return;
+	}
+
+	if ((patternType == 0) || (keep == 0))
+	{
+		// Default pattern.
+		scsiDev.data[0] = 0;
+		keep = 1;
+	}
+
+	// Repeat the pattern to fill one block, in the second half of the buffer.
+	uint16_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+	uint8_t* image = &scsiDev.data[MAX_SECTOR_SIZE];
+	int i;
+	if (unlikely(isPacked()))
+	{
+		// Packed blocks don't line up with SD sectors, so we can only fill
+		// with a single repeated byte.
+		for (i = 1; i < keep; ++i)
+		{
+			if (scsiDev.data[i] != scsiDev.data[0])
+			{
+				scsiDev.status = CHECK_CONDITION;
+				scsiDev.target->sense.code = ILLEGAL_REQUEST;
+				scsiDev.target->sense.asc = INVALID_FIELD_IN_PARAMETER_LIST;
+				scsiDev.phase = STATUS;
+				return;
+			}
+		}
+		memset(image, scsiDev.data[0], SD_SECTOR_SIZE);
+	}
+	else
+	{
+		for (i = 0; i < bytesPerSector; ++i)
+		{
+			image[i] = scsiDev.data[i % keep];
+		}
+		memset(image + bytesPerSector,
+			0,
+			SDSectorsPerSCSISector(bytesPerSector) * SD_SECTOR_SIZE - bytesPerSector);
+	}
+
+	// Writing the pattern replaces the erase.
+	doPatternFill(
+		0,
+		getScsiCapacity(
+			scsiDev.target->liveCfg.sdSectorStart,
+			bytesPerSector,
+			scsiDev.target->liveCfg.packed,
+			scsiDev.target->liveCfg.scsiSectors),
+		image,
+		immed);
+	scsiDev.phase = STATUS;
 }
 
 // Callback from the data out phase.
@@ -96,7 +211,10 @@ static void doFormatUnitHeader(void)
 		// Save the "MODE SELECT savable parameters"
 		configSave(
 			scsiDev.target->targetId,
-			scsiDev.target->liveCfg.bytesPerSector);
+			scsiDev.target->lun,
+			scsiDev.target->liveCfg.bytesPerSector,
+			(scsiDev.target->liveCfg.flags & CONFIG_ENABLE_WRITE_CACHE) ?
+				1 : 0);
 	}
 
 	if (IP)
@@ -125,10 +243,11 @@ static void doReadCapacity()
 		scsiDev.cdb[5];
 	int pmi = scsiDev.cdb[8] & 1;
 
-	uint32_t capacity = getScsiCapacity(
-		scsiDev.target->cfg->sdSectorStart,
+	uint64_t capacity = getScsiCapacity(
+		scsiDev.target->liveCfg.sdSectorStart,
 		scsiDev.target->liveCfg.bytesPerSector,
-		scsiDev.target->cfg->scsiSectors);
+		scsiDev.target->liveCfg.packed,
+		scsiDev.target->liveCfg.scsiSectors);
 
 	if (!pmi && lba)
 	{
@@ -143,7 +262,9 @@ static void doReadCapacity()
 	}
 	else if (capacity > 0)
 	{
-		uint32_t highestBlock = capacity - 1;
+		// Too big for 32 bits. The host has to use READ CAPACITY(16).
+		uint32_t highestBlock =
+			(capacity - 1 > 0xFFFFFFFF) ? 0xFFFFFFFF : capacity - 1;
 
 		scsiDev.data[0] = highestBlock >> 24;
 		scsiDev.data[1] = highestBlock >> 16;
@@ -167,24 +288,802 @@ static void doReadCapacity()
 	}
 }
 
-static void doWrite(uint32 lba, uint32 blocks)
+// READ CAPACITY(16). SD sector addresses are only 32 bits, so the upper half
+// of the returned LBA is only used by packed sectors smaller than an SD
+// sector, but SCSI-3 hosts ask for it anyway.
+static void doReadCapacity16()
 {
-	if (unlikely(blockDev.state & DISK_WP) ||
-		unlikely(scsiDev.target->cfg->deviceType == CONFIG_OPTICAL))
+	uint32_t lbaHigh = (((uint32) scsiDev.cdb[2]) << 24) +
+		(((uint32) scsiDev.cdb[3]) << 16) +
+		(((uint32) scsiDev.cdb[4]) << 8) +
+		scsiDev.cdb[5];
+	uint32_t lbaLow = (((uint32) scsiDev.cdb[6]) << 24) +
+		(((uint32) scsiDev.cdb[7]) << 16) +
+		(((uint32) scsiDev.cdb[8]) << 8) +
+		scsiDev.cdb[9];
+	uint32_t allocLength = (((uint32) scsiDev.cdb[10]) << 24) +
+		(((uint32) scsiDev.cdb[11]) << 16) +
+		(((uint32) scsiDev.cdb[12]) << 8) +
+		scsiDev.cdb[13];
+	int pmi = scsiDev.cdb[14] & 1;
+
+	uint64_t capacity = getScsiCapacity(
+		scsiDev.target->liveCfg.sdSectorStart,
+		scsiDev.target->liveCfg.bytesPerSector,
+		scsiDev.target->liveCfg.packed,
+		scsiDev.target->liveCfg.scsiSectors);
 
+	if (!pmi && (lbaHigh || lbaLow))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = ILLEGAL_REQUEST;
+		scsiDev.target->sense.asc = INVALID_FIELD_IN_CDB;
+		scsiDev.phase = STATUS;
+	}
+	else if (capacity > 0)
+	{
+		uint64_t highestBlock = capacity - 1;
+		memset(scsiDev.data, 0, 32);
+		scsiDev.data[0] = highestBlock >> 56;
+		scsiDev.data[1] = highestBlock >> 48;
+		scsiDev.data[2] = highestBlock >> 40;
+		scsiDev.data[3] = highestBlock >> 32;
+		scsiDev.data[4] = highestBlock >> 24;
+		scsiDev.data[5] = highestBlock >> 16;
+		scsiDev.data[6] = highestBlock >> 8;
+		scsiDev.data[7] = highestBlock;
+
+		uint32_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+		scsiDev.data[8] = bytesPerSector >> 24;
+		scsiDev.data[9] = bytesPerSector >> 16;
+		scsiDev.data[10] = bytesPerSector >> 8;
+		scsiDev.data[11] = bytesPerSector;
+		// No protection information, one logical block per physical block,
+		// and no thin provisioning.
+
+		scsiDev.dataLen = allocLength < 32 ? allocLength : 32;
+		scsiDev.phase = DATA_IN;
+	}
+	else
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = NOT_READY;
+		scsiDev.target->sense.asc = MEDIUM_NOT_PRESENT;
+		scsiDev.phase = STATUS;
+	}
+}
+
+// Decode the 64 bit LBA of a 16 byte CDB. Packed sectors smaller than an SD
+// sector can need more than 32 bits. See getScsiCapacity.
+static uint64 getLBA16()
+{
+	return
+		(((uint64) scsiDev.cdb[2]) << 56) +
+		(((uint64) scsiDev.cdb[3]) << 48) +
+		(((uint64) scsiDev.cdb[4]) << 40) +
+		(((uint64) scsiDev.cdb[5]) << 32) +
+		(((uint32) scsiDev.cdb[6]) << 24) +
+		(((uint32) scsiDev.cdb[7]) << 16) +
+		(((uint32) scsiDev.cdb[8]) << 8) +
+		scsiDev.cdb[9];
+}
+
+static void doErasePoll()
+{
+	int result = sdErasePoll();
+	if (result > 0)
+	{
+		eraseQueue.sdLBA += eraseQueue.chunkBlocks;
+		eraseQueue.chunkBlocks = 0;
+		eraseQueue.active = eraseQueue.sdLBA < eraseQueue.sdEnd;
+	}
+	else if (unlikely(result < 0))
+	{
+		// The host has already been given GOOD status.
+		TargetState* owner = &scsiDev.targets[eraseQueue.targetIndex];
+		ScsiSense* deferredSense = (owner->lun == eraseQueue.lun) ?
+			&owner->deferredSense :
+			&owner->luns[eraseQueue.lun].deferredSense;
+		deferredSense->code = MEDIUM_ERROR;
+		deferredSense->asc = ERASE_FAILURE;
+		eraseQueue.chunkBlocks = 0;
+		eraseQueue.active = 0;
+	}
+}
+
+// Erase queued sectors, one allocation unit at a time, until the sector
+// before sdUntil has been erased. Unless flushing, returns as soon as we're
+// selected.
+static void doErase(uint32 sdUntil, int flush)
+{
+	if (unlikely(!(blockDev.state & DISK_INITIALISED)))
+	{
+		// The card has been removed.
+		eraseQueue.active = 0;
+		return;
+	}
+
+	while (eraseQueue.active &&
+		(eraseQueue.sdLBA < sdUntil) &&
+		(flush ||
+			(likely(!scsiDev.resetFlag) && !SCSI_ReadFilt(SCSI_Filt_SEL))))
+	{
+		if (!eraseQueue.chunkBlocks)
+		{
+			uint64 auEnd =
+				((uint64) (eraseQueue.sdLBA / sdDev.auSectors) + 1) *
+					sdDev.auSectors;
+			uint32 end = auEnd < eraseQueue.sdEnd ?
+				auEnd : eraseQueue.sdEnd;
+			eraseQueue.chunkBlocks = end - eraseQueue.sdLBA;
+			sdEraseStart(eraseQueue.sdLBA, eraseQueue.chunkBlocks);
+		}
+		doErasePoll();
+	}
+
+	if (eraseQueue.chunkBlocks && sdEraseCancel())
+	{
+		// The card was still busy with the previous chunk. Start this one
+		// again next time.
+		eraseQueue.chunkBlocks = 0;
+	}
+
+	// Otherwise CMD32, CMD33 or CMD38 is outstanding. The rest of the
+	// sequence only takes a few microseconds.
+	while (eraseQueue.chunkBlocks)
+	{
+		doErasePoll();
+	}
+}
+
+// Erase any queued sectors in the SCSI block range before it's read or
+// written.
+static void doEraseBefore(uint64 lba, uint64 blocks)
+{
+	uint32 sdLBA =
+		SCSISector2SD(
+			scsiDev.target->liveCfg.sdSectorStart,
+			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->liveCfg.packed,
+			lba);
+	uint32 sdBlocks =
+		SCSIBlocks2SD(
+			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->liveCfg.packed,
+			lba,
+			blocks);
+
+	if (unlikely(eraseQueue.active) &&
+		(sdLBA < eraseQueue.sdEnd) &&
+		(sdLBA + sdBlocks > eraseQueue.sdLBA))
+	{
+		// The card can't erase with a multi-block transfer open.
+		scsiDiskReadAheadStop();
+		scsiDiskWriteCacheFlush();
+		doErase(sdLBA + sdBlocks, 1);
+	}
+}
+
+// Write the pattern to the rest of the fill range, one SD sector at a time
+// from the same buffer. Unless flushing, returns as soon as we're selected.
+// Errors from a background fill are reported by the next command, otherwise
+// they're reported by this one.
+static void doFill(PatternFill* fill, int flush)
+{
+	if (unlikely(!(blockDev.state & DISK_INITIALISED)))
+	{
+		// The card has been removed.
+		fill->active = 0;
+		return;
+	}
+	if (fill->sdLBA >= fill->sdEnd)
+	{
+		fill->active = 0;
+		return;
+	}
+
+	// See doWriteCache.
+	TargetState* target = scsiDev.target;
+	int phase = scsiDev.phase;
+	uint8 status = scsiDev.status;
+	TargetState* owner = &scsiDev.targets[fill->targetIndex];
+	ScsiSense sense = owner->sense;
+
+	scsiDev.target = owner;
+	scsiDev.status = GOOD;
+	transfer.dir = TRANSFER_WRITE;
+
+	sdWriteMultiSectorStart(fill->sdLBA, fill->sdEnd - fill->sdLBA);
+	while (!sdMultiSectorPrepPoll() && likely(scsiDev.status == GOOD)) {}
+
+	int dmaActive = 0;
+	while (likely(scsiDev.status == GOOD) &&
+		(dmaActive ||
+			((fill->sdLBA < fill->sdEnd) &&
+				(fill->active || likely(!scsiDev.resetFlag)) &&
+				(flush ||
+					(likely(!scsiDev.resetFlag) &&
+						!SCSI_ReadFilt(SCSI_Filt_SEL))))))
+	{
+		if (dmaActive)
+		{
+			if (sdDMABusy())
+			{
+				// Woken by the DMA complete or SEL interrupts.
+				__WFI();
+			}
+			else if (sdWriteSectorDMAPoll(0))
+			{
+				dmaActive = 0;
+				fill->sdLBA++;
+			}
+		}
+		else
+		{
+			int slot = (fill->sdLBA - fill->sdStart) % fill->patternSectors;
+			sdWriteMultiSectorDMA(&fill->pattern[SD_SECTOR_SIZE * slot]);
+			dmaActive = 1;
+		}
+	}
+
+	// Close the write even if we're coming back for more, so the card is
+	// free for other targets.
+	if (likely(scsiDev.status == GOOD) && unlikely(sdCompleteCachedWrite()))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		owner->sense.code = HARDWARE_ERROR;
+		owner->sense.asc = WRITE_ERROR_AUTO_REALLOCATION_FAILED;
+	}
+	transfer.inProgress = 0;
+
+	if (fill->active)
+	{
+		if (unlikely(scsiDev.status != GOOD))
+		{
+			// The host has already been given GOOD status.
+			owner->deferredSense = owner->sense;
+			fill->sdLBA = fill->sdEnd;
+		}
+		fill->active = fill->sdLBA < fill->sdEnd;
+
+		owner->sense = sense;
+		scsiDev.phase = phase;
+		scsiDev.status = status;
+	}
+	scsiDev.target = target;
+}
+
+// Write the image of one SCSI block to each block in the range. If immed is
+// set and the image is one repeated SD sector, the blocks are written by
+// scsiDiskPoll instead.
+// Packed blocks are written a whole SD sector at a time, so image must be one
+// repeated SD sector and the range must be the whole medium.
+static void doPatternFill(uint64 lba, uint64 blocks, uint8_t* image, int immed)
+{
+	const int sdPerScsi = isPacked() ? 1 :
+		SDSectorsPerSCSISector(scsiDev.target->liveCfg.bytesPerSector);
+
+	PatternFill fill;
+	fill.active = 0;
+	fill.targetIndex = scsiDev.target - scsiDev.targets;
+	fill.pattern = image;
+	fill.patternSectors = 1;
+	fill.sdStart =
+		SCSISector2SD(
+			scsiDev.target->liveCfg.sdSectorStart,
+			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->liveCfg.packed,
+			lba);
+	fill.sdLBA = fill.sdStart;
+	fill.sdEnd = fill.sdStart +
+		SCSIBlocks2SD(
+			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->liveCfg.packed,
+			lba,
+			blocks);
+
+	int i;
+	for (i = 1; i < sdPerScsi; ++i)
+	{
+		if (memcmp(image, image + SD_SECTOR_SIZE * i, SD_SECTOR_SIZE))
+		{
+			fill.patternSectors = sdPerScsi;
+			break;
+		}
+	}
+
+	doEraseBefore(lba, blocks);
+	cacheInvalidate(fill.sdStart, fill.sdEnd);
+
+	if (immed && (fill.patternSectors == 1))
+	{
+		if (formatFill.active)
+		{
+			// Only one background fill at a time.
+			doFill(&formatFill, 1);
+		}
+		memcpy(formatPattern, image, SD_SECTOR_SIZE);
+		fill.pattern = formatPattern;
+		fill.active = 1;
+		formatFill = fill;
+	}
+	else
+	{
+		doFill(&fill, 1);
+	}
+}
+
+// Callback once the WRITE SAME block has been received.
+static void doWriteSameData(void)
+{
+	uint16_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+	memset(&scsiDev.data[bytesPerSector],
+		0,
+		SDSectorsPerSCSISector(bytesPerSector) * SD_SECTOR_SIZE - bytesPerSector);
+
+	doPatternFill(writeSameLBA, writeSameBlocks, scsiDev.data, 0);
+	scsiDev.phase = STATUS;
+}
+
+static void doWriteSame(uint32 lba, uint32 blocks)
+{
+	uint64_t capacity = getScsiCapacity(
+		scsiDev.target->liveCfg.sdSectorStart,
+		scsiDev.target->liveCfg.bytesPerSector,
+		scsiDev.target->liveCfg.packed,
+		scsiDev.target->liveCfg.scsiSectors);
+
+	if ((scsiDev.cdb[1] & 0x06) || unlikely(isPacked()))
+	{
+		// PBDATA and LBDATA. We can't write the address into each block.
+		// Packed blocks share SD sectors with their neighbours, so they
+		// can't be written from a single SD sector image either.
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = ILLEGAL_REQUEST;
+		scsiDev.target->sense.asc = INVALID_FIELD_IN_CDB;
+		scsiDev.phase = STATUS;
+	}
+	else if (unlikely(blockDev.state & DISK_WP) ||
+		unlikely(scsiDev.target->liveCfg.deviceType == CONFIG_OPTICAL))
 	{
 		scsiDev.status = CHECK_CONDITION;
 		scsiDev.target->sense.code = ILLEGAL_REQUEST;
 		scsiDev.target->sense.asc = WRITE_PROTECTED;
 		scsiDev.phase = STATUS;
 	}
-	else if (unlikely(((uint64) lba) + blocks >
-		getScsiCapacity(
-			scsiDev.target->cfg->sdSectorStart,
+	else if (unlikely(((uint64) lba) + blocks > capacity) ||
+		unlikely(lba >= capacity))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = ILLEGAL_REQUEST;
+		scsiDev.target->sense.asc = LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+		scsiDev.phase = STATUS;
+	}
+	else
+	{
+		// The UNMAP bit is allowed, but we always write the data.
+		// A block count of 0 means to the end of the medium.
+		writeSameLBA = lba;
+		writeSameBlocks = blocks ? blocks : capacity - lba;
+		scsiDev.dataLen = scsiDev.target->liveCfg.bytesPerSector;
+		scsiDev.phase = DATA_OUT;
+		scsiDev.postDataOutHook = doWriteSameData;
+	}
+}
+
+// Number of bytes the host sends for SD sector "sector" of a transfer of
+// blocks starting at lba. They start at *offset into the SD sector.
+static int sdSectorBytes(uint64 lba, uint32 blocks, uint32 sector, int* offset)
+{
+	uint16_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+	int bytes = SD_SECTOR_SIZE;
+	*offset = 0;
+	if (unlikely(isPacked()))
+	{
+		// Only the first and last SD sectors are shared with other blocks.
+		int end = SCSISectorOffset(bytesPerSector, 1, lba + blocks);
+		if (sector == 0)
+		{
+			*offset = SCSISectorOffset(bytesPerSector, 1, lba);
+		}
+		if (end &&
+			(sector == SCSIBlocks2SD(bytesPerSector, 1, lba, blocks) - 1))
+		{
+			bytes = end;
+		}
+		bytes -= *offset;
+	}
+	else
+	{
+		uint32 sdPerScsi = SDSectorsPerSCSISector(bytesPerSector);
+		if ((sector % sdPerScsi) == (sdPerScsi - 1))
+		{
+			bytes = bytesPerSector % SD_SECTOR_SIZE;
+			if (bytes == 0) bytes = SD_SECTOR_SIZE;
+		}
+	}
+	return bytes;
+}
+
+static int cacheFind(uint32 sdLBA)
+{
+	int i;
+	for (i = 0; i < BLOCK_CACHE_SECTORS; ++i)
+	{
+		if (blockCache.entries[i].valid &&
+			(blockCache.entries[i].sdLBA == sdLBA))
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Find an entry for the current target to load a sector into. Entries used
+// since minUse are kept. Returns -1 if the cache is full. Use counts are
+// compared by their signed difference, so they can wrap.
+static int cacheAlloc(uint32 minUse)
+{
+	int targetIndex = scsiDev.target - scsiDev.targets;
+	int owned = 0;
+	int i;
+	for (i = 0; i < BLOCK_CACHE_SECTORS; ++i)
+	{
+		if (blockCache.entries[i].valid &&
+			(blockCache.entries[i].targetIndex == targetIndex))
+		{
+			++owned;
+		}
+	}
+
+	// Below its limit, a target may replace anyone's entries. Otherwise
+	// only its own.
+	int ownOnly = owned >= scsiDiskCacheSectors(scsiDev.target->cfg);
+	int best = -1;
+	for (i = 0; i < BLOCK_CACHE_SECTORS; ++i)
+	{
+		const CacheEntry* entry = &blockCache.entries[i];
+		if (!entry->valid)
+		{
+			if (!ownOnly) return i;
+		}
+		else if (!entry->pinned &&
+			((int32_t) (entry->lastUse - minUse) < 0) &&
+			(!ownOnly || (entry->targetIndex == targetIndex)) &&
+			((best < 0) ||
+				((int32_t)
+					(entry->lastUse - blockCache.entries[best].lastUse) < 0)))
+		{
+			best = i;
+		}
+	}
+	return best;
+}
+
+// Read one SD sector while no multi-block transfer is open. Sets CHECK
+// CONDITION on errors.
+static int readSector(uint32 sdLBA, uint8_t* buffer)
+{
+	const int checkCRC =
+		scsiDev.target->cfg->flags & CONFIG_ENABLE_SD_CRC;
+	int retries = 0;
+	while (1)
+	{
+		if (!sdReadSingleSectorPrep(sdLBA))
+		{
+			return 0;
+		}
+
+		uint32_t tokenStart = getTime_ms();
+		int started = 0;
+		while (!started &&
+			(elapsedTime_ms(tokenStart) <= SD_READ_TOKEN_TIMEOUT_MS))
+		{
+			started = sdReadSectorDMAStart(buffer);
+		}
+		if (unlikely(started <= 0))
+		{
+			sdReadSectorError();
+			return 0;
+		}
+		while (!sdReadSectorDMAPoll()) {}
+
+		if (likely(!checkCRC) ||
+			likely(crc16(buffer, SD_SECTOR_SIZE) == sdReadSectorCRC()))
+		{
+			return 1;
+		}
+		else if (++retries > SD_CRC_RETRIES)
+		{
+			sdReadSectorError();
+			return 0;
+		}
+	}
+}
+
+// Load the SCSI blocks into the cache, optionally pinning them. Returns 1
+// if they are all cached.
+static int cacheLoad(uint64 lba, uint32 blocks, int pin)
+{
+	uint32 sdLBA =
+		SCSISector2SD(
+			scsiDev.target->liveCfg.sdSectorStart,
 			scsiDev.target->liveCfg.bytesPerSector,
-			scsiDev.target->cfg->scsiSectors
-			)
-		))
+			scsiDev.target->liveCfg.packed,
+			lba);
+	uint32 sdBlocks =
+		SCSIBlocks2SD(
+			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->liveCfg.packed,
+			lba,
+			blocks);
+	if (sdBlocks > BLOCK_CACHE_SECTORS)
+	{
+		return 0;
+	}
+
+	// Sectors of this range mustn't replace each other.
+	uint32 minUse = blockCache.useCount + 1;
+
+	// The SD card is free. READ is the only command that leaves the
+	// read-ahead stream open, and it doesn't come here.
+	transfer.multiBlock = 0;
+
+	uint32 i;
+	for (i = 0; i < sdBlocks; ++i)
+	{
+		int entry = cacheFind(sdLBA + i);
+		if (entry < 0)
+		{
+			entry = cacheAlloc(minUse);
+			if (entry < 0)
+			{
+				return 0;
+			}
+			if (blockCache.entries[entry].valid)
+			{
+				blockCache.entries[entry].valid = 0;
+				blockCache.used--;
+			}
+			if (!readSector(sdLBA + i, cacheData[entry]))
+			{
+				return 0;
+			}
+			blockCache.entries[entry].valid = 1;
+			blockCache.used++;
+			blockCache.entries[entry].pinned = 0;
+			blockCache.entries[entry].sdLBA = sdLBA + i;
+			blockCache.entries[entry].targetIndex =
+				scsiDev.target - scsiDev.targets;
+		}
+		blockCache.entries[entry].lastUse = ++blockCache.useCount;
+		blockCache.entries[entry].pinned |= pin;
+	}
+	return 1;
+}
+
+// Drop any cached copies of SD sectors from sdLBA up to sdEnd.
+static void cacheInvalidate(uint32 sdLBA, uint32 sdEnd)
+{
+	int i;
+	for (i = 0; i < BLOCK_CACHE_SECTORS; ++i)
+	{
+		CacheEntry* entry = &blockCache.entries[i];
+		if (entry->valid &&
+			(entry->sdLBA >= sdLBA) &&
+			(entry->sdLBA < sdEnd))
+		{
+			entry->valid = 0;
+			entry->pinned = 0;
+			blockCache.used--;
+		}
+	}
+}
+
+// Keep a cached copy up to date with a sector written by the host.
+static void cacheUpdate(uint32 sdLBA, const uint8_t* data)
+{
+	int entry = cacheFind(sdLBA);
+	if (entry >= 0)
+	{
+		memcpy(cacheData[entry], data, SD_SECTOR_SIZE);
+	}
+}
+
+// Send a READ straight from the cache if every sector is there.
+static int doReadCached(uint64 lba, uint32 blocks)
+{
+	uint32 sdLBA =
+		SCSISector2SD(
+			scsiDev.target->liveCfg.sdSectorStart,
+			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->liveCfg.packed,
+			lba);
+	uint32 sdBlocks =
+		SCSIBlocks2SD(
+			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->liveCfg.packed,
+			lba,
+			blocks);
+	if ((sdBlocks == 0) || (sdBlocks > BLOCK_CACHE_SECTORS))
+	{
+		return 0;
+	}
+
+	int entries[BLOCK_CACHE_SECTORS];
+	uint32 i;
+	for (i = 0; i < sdBlocks; ++i)
+	{
+		entries[i] = cacheFind(sdLBA + i);
+		if (entries[i] < 0)
+		{
+			return 0;
+		}
+	}
+
+	scsiEnterPhase(DATA_IN);
+	for (i = 0; (i < sdBlocks) && likely(!scsiDev.resetFlag); ++i)
+	{
+		int offset;
+		int bytes = sdSectorBytes(lba, blocks, i, &offset);
+		scsiWrite(cacheData[entries[i]] + offset, bytes);
+		scsiDev.cmdDataBytes += bytes;
+		blockCache.entries[entries[i]].lastUse = ++blockCache.useCount;
+	}
+	scsiDev.phase = STATUS;
+	return 1;
+}
+
+static void doPreFetch(uint32 lba, uint32 blocks)
+{
+	uint64_t capacity = getScsiCapacity(
+		scsiDev.target->liveCfg.sdSectorStart,
+		scsiDev.target->liveCfg.bytesPerSector,
+		scsiDev.target->liveCfg.packed,
+		scsiDev.target->liveCfg.scsiSectors);
+
+	// A block count of 0 means to the end of the medium. Far more than
+	// the cache holds, so it doesn't matter if that's clamped.
+	if ((blocks == 0) && (lba < capacity))
+	{
+		blocks = (capacity - lba > 0xFFFFFFFF) ? 0xFFFFFFFF : capacity - lba;
+	}
+
+	if (unlikely(((uint64) lba) + blocks > capacity))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = ILLEGAL_REQUEST;
+		scsiDev.target->sense.asc = LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+		scsiDev.phase = STATUS;
+	}
+	else if (scsiDiskCacheSectors(scsiDev.target->cfg) > 0)
+	{
+		doEraseBefore(lba, blocks);
+		if (cacheLoad(lba, blocks, 0) && (scsiDev.status == GOOD))
+		{
+			// All of the blocks fit.
+			scsiDev.status = CONDITION_MET;
+			scsiDev.phase = STATUS;
+		}
+	}
+}
+
+static void doLockUnlockCache(uint32 lba, uint32 blocks, int lock)
+{
+	uint64_t capacity = getScsiCapacity(
+		scsiDev.target->liveCfg.sdSectorStart,
+		scsiDev.target->liveCfg.bytesPerSector,
+		scsiDev.target->liveCfg.packed,
+		scsiDev.target->liveCfg.scsiSectors);
+
+	// A block count of 0 means to the end of the medium.
+	if ((blocks == 0) && (lba < capacity))
+	{
+		blocks = (capacity - lba > 0xFFFFFFFF) ? 0xFFFFFFFF : capacity - lba;
+	}
+
+	if (unlikely(((uint64) lba) + blocks > capacity))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = ILLEGAL_REQUEST;
+		scsiDev.target->sense.asc = LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+		scsiDev.phase = STATUS;
+	}
+	else if (lock)
+	{
+		doEraseBefore(lba, blocks);
+		if (!cacheLoad(lba, blocks, 1) && (scsiDev.status == GOOD))
+		{
+			// Blocks already pinned stay pinned.
+			scsiDev.status = CHECK_CONDITION;
+			scsiDev.target->sense.code = ILLEGAL_REQUEST;
+			scsiDev.target->sense.asc = INSUFFICIENT_RESOURCES;
+			scsiDev.phase = STATUS;
+		}
+	}
+	else
+	{
+		// Unpinned blocks stay in the cache until they're replaced.
+		uint32 sdLBA =
+			SCSISector2SD(
+				scsiDev.target->liveCfg.sdSectorStart,
+				scsiDev.target->liveCfg.bytesPerSector,
+				scsiDev.target->liveCfg.packed,
+				lba);
+		uint32 sdEnd = sdLBA +
+			SCSIBlocks2SD(
+				scsiDev.target->liveCfg.bytesPerSector,
+				scsiDev.target->liveCfg.packed,
+				lba,
+				blocks);
+		int i;
+		for (i = 0; i < BLOCK_CACHE_SECTORS; ++i)
+		{
+			CacheEntry* entry = &blockCache.entries[i];
+			if (entry->valid &&
+				(entry->sdLBA >= sdLBA) &&
+				(entry->sdLBA < sdEnd))
+			{
+				entry->pinned = 0;
+			}
+		}
+	}
+}
+
+// A packed WRITE may only replace part of its first and last SD sectors, so
+// they're read before the multi-block write starts. The first goes into ring
+// slot 0, and the host data is received over it. The last is kept in the
+// final ring slot, which packed WRITEs don't otherwise use, until the host
+// data for it has been received. Returns 0 on errors, with CHECK CONDITION
+// set.
+static int doWritePackedPrep(uint64 lba, uint32 blocks)
+{
+	uint16_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+	uint32 sdLBA =
+		SCSISector2SD(
+			scsiDev.target->liveCfg.sdSectorStart,
+			bytesPerSector,
+			1,
+			lba);
+	uint32 sdBlocks = SCSIBlocks2SD(bytesPerSector, 1, lba, blocks);
+	int start = SCSISectorOffset(bytesPerSector, 1, lba);
+	int end = SCSISectorOffset(bytesPerSector, 1, lba + blocks);
+	const int buffers = sizeof(scsiDev.data) / SD_SECTOR_SIZE;
+
+	// The SD card is free. See cacheLoad.
+	transfer.multiBlock = 0;
+
+	int result = 1;
+	if (start || (end && (sdBlocks == 1)))
+	{
+		result = readSector(sdLBA, scsiDev.data);
+	}
+	if (result && end && (sdBlocks > 1))
+	{
+		result = readSector(
+			sdLBA + sdBlocks - 1,
+			&scsiDev.data[SD_SECTOR_SIZE * (buffers - 1)]);
+	}
+	return result;
+}
+
+static void doWrite(uint64 lba, uint32 blocks)
+{
+	uint64_t capacity = getScsiCapacity(
+		scsiDev.target->liveCfg.sdSectorStart,
+		scsiDev.target->liveCfg.bytesPerSector,
+		scsiDev.target->liveCfg.packed,
+		scsiDev.target->liveCfg.scsiSectors);
+	if (unlikely(blockDev.state & DISK_WP) ||
+		unlikely(scsiDev.target->liveCfg.deviceType == CONFIG_OPTICAL))
+
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = ILLEGAL_REQUEST;
+		scsiDev.target->sense.asc = WRITE_PROTECTED;
+		scsiDev.phase = STATUS;
+	}
+	else if (unlikely(lba > capacity) || unlikely(lba + blocks > capacity))
 	{
 		scsiDev.status = CHECK_CONDITION;
 		scsiDev.target->sense.code = ILLEGAL_REQUEST;
@@ -193,6 +1092,41 @@ static void doWrite(uint32 lba, uint32 blocks)
 	}
 	else
 	{
+		// FUA and WRITE AND VERIFY must reach the medium before we return
+		// GOOD status.
+		int forceUnitAccess =
+			(scsiDev.cdb[0] == 0x2E) ||
+			(((scsiDev.cdb[0] == 0x2A) ||
+					(scsiDev.cdb[0] == 0xAA) ||
+					(scsiDev.cdb[0] == 0x8A)) &&
+				(scsiDev.cdb[1] & 0x08));
+		// Packed WRITEs always wait for the card. The next one may need
+		// to read back the last SD sector of this one.
+		const int packed = isPacked();
+		writeCache.writeBack =
+			(scsiDev.target->liveCfg.flags & CONFIG_ENABLE_WRITE_CACHE) &&
+			!forceUnitAccess &&
+			likely(!packed);
+
+		doEraseBefore(lba, blocks);
+
+		int tgtIndex = scsiDev.target - scsiDev.targets;
+		int streaming =
+			(lba == writeCache.lastEnd[tgtIndex]) &&
+			!forceUnitAccess &&
+			likely(!packed);
+		writeCache.lastEnd[tgtIndex] = lba + blocks;
+
+		if (unlikely(packed))
+		{
+			// The card can't read with a multi-block write open.
+			scsiDiskWriteCacheFlush();
+			if (!doWritePackedPrep(lba, blocks))
+			{
+				return; // CHECK CONDITION already set.
+			}
+		}
+
 		transfer.dir = TRANSFER_WRITE;
 		transfer.lba = lba;
 		transfer.blocks = blocks;
@@ -201,21 +1135,136 @@ static void doWrite(uint32 lba, uint32 blocks)
 		scsiDev.dataLen = scsiDev.target->liveCfg.bytesPerSector;
 		scsiDev.dataPtr = scsiDev.target->liveCfg.bytesPerSector;
 
-		// No need for single-block writes atm.  Overhead of the
-		// multi-block write is minimal.
-		transfer.multiBlock = 1;
+		// No need for single-block writes atm.  Overhead of the
+		// multi-block write is minimal.
+		transfer.multiBlock = 1;
+
+		if (writeCache.active &&
+			(writeCache.targetIndex == tgtIndex) &&
+			(writeCache.nextLBA == lba) &&
+			(writeCache.bytesPerSector ==
+				scsiDev.target->liveCfg.bytesPerSector) &&
+			!forceUnitAccess)
+		{
+			// Continue the open multi-block write. scsiDiskPoll takes it
+			// over, along with any sectors that are still buffered.
+			writeCache.hits++;
+		}
+		else
+		{
+			if (writeCache.active)
+			{
+				writeCache.misses++;
+			}
+
+			// The SD card can only have one multi-block write open.
+			scsiDiskWriteCacheFlush();
+			sdWriteMultiSectorPrep();
+		}
+		writeCache.streaming = streaming;
+	}
+}
+
+
+static void doRead(uint64 lba, uint32 blocks)
+{
+	uint64_t capacity = getScsiCapacity(
+		scsiDev.target->liveCfg.sdSectorStart,
+		scsiDev.target->liveCfg.bytesPerSector,
+		scsiDev.target->liveCfg.packed,
+		scsiDev.target->liveCfg.scsiSectors);
+	if (unlikely(lba > capacity) || unlikely(lba + blocks > capacity))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = ILLEGAL_REQUEST;
+		scsiDev.target->sense.asc = LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+		scsiDev.phase = STATUS;
+	}
+	else if (unlikely(blockCache.used) && doReadCached(lba, blocks))
+	{
+		// Sent from the block cache.
+	}
+	else
+	{
+		transfer.dir = TRANSFER_READ;
+		transfer.lba = lba;
+		transfer.blocks = blocks;
+		transfer.currentBlock = 0;
+		scsiDev.phase = DATA_IN;
+		scsiDev.dataLen = 0; // No data yet
+
+		doEraseBefore(lba, blocks);
+
+		// The next packed READ starts part way through the last SD sector
+		// of this one, so there's nothing to read ahead.
+		int tgtIndex = scsiDev.target - scsiDev.targets;
+		readAhead.streaming =
+			(lba == readAhead.lastEnd[tgtIndex]) && likely(!isPacked());
+		readAhead.lastEnd[tgtIndex] = lba + blocks;
+
+		int lastSector = unlikely(lba + blocks == capacity);
+
+		if (readAhead.active &&
+			(readAhead.targetIndex == tgtIndex) &&
+			(readAhead.nextLBA == lba) &&
+			(readAhead.bytesPerSector ==
+				scsiDev.target->liveCfg.bytesPerSector) &&
+			!lastSector)
+		{
+			// Continue the open multi-block read. scsiDiskPoll will pick up
+			// any sectors that have already been buffered.
+			readAhead.active = 0;
+			readAhead.hits++;
+			transfer.multiBlock = 1;
+			transfer.inProgress = 1;
+		}
+		else
+		{
+			if (readAhead.active)
+			{
+				readAhead.misses++;
+			}
+			scsiDiskReadAheadStop();
 
-		sdWriteMultiSectorPrep();
+			uint32_t sdBlocks =
+				SCSIBlocks2SD(
+					scsiDev.target->liveCfg.bytesPerSector,
+					scsiDev.target->liveCfg.packed,
+					lba,
+					blocks);
+			if (lastSector ||
+				((blocks == 1) && !readAhead.streaming))
+			{
+				// We get errors on reading the last sector using an
+				// open-ended multi-sector read :-(
+				// Random single-sector reads don't benefit from
+				// read-ahead either.
+				// A CMD23 read stops at the end by itself, and is still
+				// faster than a CMD17 for each SD sector.
+				transfer.multiBlock = sdDev.cmd23 && (sdBlocks > 1);
+				if (transfer.multiBlock)
+				{
+					sdReadMultiSectorPrep(sdBlocks);
+				}
+			}
+			else
+			{
+				// Leave the read open for the read-ahead engine if the host
+				// is streaming. Otherwise avoid the CMD12.
+				transfer.multiBlock = 1;
+				sdReadMultiSectorPrep(readAhead.streaming ? 0 : sdBlocks);
+			}
+		}
 	}
 }
 
-
-static void doRead(uint32 lba, uint32 blocks)
+static void doVerify(uint32 lba, uint32 blocks)
 {
-	uint32_t capacity = getScsiCapacity(
-		scsiDev.target->cfg->sdSectorStart,
+	uint64_t capacity = getScsiCapacity(
+		scsiDev.target->liveCfg.sdSectorStart,
 		scsiDev.target->liveCfg.bytesPerSector,
-		scsiDev.target->cfg->scsiSectors);
+		scsiDev.target->liveCfg.packed,
+		scsiDev.target->liveCfg.scsiSectors);
 	if (unlikely(((uint64) lba) + blocks > capacity))
 	{
 		scsiDev.status = CHECK_CONDITION;
@@ -223,27 +1272,33 @@ static void doRead(uint32 lba, uint32 blocks)
 		scsiDev.target->sense.asc = LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
 		scsiDev.phase = STATUS;
 	}
-	else
+	else if (blocks > 0)
 	{
-		transfer.dir = TRANSFER_READ;
+		doEraseBefore(lba, blocks);
+
+		// Any cached writes have already been flushed by
+		// scsiDiskCommandPrep.
+		transfer.dir = TRANSFER_VERIFY;
 		transfer.lba = lba;
 		transfer.blocks = blocks;
 		transfer.currentBlock = 0;
-		scsiDev.phase = DATA_IN;
-		scsiDev.dataLen = 0; // No data yet
+		scsiDev.phase = DATA_OUT;
+		scsiDev.dataLen = scsiDev.target->liveCfg.bytesPerSector;
+		scsiDev.dataPtr = scsiDev.target->liveCfg.bytesPerSector;
 
-		if ((blocks == 1) ||
-			unlikely(((uint64) lba) + blocks == capacity)
-			)
-		{
-			// We get errors on reading the last sector using a multi-sector
-			// read :-(
-			transfer.multiBlock = 0;
-		}
-		else
+		// See doRead.
+		uint32_t sdBlocks =
+			SCSIBlocks2SD(
+				scsiDev.target->liveCfg.bytesPerSector,
+				scsiDev.target->liveCfg.packed,
+				lba,
+				blocks);
+		int lastSector = unlikely(((uint64) lba) + blocks == capacity);
+		transfer.multiBlock =
+			!lastSector || (sdDev.cmd23 && (sdBlocks > 1));
+		if (transfer.multiBlock)
 		{
-			transfer.multiBlock = 1;
-			sdReadMultiSectorPrep();
+			sdReadMultiSectorPrep(sdBlocks);
 		}
 	}
 }
@@ -252,9 +1307,10 @@ static void doSeek(uint32 lba)
 {
 	if (lba >=
 		getScsiCapacity(
-			scsiDev.target->cfg->sdSectorStart,
+			scsiDev.target->liveCfg.sdSectorStart,
 			scsiDev.target->liveCfg.bytesPerSector,
-			scsiDev.target->cfg->scsiSectors)
+			scsiDev.target->liveCfg.packed,
+			scsiDev.target->liveCfg.scsiSectors)
 		)
 	{
 		scsiDev.status = CHECK_CONDITION;
@@ -267,7 +1323,9 @@ static void doSeek(uint32 lba)
 static int doTestUnitReady()
 {
 	int ready = 1;
-	if (likely(blockDev.state == (DISK_STARTED | DISK_PRESENT | DISK_INITIALISED)))
+	uint16_t progress;
+	if (likely(blockDev.state == (DISK_STARTED | DISK_PRESENT | DISK_INITIALISED)) &&
+		likely(!formatFill.active))
 	{
 		// nothing to do.
 	}
@@ -295,6 +1353,14 @@ static int doTestUnitReady()
 		scsiDev.target->sense.asc = LOGICAL_UNIT_NOT_READY_CAUSE_NOT_REPORTABLE;
 		scsiDev.phase = STATUS;
 	}
+	else if (scsiDiskFormatProgress(&progress))
+	{
+		ready = 0;
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = NOT_READY;
+		scsiDev.target->sense.asc = LOGICAL_UNIT_NOT_READY_FORMAT_IN_PROGRESS;
+		scsiDev.phase = STATUS;
+	}
 	return ready;
 }
 
@@ -375,7 +1441,7 @@ int scsiDiskCommand()
 	else if (likely(command == 0x2A) || // WRITE(10)
 		unlikely(command == 0x2E)) // WRITE AND VERIFY
 	{
-		// Ignore all cache control bits - we don't support a memory cache.
+		// The FUA bit is handled by doWrite.
 		// Don't bother verifying either. The SD card likely stores ECC
 		// along with each flash row.
 
@@ -390,12 +1456,64 @@ int scsiDiskCommand()
 
 		doWrite(lba, blocks);
 	}
+	else if (unlikely(command == 0xA8))
+	{
+		// READ(12)
+		uint32 lba =
+			(((uint32) scsiDev.cdb[2]) << 24) +
+			(((uint32) scsiDev.cdb[3]) << 16) +
+			(((uint32) scsiDev.cdb[4]) << 8) +
+			scsiDev.cdb[5];
+		uint32 blocks =
+			(((uint32) scsiDev.cdb[6]) << 24) +
+			(((uint32) scsiDev.cdb[7]) << 16) +
+			(((uint32) scsiDev.cdb[8]) << 8) +
+			scsiDev.cdb[9];
+
+		doRead(lba, blocks);
+	}
+	else if (unlikely(command == 0xAA))
+	{
+		// WRITE(12)
+		uint32 lba =
+			(((uint32) scsiDev.cdb[2]) << 24) +
+			(((uint32) scsiDev.cdb[3]) << 16) +
+			(((uint32) scsiDev.cdb[4]) << 8) +
+			scsiDev.cdb[5];
+		uint32 blocks =
+			(((uint32) scsiDev.cdb[6]) << 24) +
+			(((uint32) scsiDev.cdb[7]) << 16) +
+			(((uint32) scsiDev.cdb[8]) << 8) +
+			scsiDev.cdb[9];
+
+		doWrite(lba, blocks);
+	}
+	else if (unlikely(command == 0x88) || // READ(16)
+		unlikely(command == 0x8A)) // WRITE(16)
+	{
+		uint64 lba = getLBA16();
+		uint32 blocks =
+			(((uint32) scsiDev.cdb[10]) << 24) +
+			(((uint32) scsiDev.cdb[11]) << 16) +
+			(((uint32) scsiDev.cdb[12]) << 8) +
+			scsiDev.cdb[13];
+
+		if (command == 0x88)
+		{
+			doRead(lba, blocks);
+		}
+		else
+		{
+			doWrite(lba, blocks);
+		}
+	}
 
 	else if (unlikely(command == 0x04))
 	{
 		// FORMAT UNIT
-		// We don't really do any formatting, but we need to read the correct
-		// number of bytes in the DATA_OUT phase to make the SCSI host happy.
+		// Unless the host supplies an initialisation pattern we don't really
+		// do any formatting, but we need to read the correct number of bytes
+		// in the DATA_OUT phase to make the SCSI host happy.
 
 		int fmtData = (scsiDev.cdb[1] & 0x10) ? 1 : 0;
 		if (fmtData)
@@ -409,6 +1527,7 @@ int scsiDiskCommand()
 		else
 		{
 			// No data to read, we're already finished!
+			doFormatUnitErase();
 		}
 	}
 	else if (unlikely(command == 0x25))
@@ -416,6 +1535,12 @@ int scsiDiskCommand()
 		// READ CAPACITY
 		doReadCapacity();
 	}
+	else if (unlikely(command == 0x9E) &&
+		((scsiDev.cdb[1] & 0x1F) == 0x10))
+	{
+		// SERVICE ACTION IN(16), READ CAPACITY(16)
+		doReadCapacity16();
+	}
 	else if (unlikely(command == 0x0B))
 	{
 		// SEEK(6)
@@ -441,12 +1566,31 @@ int scsiDiskCommand()
 	else if (unlikely(command == 0x36))
 	{
 		// LOCK UNLOCK CACHE
-		// We don't have a cache to lock data into. do nothing.
+		uint32 lba =
+			(((uint32) scsiDev.cdb[2]) << 24) +
+			(((uint32) scsiDev.cdb[3]) << 16) +
+			(((uint32) scsiDev.cdb[4]) << 8) +
+			scsiDev.cdb[5];
+		uint32 blocks =
+			(((uint32) scsiDev.cdb[7]) << 8) +
+			scsiDev.cdb[8];
+
+		doLockUnlockCache(lba, blocks, scsiDev.cdb[1] & 0x02);
 	}
 	else if (unlikely(command == 0x34))
 	{
 		// PRE-FETCH.
-		// We don't have a cache to pre-fetch into. do nothing.
+		// The IMMED bit is ignored. The cache is only a few sectors.
+		uint32 lba =
+			(((uint32) scsiDev.cdb[2]) << 24) +
+			(((uint32) scsiDev.cdb[3]) << 16) +
+			(((uint32) scsiDev.cdb[4]) << 8) +
+			scsiDev.cdb[5];
+		uint32 blocks =
+			(((uint32) scsiDev.cdb[7]) << 8) +
+			scsiDev.cdb[8];
+
+		doPreFetch(lba, blocks);
 	}
 	else if (unlikely(command == 0x1E))
 	{
@@ -454,42 +1598,505 @@ int scsiDiskCommand()
 		// Not much we can do to prevent the user removing the SD card.
 		// do nothing.
 	}
-	else if (unlikely(command == 0x01))
+	else if (unlikely(command == 0x01))
+	{
+		// REZERO UNIT
+		// Set the lun to a vendor-specific state. Ignore.
+	}
+	else if (unlikely(command == 0x41))
+	{
+		// WRITE SAME(10)
+		uint32 lba =
+			(((uint32) scsiDev.cdb[2]) << 24) +
+			(((uint32) scsiDev.cdb[3]) << 16) +
+			(((uint32) scsiDev.cdb[4]) << 8) +
+			scsiDev.cdb[5];
+		uint32 blocks =
+			(((uint32) scsiDev.cdb[7]) << 8) +
+			scsiDev.cdb[8];
+
+		doWriteSame(lba, blocks);
+	}
+	else if (unlikely(command == 0x35))
+	{
+		// SYNCHRONIZE CACHE
+		// The write cache has already been flushed by scsiDiskCommandPrep,
+		// and any write error reported as a deferred error.
+	}
+	else if (unlikely(command == 0x2F))
+	{
+		// VERIFY
+		if ((scsiDev.cdb[1] & 0x02) == 0)
+		{
+			// They are asking us to do a medium verification with no data
+			// comparison. Assume success, do nothing.
+		}
+		else
+		{
+			// BYTCHK. Compare the data they supply against the card.
+			uint32 lba =
+				(((uint32) scsiDev.cdb[2]) << 24) +
+				(((uint32) scsiDev.cdb[3]) << 16) +
+				(((uint32) scsiDev.cdb[4]) << 8) +
+				scsiDev.cdb[5];
+			uint32 blocks =
+				(((uint32) scsiDev.cdb[7]) << 8) +
+				scsiDev.cdb[8];
+
+			doVerify(lba, blocks);
+		}
+	}
+	else
+	{
+		commandHandled = 0;
+	}
+
+	return commandHandled;
+}
+
+// Stop the read-ahead engine if a buffered sector fails its CRC check. The
+// next READ will fetch it again.
+static void doReadAheadCheckCRC(int slot, uint16_t crc)
+{
+	if (unlikely(crc16(&scsiDev.data[SD_SECTOR_SIZE * slot], SD_SECTOR_SIZE) != crc))
+	{
+		scsiDiskReadAheadStop();
+	}
+}
+
+// Keep the card streaming into the data ring while the bus is free.
+// Returns as soon as we're selected, or once there's data for a queued
+// command.
+static void doReadAhead()
+{
+	int buffers = sizeof(scsiDev.data) / SD_SECTOR_SIZE;
+	uint32_t tokenStart = getTime_ms();
+
+	// Sector waiting for its CRC check, which is done once the next sector
+	// transfer has started.
+	const int checkCRC =
+		scsiDev.targets[readAhead.targetIndex].cfg->flags & CONFIG_ENABLE_SD_CRC;
+	int checkSlot = -1;
+	uint16_t sdCRC = 0;
+
+	while (readAhead.active &&
+		likely(!scsiDev.resetFlag) &&
+		!SCSI_ReadFilt(SCSI_Filt_SEL) &&
+		!(scsiDev.queueLen && readAhead.buffered))
+	{
+		if (readAhead.dmaActive)
+		{
+			if (sdDMABusy())
+			{
+				// Woken by the DMA complete or SEL interrupts.
+				__WFI();
+			}
+			else if (sdReadSectorDMAPoll())
+			{
+				if (unlikely(checkCRC))
+				{
+					checkSlot = (readAhead.start + readAhead.buffered) % buffers;
+					sdCRC = sdReadSectorCRC();
+				}
+				readAhead.dmaActive = 0;
+				readAhead.buffered++;
+				tokenStart = getTime_ms();
+			}
+		}
+		else if ((readAhead.buffered < buffers) &&
+			(readAhead.sdLBA < readAhead.sdEnd))
+		{
+			int slot = (readAhead.start + readAhead.buffered) % buffers;
+			int started =
+				sdReadSectorDMAStart(&scsiDev.data[SD_SECTOR_SIZE * slot]);
+			if (started > 0)
+			{
+				readAhead.dmaActive = 1;
+				readAhead.sdLBA++;
+				if (unlikely(checkSlot >= 0))
+				{
+					doReadAheadCheckCRC(checkSlot, sdCRC);
+					checkSlot = -1;
+				}
+			}
+			else if (unlikely(started < 0) ||
+				unlikely(elapsedTime_ms(tokenStart) > SD_READ_TOKEN_TIMEOUT_MS))
+			{
+				// Error token, or the card has stopped responding.
+				scsiDiskReadAheadStop();
+			}
+		}
+		else
+		{
+			// Ring is full, or we've reached the end of the device.
+			break;
+		}
+	}
+
+	// Nothing else to overlap it with.
+	if (unlikely(checkSlot >= 0) && readAhead.active)
+	{
+		doReadAheadCheckCRC(checkSlot, sdCRC);
+	}
+
+	if (readAhead.active &&
+		!SCSI_ReadFilt(SCSI_Filt_SEL) &&
+		unlikely(elapsedTime_ms(readAhead.lastActivity) > 100))
+	{
+		// The host has stopped reading. Release the card so sdPoll can
+		// check for card removal.
+		scsiDiskReadAheadStop();
+	}
+}
+
+// Write buffered sectors to the SD card, then close the multi-block write
+// once it's no longer needed. Unless flushing, returns as soon as we're
+// selected.
+static void doWriteCache(int flush)
+{
+	int buffers = sizeof(scsiDev.data) / SD_SECTOR_SIZE;
+
+	// sdWriteSectorDMAPoll reports errors against the current target, and
+	// we may be called while the bus is free or from another command.
+	TargetState* target = scsiDev.target;
+	int phase = scsiDev.phase;
+	uint8 status = scsiDev.status;
+	TargetState* owner = &scsiDev.targets[writeCache.targetIndex];
+	ScsiSense sense = owner->sense;
+
+	scsiDev.target = owner;
+	scsiDev.status = GOOD;
+	transfer.dir = TRANSFER_WRITE;
+	transfer.inProgress = 1;
+
+	while ((writeCache.pending > 0) &&
+		likely(scsiDev.status == GOOD) &&
+		(flush ||
+			(likely(!scsiDev.resetFlag) && !SCSI_ReadFilt(SCSI_Filt_SEL))))
+	{
+		if (writeCache.dmaActive)
+		{
+			if (sdDMABusy())
+			{
+				// Woken by the DMA complete or SEL interrupts.
+				__WFI();
+			}
+			else if (sdWriteSectorDMAPoll(0))
+			{
+				writeCache.dmaActive = 0;
+				writeCache.pending--;
+				writeCache.start = (writeCache.start + 1) % buffers;
+				writeCache.lastActivity = getTime_ms();
+			}
+		}
+		else
+		{
+			sdWriteMultiSectorDMA(
+				&scsiDev.data[SD_SECTOR_SIZE * writeCache.start]);
+			writeCache.dmaActive = 1;
+		}
+	}
+
+	if (unlikely(scsiDev.status != GOOD))
+	{
+		// The multi-block write has already been stopped. The host has
+		// been told the data was written, so all we can do is fail the
+		// next command.
+		owner->deferredSense = owner->sense;
+		writeCache.active = 0;
+		writeCache.pending = 0;
+		writeCache.dmaActive = 0;
+	}
+	else if ((writeCache.pending == 0) &&
+		(flush ||
+			(!SCSI_ReadFilt(SCSI_Filt_SEL) &&
+				(!writeCache.streaming ||
+					unlikely(elapsedTime_ms(writeCache.lastActivity) > 100)))))
+	{
+		// Not a sequential stream, or the host has stopped writing.
+		// Send the stop token so the card can finish programming.
+		writeCache.active = 0;
+		if (unlikely(sdCompleteCachedWrite()))
+		{
+			owner->deferredSense.code = HARDWARE_ERROR;
+			owner->deferredSense.asc = WRITE_ERROR_AUTO_REALLOCATION_FAILED;
+		}
+	}
+
+	if (!writeCache.active)
+	{
+		writeCache.start = 0;
+	}
+
+	owner->sense = sense;
+	transfer.inProgress = 0;
+	scsiDev.target = target;
+	scsiDev.phase = phase;
+	scsiDev.status = status;
+}
+
+// Returns non-zero if the buffers differ. Faster if both are word aligned.
+static int verifyCompare(const uint8_t* a, const uint8_t* b, int bytes)
+{
+	if (unlikely((((uintptr_t) a) | ((uintptr_t) b)) & 3))
+	{
+		// Packed blocks can start anywhere in an SD sector.
+		return memcmp(a, b, bytes);
+	}
+
+	const uint32_t* wordA = (const uint32_t*) a;
+	const uint32_t* wordB = (const uint32_t*) b;
+	int words = bytes / 4;
+	int i;
+	for (i = 0; i < words; ++i)
+	{
+		if (wordA[i] != wordB[i]) return 1;
+	}
+	return memcmp(a + words * 4, b + words * 4, bytes - words * 4);
+}
+
+// VERIFY with BYTCHK. The host data is received into the first half of
+// scsiDev.data while the card reads the same sectors into the second half.
+// Each sector is compared once both halves have it, while the next ones are
+// still in flight.
+static void doVerifyData()
+{
+	scsiEnterPhase(DATA_OUT);
+
+	const int sdPerScsi =
+		SDSectorsPerSCSISector(scsiDev.target->liveCfg.bytesPerSector);
+	const int buffers = sizeof(scsiDev.data) / SD_SECTOR_SIZE / 2;
+	uint8_t* sdData = &scsiDev.data[SD_SECTOR_SIZE * buffers];
+
+	int totalSDSectors =
+		SCSIBlocks2SD(
+			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->liveCfg.packed,
+			transfer.lba,
+			transfer.blocks);
+	uint32_t sdLBA =
+		SCSISector2SD(
+			scsiDev.target->liveCfg.sdSectorStart,
+			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->liveCfg.packed,
+			transfer.lba);
+
+	const int checkCRC =
+		scsiDev.target->cfg->flags & CONFIG_ENABLE_SD_CRC;
+	uint16_t sdCRC[sizeof(scsiDev.data) / SD_SECTOR_SIZE / 2];
+
+	int received = 0; // Sectors from the host.
+	int read = 0; // Sectors from the card.
+	int compared = 0;
+	int scsiActive = 0;
+	int sdActive = 0;
+	int sdWaiting = 0;
+	uint32_t tokenStart = 0;
+
+	// See the DATA_IN disconnect in scsiDiskPoll.
+	uint32_t disconnectDelay_ms =
+		(scsiDev.target->liveCfg.busInactivityLimit + 9) / 10;
+	int scsiDisconnected = 0;
+	uint32_t lastActivityTime = getTime_ms();
+
+	while ((compared < totalSDSectors) &&
+		likely(scsiDev.phase == DATA_OUT) && // scsiDisconnect keeps our phase.
+		likely(!scsiDev.resetFlag))
+	{
+		int scsiBusy = scsiDMABusy();
+		int sdBusy = sdDMABusy();
+		while (scsiBusy && sdBusy)
+		{
+			__WFI();
+			scsiBusy = scsiDMABusy();
+			sdBusy = sdDMABusy();
+		}
+
+		if (sdActive && !sdBusy && sdReadSectorDMAPoll())
+		{
+			sdActive = 0;
+			if (unlikely(checkCRC))
+			{
+				sdCRC[read % buffers] = sdReadSectorCRC();
+			}
+			read++;
+		}
+		if (!sdActive &&
+			((read - compared) < buffers) &&
+			(read < totalSDSectors) &&
+			sdMultiSectorPrepPoll()) // CMD18 accepted.
+		{
+			if (!sdWaiting)
+			{
+				sdWaiting =
+					transfer.multiBlock ||
+					sdReadSingleSectorPrep(sdLBA + read);
+				tokenStart = getTime_ms();
+			}
+			if (sdWaiting)
+			{
+				int started = sdReadSectorDMAStart(
+					&sdData[SD_SECTOR_SIZE * (read % buffers)]);
+				if (started > 0)
+				{
+					sdActive = 1;
+					sdWaiting = 0;
+				}
+				else if (unlikely(started < 0) ||
+					unlikely(elapsedTime_ms(tokenStart) > SD_READ_TOKEN_TIMEOUT_MS))
+				{
+					sdWaiting = 0;
+					sdReadSectorError();
+				}
+			}
+		}
+
+		uint32_t now = getTime_ms();
+
+		if (scsiActive && !scsiBusy && scsiReadDMAPoll())
+		{
+			scsiActive = 0;
+			received++;
+			lastActivityTime = now;
+		}
+		if (!scsiActive &&
+			((received - compared) < buffers) &&
+			(received < totalSDSectors) &&
+			likely(!scsiDisconnected) &&
+			likely(scsiDev.phase == DATA_OUT))
+		{
+			int offset;
+			int dmaBytes =
+				sdSectorBytes(transfer.lba, transfer.blocks, received, &offset);
+			scsiReadDMA(
+				&scsiDev.data[SD_SECTOR_SIZE * (received % buffers) + offset],
+				dmaBytes);
+			scsiDev.cmdDataBytes += dmaBytes;
+			scsiActive = 1;
+		}
+		else if (
+			(scsiActive == 0) &&
+			likely(!scsiDisconnected) &&
+			unlikely(scsiDev.discPriv) &&
+			likely(disconnectDelay_ms > 0) && // 0 means no limit.
+			unlikely(diffTime_ms(lastActivityTime, now) >= disconnectDelay_ms) &&
+			likely(scsiDev.phase == DATA_OUT))
+		{
+			// Waiting for the card to catch up.
+			scsiDisconnect();
+			scsiDisconnected = 1;
+			lastActivityTime = getTime_ms();
+		}
+		else if (unlikely(scsiDisconnected) &&
+			unlikely(scsiAcceptDisconnected()))
+		{
+			// The initiator has aborted this command.
+			scsiDisconnected = 0;
+			scsiDev.phase = BUS_FREE;
+		}
+		else if (unlikely(scsiDisconnected) &&
+			(
+				(compared == received) ||
+				// Send some messages every 100ms so we don't timeout.
+				unlikely(diffTime_ms(lastActivityTime, now) >= 100)
+			))
+		{
+			int reconnected = scsiReconnect();
+			if (reconnected)
+			{
+				scsiDisconnected = 0;
+				lastActivityTime = getTime_ms(); // Don't disconnect immediately.
+			}
+			else if (diffTime_ms(lastActivityTime, getTime_ms()) >= 10000)
+			{
+				// Give up after 10 seconds of trying to reconnect.
+				scsiDev.resetFlag = 1;
+			}
+		}
+
+		// Compare one sector while the next ones are transferred.
+		if ((compared < received) &&
+			(compared < read) &&
+			likely(scsiDev.phase == DATA_OUT))
+		{
+			int slot = compared % buffers;
+			int offset;
+			int bytes =
+				sdSectorBytes(transfer.lba, transfer.blocks, compared, &offset);
+			if (unlikely(checkCRC) &&
+				unlikely(crc16(&sdData[SD_SECTOR_SIZE * slot], SD_SECTOR_SIZE) !=
+					sdCRC[slot]))
+			{
+				sdReadSectorError();
+			}
+			else if (likely(!verifyCompare(
+				&scsiDev.data[SD_SECTOR_SIZE * slot + offset],
+				&sdData[SD_SECTOR_SIZE * slot + offset],
+				bytes)))
+			{
+				compared++;
+			}
+			else
+			{
+				// REQUEST SENSE reports transfer.lba in the information
+				// field.
+				if (unlikely(isPacked()))
+				{
+					// The first block holding any of this SD sector.
+					if (compared > 0)
+					{
+						transfer.lba +=
+							(compared * SD_SECTOR_SIZE -
+								SCSISectorOffset(
+									scsiDev.target->liveCfg.bytesPerSector,
+									1,
+									transfer.lba)) /
+							scsiDev.target->liveCfg.bytesPerSector;
+					}
+				}
+				else
+				{
+					transfer.lba += compared / sdPerScsi;
+				}
+				scsiDev.status = CHECK_CONDITION;
+				scsiDev.target->sense.code = MISCOMPARE;
+				scsiDev.target->sense.asc = MISCOMPARE_DURING_VERIFY_OPERATION;
+				scsiDev.phase = STATUS;
+			}
+		}
+	}
+
+	// Let the host and card finish the sectors in flight before changing
+	// phase.
+	while (scsiActive && !scsiReadDMAPoll() && likely(!scsiDev.resetFlag)) {}
+	while (sdActive && !sdReadSectorDMAPoll()) {}
+
+	while (
+		!scsiDev.resetFlag &&
+		unlikely(scsiDisconnected) &&
+		(elapsedTime_ms(lastActivityTime) <= 10000))
 	{
-		// REZERO UNIT
-		// Set the lun to a vendor-specific state. Ignore.
+		scsiDisconnected = !scsiReconnect();
 	}
-	else if (unlikely(command == 0x35))
+	if (scsiDisconnected)
 	{
-		// SYNCHRONIZE CACHE
-		// We don't have a cache. do nothing.
+		// Failed to reconnect
+		scsiDev.resetFlag = 1;
 	}
-	else if (unlikely(command == 0x2F))
+
+	if (scsiDev.phase == DATA_OUT)
 	{
-		// VERIFY
-		// TODO: When they supply data to verify, we should read the data and
-		// verify it. If they don't supply any data, just say success.
-		if ((scsiDev.cdb[1] & 0x02) == 0)
-		{
-			// They are asking us to do a medium verification with no data
-			// comparison. Assume success, do nothing.
-		}
-		else
+		if (scsiDev.parityError &&
+			(scsiDev.target->cfg->flags & CONFIG_ENABLE_PARITY) &&
+			(scsiDev.compatMode >= COMPAT_SCSI2))
 		{
-			// TODO. This means they are supplying data to verify against.
-			// Technically we should probably grab the data and compare it.
+			scsiDev.target->sense.code = ABORTED_COMMAND;
+			scsiDev.target->sense.asc = SCSI_PARITY_ERROR;
 			scsiDev.status = CHECK_CONDITION;
-			scsiDev.target->sense.code = ILLEGAL_REQUEST;
-			scsiDev.target->sense.asc = INVALID_FIELD_IN_CDB;
-			scsiDev.phase = STATUS;
 		}
+		scsiDev.phase = STATUS;
 	}
-	else
-	{
-		commandHandled = 0;
-	}
-
-	return commandHandled;
+	scsiDiskReset();
 }
 
 void scsiDiskPoll()
@@ -500,23 +2107,82 @@ void scsiDiskPoll()
 		scsiEnterPhase(DATA_IN);
 
 		int totalSDSectors =
-			transfer.blocks *
-				SDSectorsPerSCSISector(scsiDev.target->liveCfg.bytesPerSector);
+			SCSIBlocks2SD(
+				scsiDev.target->liveCfg.bytesPerSector,
+				scsiDev.target->liveCfg.packed,
+				transfer.lba,
+				transfer.blocks);
 		uint32_t sdLBA =
 			SCSISector2SD(
-				scsiDev.target->cfg->sdSectorStart,
+				scsiDev.target->liveCfg.sdSectorStart,
 				scsiDev.target->liveCfg.bytesPerSector,
+				scsiDev.target->liveCfg.packed,
 				transfer.lba);
 
 		const int sdPerScsi =
 			SDSectorsPerSCSISector(scsiDev.target->liveCfg.bytesPerSector);
 		int buffers = sizeof(scsiDev.data) / SD_SECTOR_SIZE;
-		int prep = 0;
+
+		// True if every SD sector is sent to the host in full.
+		const int fullSectors =
+			(scsiDev.target->liveCfg.bytesPerSector % SD_SECTOR_SIZE) == 0;
+
+		// Otherwise, packed blocks only skip part of the first and last SD
+		// sectors.
+		const int packed = isPacked();
+		int dmaOffset = 0;
+		int packedEnd = SD_SECTOR_SIZE;
+		if (unlikely(packed))
+		{
+			dmaOffset = SCSISectorOffset(
+				scsiDev.target->liveCfg.bytesPerSector, 1, transfer.lba);
+			int end = SCSISectorOffset(
+				scsiDev.target->liveCfg.bytesPerSector,
+				1,
+				transfer.lba + transfer.blocks);
+			if (end) packedEnd = end;
+		}
+
+		// Start with any sectors already buffered by the read-ahead engine.
+		int ringStart = readAhead.start;
+		int prep = readAhead.buffered;
 		int i = 0;
 		int scsiActive = 0;
-		int sdActive = 0;
+		int sdActive = readAhead.dmaActive;
+		readAhead.start = 0;
+		readAhead.buffered = 0;
+		readAhead.dmaActive = 0;
+
+		// Set once the card has been asked for the next sector, until it
+		// sends the start-block token.
+		int sdWaiting = 0;
+		uint32_t tokenStart = 0;
+
+		// Disconnect-Reconnect mode page. Release the bus if we've had
+		// nothing to send for the bus inactivity limit, and reselect once
+		// the buffer full ratio has been reached.
+		uint32_t disconnectDelay_ms =
+			(scsiDev.target->liveCfg.busInactivityLimit + 9) / 10;
+		int reselectSectors =
+			(buffers * scsiDev.target->liveCfg.bufferFullRatio) / 256;
+		if (reselectSectors < 1) reselectSectors = 1;
+
+		int scsiDisconnected = 0;
+		uint32_t lastActivityTime = getTime_ms();
+
+		// Optional CRC check of each SD sector. A sector is checked while
+		// the card sends the next one, and only sectors up to "verified" are
+		// sent to the host. Sectors from the read-ahead engine have already
+		// been checked.
+		const int checkCRC =
+			scsiDev.target->cfg->flags & CONFIG_ENABLE_SD_CRC;
+		uint16_t sdCRC[sizeof(scsiDev.data) / SD_SECTOR_SIZE];
+		int verified = prep;
+		int retries = 0;
+		int sdRetry = 0; // Waiting for an earlier CMD17 before re-reading.
+
 		while ((i < totalSDSectors) &&
-			likely(scsiDev.phase == DATA_IN) &&
+			likely(scsiDev.phase == DATA_IN) && // scsiDisconnect keeps our phase.
 			likely(!scsiDev.resetFlag))
 		{
 			// Wait for the next DMA interrupt. It's beneficial to halt the
@@ -537,7 +2203,15 @@ void scsiDiskPoll()
 			if (sdActive && !sdBusy && sdReadSectorDMAPoll())
 			{
 				sdActive = 0;
+				if (unlikely(checkCRC))
+				{
+					sdCRC[(ringStart + prep) % buffers] = sdReadSectorCRC();
+				}
 				prep++;
+				if (likely(!checkCRC))
+				{
+					verified = prep;
+				}
 			}
 
 			// Usually SD is slower than the SCSI interface.
@@ -546,61 +2220,319 @@ void scsiDiskPoll()
 			// ie. NO "else" HERE.
 			if (!sdActive &&
 				(prep - i < buffers) &&
-				(prep < totalSDSectors))
+				(prep < totalSDSectors) &&
+				(likely(!sdRetry) || sdWaiting) &&
+				sdMultiSectorPrepPoll()) // CMD18 accepted.
 			{
 				// Start an SD transfer if we have space.
-				if (transfer.multiBlock)
+				// Don't spin waiting for the card. A slow CMD18 start or
+				// garbage collection pause can take up to
+				// SD_READ_TOKEN_TIMEOUT_MS, and we may want to disconnect
+				// in the meantime.
+				if (!sdWaiting)
+				{
+					sdWaiting =
+						transfer.multiBlock ||
+						sdReadSingleSectorPrep(sdLBA + prep);
+					tokenStart = getTime_ms();
+				}
+				if (sdWaiting)
+				{
+					int started = sdReadSectorDMAStart(
+						&scsiDev.data[SD_SECTOR_SIZE * ((ringStart + prep) % buffers)]);
+					if (started > 0)
+					{
+						sdActive = 1;
+						sdWaiting = 0;
+					}
+					else if (unlikely(started < 0) ||
+						unlikely(elapsedTime_ms(tokenStart) > SD_READ_TOKEN_TIMEOUT_MS))
+					{
+						sdWaiting = 0;
+						sdReadSectorError();
+					}
+				}
+			}
+
+			// Check the CRC of one sector while the card sends the next.
+			if (unlikely(checkCRC) &&
+				(verified < prep) &&
+				likely(scsiDev.phase == DATA_IN))
+			{
+				int slot = (ringStart + verified) % buffers;
+				if (likely(!sdRetry) &&
+					likely(crc16(&scsiDev.data[SD_SECTOR_SIZE * slot], SD_SECTOR_SIZE) ==
+						sdCRC[slot]))
 				{
-					sdReadMultiSectorDMA(&scsiDev.data[SD_SECTOR_SIZE * (prep % buffers)]);
+					verified++;
+					retries = 0;
+				}
+				else if (retries >= SD_CRC_RETRIES)
+				{
+					sdReadSectorError();
+				}
+				else if (transfer.multiBlock || (!sdActive && !sdWaiting))
+				{
+					// Corrupted on the way from the card. Discard this sector
+					// and any read after it, and ask for them again.
+					retries++;
+					sdRetry = 0;
+					if (sdActive)
+					{
+						while (!sdReadSectorDMAPoll()) { /* spin */ }
+						sdActive = 0;
+					}
+					sdWaiting = 0;
+					prep = verified;
+					if (transfer.multiBlock)
+					{
+						sdReadMultiSectorRetry(
+							sdLBA + verified, totalSDSectors - verified);
+					}
+					// Otherwise the next CMD17 is for this sector.
 				}
 				else
 				{
-					sdReadSingleSectorDMA(sdLBA + prep, &scsiDev.data[SD_SECTOR_SIZE * (prep % buffers)]);
+					// Let the card finish the CMD17 we've already sent.
+					sdRetry = 1;
 				}
-				sdActive = 1;
 			}
 
+			uint32_t now = getTime_ms();
+
 			if (scsiActive && !scsiBusy && scsiWriteDMAPoll())
 			{
+				i += scsiActive;
 				scsiActive = 0;
-				++i;
+				lastActivityTime = now;
 			}
-			if (!scsiActive && ((prep - i) > 0))
+			if (!scsiActive &&
+				((verified - i) > 0) &&
+				likely(!scsiDisconnected))
 			{
+				int slot = (ringStart + i) % buffers;
 				int dmaBytes = SD_SECTOR_SIZE;
-				if ((i % sdPerScsi) == (sdPerScsi - 1))
+				int offset = 0;
+				if (fullSectors || unlikely(packed))
 				{
-					dmaBytes = scsiDev.target->liveCfg.bytesPerSector % SD_SECTOR_SIZE;
-					if (dmaBytes == 0) dmaBytes = SD_SECTOR_SIZE;
+					// Send every buffered sector up to the end of the ring
+					// in one chained DMA transfer, rather than stopping to
+					// re-arm the channel after each one.
+					scsiActive = verified - i;
+					if (slot + scsiActive > buffers)
+					{
+						scsiActive = buffers - slot;
+					}
+					dmaBytes = SD_SECTOR_SIZE * scsiActive;
+					if (unlikely(packed))
+					{
+						if (i == 0)
+						{
+							offset = dmaOffset;
+						}
+						if (i + scsiActive == totalSDSectors)
+						{
+							dmaBytes -= SD_SECTOR_SIZE - packedEnd;
+						}
+						dmaBytes -= offset;
+					}
+				}
+				else
+				{
+					if ((i % sdPerScsi) == (sdPerScsi - 1))
+					{
+						dmaBytes = scsiDev.target->liveCfg.bytesPerSector % SD_SECTOR_SIZE;
+						if (dmaBytes == 0) dmaBytes = SD_SECTOR_SIZE;
+					}
+					scsiActive = 1;
+				}
+				scsiWriteDMA(&scsiDev.data[SD_SECTOR_SIZE * slot + offset], dmaBytes);
+				scsiDev.cmdDataBytes += dmaBytes;
+			}
+			else if (
+				(scsiActive == 0) &&
+				!sdActive &&
+				(verified == i) && // Nothing buffered to send.
+				likely(!scsiDisconnected) &&
+				unlikely(scsiDev.discPriv) &&
+				likely(disconnectDelay_ms > 0) && // 0 means no limit.
+				unlikely(diffTime_ms(lastActivityTime, now) >= disconnectDelay_ms) &&
+				likely(scsiDev.phase == DATA_IN))
+			{
+				// The SD card is slow to send the next sector, and we're
+				// holding the bus without transferring anything. Let the
+				// other devices on the bus use it.
+				scsiDisconnect();
+				scsiDisconnected = 1;
+				lastActivityTime = getTime_ms();
+			}
+			else if (unlikely(scsiDisconnected) &&
+				unlikely(scsiAcceptDisconnected()))
+			{
+				// The initiator has aborted this command.
+				scsiDisconnected = 0;
+				scsiDev.phase = BUS_FREE;
+			}
+			else if (unlikely(scsiDisconnected) &&
+				(
+					((verified - i) >= reselectSectors) ||
+					(verified == totalSDSectors) ||
+					// Send some messages every 100ms so we don't timeout.
+					// At a minimum, a reselection involves an IDENTIFY message.
+					unlikely(diffTime_ms(lastActivityTime, now) >= 100)
+				))
+			{
+				int reconnected = scsiReconnect();
+				if (reconnected)
+				{
+					scsiDisconnected = 0;
+					lastActivityTime = getTime_ms(); // Don't disconnect immediately.
+				}
+				else if (diffTime_ms(lastActivityTime, getTime_ms()) >= 10000)
+				{
+					// Give up after 10 seconds of trying to reconnect.
+					scsiDev.resetFlag = 1;
 				}
-				scsiWriteDMA(&scsiDev.data[SD_SECTOR_SIZE * (i % buffers)], dmaBytes);
-				scsiActive = 1;
 			}
 		}
+
+		// We may have disconnected before a read error. Reselect to
+		// return the status.
+		while (
+			!scsiDev.resetFlag &&
+			unlikely(scsiDisconnected) &&
+			(elapsedTime_ms(lastActivityTime) <= 10000))
+		{
+			scsiDisconnected = !scsiReconnect();
+		}
+		if (scsiDisconnected)
+		{
+			// Failed to reconnect
+			scsiDev.resetFlag = 1;
+		}
+
 		if (scsiDev.phase == DATA_IN)
 		{
 			scsiDev.phase = STATUS;
 		}
+
+		if (readAhead.streaming &&
+			transfer.multiBlock &&
+			transfer.inProgress &&
+			(i == totalSDSectors) &&
+			(scsiDev.status == GOOD) &&
+			likely(!scsiDev.resetFlag))
+		{
+			// Hand the open multi-block read over to the read-ahead engine
+			// instead of closing it.
+			uint64_t capacity = getScsiCapacity(
+				scsiDev.target->liveCfg.sdSectorStart,
+				scsiDev.target->liveCfg.bytesPerSector,
+				scsiDev.target->liveCfg.packed,
+				scsiDev.target->liveCfg.scsiSectors);
+
+			readAhead.active = 1;
+			readAhead.targetIndex = scsiDev.target - scsiDev.targets;
+			readAhead.bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+			readAhead.nextLBA = transfer.lba + transfer.blocks;
+			readAhead.sdLBA = sdLBA + prep + sdActive;
+			readAhead.sdEnd =
+				SCSISector2SD(
+					scsiDev.target->liveCfg.sdSectorStart,
+					scsiDev.target->liveCfg.bytesPerSector,
+					scsiDev.target->liveCfg.packed,
+					capacity - 1);
+			if (unlikely(eraseQueue.active) &&
+				(eraseQueue.sdEnd > readAhead.sdLBA) &&
+				(eraseQueue.sdLBA < readAhead.sdEnd))
+			{
+				// Don't buffer sectors that are about to be erased.
+				readAhead.sdEnd = eraseQueue.sdLBA > readAhead.sdLBA ?
+					eraseQueue.sdLBA : readAhead.sdLBA;
+			}
+			readAhead.start = (ringStart + i) % buffers;
+			readAhead.buffered = prep - i;
+			readAhead.dmaActive = sdActive;
+			readAhead.lastActivity = getTime_ms();
+
+			// sdCompleteReadAhead is now responsible for the CMD12.
+			transfer.inProgress = 0;
+		}
 		scsiDiskReset();
 	}
+	else if (unlikely(transfer.dir == TRANSFER_VERIFY) &&
+		(scsiDev.phase == DATA_OUT) &&
+		(transfer.currentBlock != transfer.blocks))
+	{
+		doVerifyData();
+	}
 	else if (scsiDev.phase == DATA_OUT &&
 		transfer.currentBlock != transfer.blocks)
 	{
 		scsiEnterPhase(DATA_OUT);
 
-		const int sdPerScsi =
-			SDSectorsPerSCSISector(scsiDev.target->liveCfg.bytesPerSector);
-		int totalSDSectors = transfer.blocks * sdPerScsi;
 		int buffers = sizeof(scsiDev.data) / SD_SECTOR_SIZE;
-		int prep = 0;
+
+		// The final ring slot holds the card's copy of the last SD sector
+		// of a packed WRITE. See doWritePackedPrep.
+		const int packed = isPacked();
+		const int packedEnd = unlikely(packed) ?
+			SCSISectorOffset(
+				scsiDev.target->liveCfg.bytesPerSector,
+				1,
+				transfer.lba + transfer.blocks) :
+			0;
+		if (unlikely(packed))
+		{
+			buffers--;
+		}
+
+		int ringStart = 0;
+		int carried = 0;
+		int sdActive = 0;
+		if (writeCache.active)
+		{
+			// doWrite found a sequential stream. Start with any sectors from
+			// the previous WRITE that haven't been written to the card yet.
+			ringStart = writeCache.start;
+			carried = writeCache.pending;
+			sdActive = writeCache.dmaActive;
+			writeCache.active = 0;
+			writeCache.start = 0;
+			writeCache.pending = 0;
+			writeCache.dmaActive = 0;
+			transfer.inProgress = 1;
+		}
+
+		int totalSDSectors = carried +
+			SCSIBlocks2SD(
+				scsiDev.target->liveCfg.bytesPerSector,
+				scsiDev.target->liveCfg.packed,
+				transfer.lba,
+				transfer.blocks);
+		uint32_t sdLBA =
+			SCSISector2SD(
+				scsiDev.target->liveCfg.sdSectorStart,
+				scsiDev.target->liveCfg.bytesPerSector,
+				scsiDev.target->liveCfg.packed,
+				transfer.lba);
+		int prep = carried;
 		int i = 0;
 		int scsiDisconnected = 0;
 		int scsiComplete = 0;
 		uint32_t lastActivityTime = getTime_ms();
 		int scsiActive = 0;
-		int sdActive = 0;
+
+		// doWrite only started the CMD25. Receive from the host while the
+		// card finishes any earlier programming and accepts it.
+		int sdOpen = 0;
 
 		while ((i < totalSDSectors) &&
+			// With write-back, stop once all data is buffered and the
+			// write cache has an open multi-block write to hand it to.
+			(likely(!writeCache.writeBack) ||
+				(prep < totalSDSectors) ||
+				!sdOpen) &&
 			(likely(scsiDev.phase == DATA_OUT) || // scsiDisconnect keeps our phase.
 				scsiComplete) &&
 			likely(!scsiDev.resetFlag))
@@ -620,15 +2552,24 @@ void scsiDiskPoll()
 				sdBusy = sdDMABusy();
 			}
 
-			if (sdActive && !sdBusy && sdWriteSectorDMAPoll(i == (totalSDSectors - 1)))
+			// Leave the multi-block write open for the next sequential WRITE.
+			if (sdActive &&
+				!sdBusy &&
+				sdWriteSectorDMAPoll(
+					(i == (totalSDSectors - 1)) && !writeCache.streaming))
 			{
 				sdActive = 0;
 				i++;
 			}
-			if (!sdActive && ((prep - i) > 0))
+			if (!sdOpen)
+			{
+				sdOpen = sdMultiSectorPrepPoll();
+			}
+			if (!sdActive && sdOpen && ((prep - i) > 0))
 			{
 				// Start an SD transfer if we have space.
-				sdWriteMultiSectorDMA(&scsiDev.data[SD_SECTOR_SIZE * (i % buffers)]);
+				sdWriteMultiSectorDMA(
+					&scsiDev.data[SD_SECTOR_SIZE * ((ringStart + i) % buffers)]);
 				sdActive = 1;
 			}
 
@@ -636,6 +2577,22 @@ void scsiDiskPoll()
 
 			if (scsiActive && !scsiBusy && scsiReadDMAPoll())
 			{
+				uint8_t* sector =
+					&scsiDev.data[SD_SECTOR_SIZE * ((ringStart + prep) % buffers)];
+				if (unlikely(packedEnd) &&
+					(prep > 0) &&
+					(prep == totalSDSectors - 1))
+				{
+					// Keep the rest of the last SD sector.
+					memcpy(
+						sector + packedEnd,
+						&scsiDev.data[SD_SECTOR_SIZE * buffers + packedEnd],
+						SD_SECTOR_SIZE - packedEnd);
+				}
+				if (unlikely(blockCache.used))
+				{
+					cacheUpdate(sdLBA + (prep - carried), sector);
+				}
 				scsiActive = 0;
 				++prep;
 				lastActivityTime = now;
@@ -645,25 +2602,29 @@ void scsiDiskPoll()
 				(prep < totalSDSectors) &&
 				likely(!scsiDisconnected))
 			{
-				int dmaBytes = SD_SECTOR_SIZE;
-				if ((prep % sdPerScsi) == (sdPerScsi - 1))
-				{
-					dmaBytes = scsiDev.target->liveCfg.bytesPerSector % SD_SECTOR_SIZE;
-					if (dmaBytes == 0) dmaBytes = SD_SECTOR_SIZE;
-				}
-				scsiReadDMA(&scsiDev.data[SD_SECTOR_SIZE * (prep % buffers)], dmaBytes);
+				int offset;
+				int dmaBytes = sdSectorBytes(
+					transfer.lba, transfer.blocks, prep - carried, &offset);
+				scsiReadDMA(
+					&scsiDev.data[
+						SD_SECTOR_SIZE * ((ringStart + prep) % buffers) + offset],
+					dmaBytes);
+				scsiDev.cmdDataBytes += dmaBytes;
 				scsiActive = 1;
 			}
 			else if (
 				(scsiActive == 0) &&
 				likely(!scsiDisconnected) &&
 				unlikely(scsiDev.discPriv) &&
-				unlikely(diffTime_ms(lastActivityTime, now) >= 20) &&
+				unlikely(diffTime_ms(lastActivityTime, now) >=
+					sdDev.writeLatency.disconnect_ms) &&
 				likely(scsiDev.phase == DATA_OUT))
 			{
 				// We're transferring over the SCSI bus faster than the SD card
 				// can write.  There is no more buffer space once we've finished
 				// this SCSI transfer.
+				// The card has been busy for longer than most of its writes
+				// take. See sdWriteLatencyRecord.
 				// The NCR 53C700 interface chips have a 250ms "byte-to-byte"
 				// timeout buffer. SD card writes are supposed to complete
 				// within 200ms, but sometimes they don't.
@@ -672,6 +2633,13 @@ void scsiDiskPoll()
 				scsiDisconnected = 1;
 				lastActivityTime = getTime_ms();
 			}
+			else if (unlikely(scsiDisconnected) &&
+				unlikely(scsiAcceptDisconnected()))
+			{
+				// The initiator has aborted this command.
+				scsiDisconnected = 0;
+				scsiDev.phase = BUS_FREE;
+			}
 			else if (unlikely(scsiDisconnected) &&
 				(
 					(prep == i) || // Buffers empty.
@@ -697,7 +2665,8 @@ void scsiDiskPoll()
 				(sdActive == 1) &&
 				(prep == totalSDSectors) && // All scsi data read and buffered
 				likely(!scsiDev.discPriv) && // Prefer disconnect where possible.
-				unlikely(diffTime_ms(lastActivityTime, now) >= 150) &&
+				unlikely(diffTime_ms(lastActivityTime, now) >=
+					sdDev.writeLatency.earlyStatus_ms) &&
 
 				likely(scsiDev.phase == DATA_OUT) &&
 				!(scsiDev.cdb[scsiDev.cdbLen - 1] & 0x01) // Not linked command
@@ -749,8 +2718,224 @@ void scsiDiskPoll()
 			}
 			scsiDev.phase = STATUS;
 		}
+
+		if ((writeCache.writeBack || writeCache.streaming) &&
+			transfer.inProgress &&
+			(prep == totalSDSectors) &&
+			(scsiDev.status == GOOD) &&
+			likely(!scsiDev.resetFlag))
+		{
+			// Hand the open multi-block write, and any sectors not yet
+			// written, over to the write cache instead of waiting for the
+			// card.
+			writeCache.active = 1;
+			writeCache.targetIndex = scsiDev.target - scsiDev.targets;
+			writeCache.bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+			writeCache.nextLBA = transfer.lba + transfer.blocks;
+			writeCache.start = (ringStart + i) % buffers;
+			writeCache.pending = prep - i;
+			writeCache.dmaActive = sdActive;
+			writeCache.lastActivity = getTime_ms();
+
+			// doWriteCache is now responsible for the stop token.
+			transfer.inProgress = 0;
+		}
+		writeCache.writeBack = 0;
 		scsiDiskReset();
 	}
+	else if (unlikely(readAhead.active) &&
+		((scsiDev.phase == BUS_FREE) || (scsiDev.phase == BUS_BUSY)))
+	{
+		doReadAhead();
+	}
+	else if (unlikely(writeCache.active) &&
+		((scsiDev.phase == BUS_FREE) || (scsiDev.phase == BUS_BUSY)))
+	{
+		doWriteCache(0);
+	}
+	else if (unlikely(eraseQueue.active) &&
+		((scsiDev.phase == BUS_FREE) || (scsiDev.phase == BUS_BUSY)))
+	{
+		doErase(0xFFFFFFFF, 0);
+	}
+	else if (unlikely(formatFill.active) &&
+		((scsiDev.phase == BUS_FREE) || (scsiDev.phase == BUS_BUSY)))
+	{
+		doFill(&formatFill, 0);
+	}
+}
+
+void scsiDiskReadAheadStop()
+{
+	if (readAhead.active)
+	{
+		readAhead.active = 0;
+		sdCompleteReadAhead();
+	}
+	readAhead.start = 0;
+	readAhead.buffered = 0;
+	readAhead.dmaActive = 0;
+}
+
+// Called for every command before it is processed.
+void scsiDiskCommandPrep()
+{
+	uint8 command = scsiDev.cdb[0];
+	if (readAhead.active &&
+		(command != 0x08) && // READ(6)
+		(command != 0x28) && // READ(10)
+		(command != 0xA8) && // READ(12)
+		(command != 0x88) && // READ(16)
+		(command != 0x00)) // TEST UNIT READY
+	{
+		// Anything else may use the data buffer or the SD card.
+		scsiDiskReadAheadStop();
+	}
+
+	if (writeCache.active &&
+		(command != 0x0A) && // WRITE(6)
+		(command != 0x2A) && // WRITE(10)
+		(command != 0xAA) && // WRITE(12)
+		(command != 0x8A) && // WRITE(16)
+		(command != 0x00)) // TEST UNIT READY
+	{
+		// Includes SYNCHRONIZE CACHE and START STOP UNIT.
+		scsiDiskWriteCacheFlush();
+	}
+}
+
+// Write all buffered sectors to the SD card. Must complete even if the
+// bus is reset, as the host has already been told the data was written.
+void scsiDiskWriteCacheFlush()
+{
+	if (writeCache.active)
+	{
+		doWriteCache(1);
+	}
+}
+
+// Returns 1 if the current target is being formatted by scsiDiskPoll, with
+// the fraction done in 1/65536ths.
+int scsiDiskFormatProgress(uint16_t* progress)
+{
+	if (formatFill.active &&
+		(formatFill.targetIndex == (scsiDev.target - scsiDev.targets)))
+	{
+		*progress =
+			(((uint64) (formatFill.sdLBA - formatFill.sdStart)) << 16) /
+				(formatFill.sdEnd - formatFill.sdStart);
+		return 1;
+	}
+	return 0;
+}
+
+// Drop everything from the block cache. Called when the SD card is removed.
+void scsiDiskCacheClear()
+{
+	memset(&blockCache.entries, 0, sizeof(blockCache.entries));
+	blockCache.used = 0;
+}
+
+// Block cache entries the target may use. Its config may ask for more than
+// the firmware was built with.
+int scsiDiskCacheSectors(const TargetConfig* cfg)
+{
+	return cfg->cacheSectors < BLOCK_CACHE_SECTORS ?
+		cfg->cacheSectors : BLOCK_CACHE_SECTORS;
+}
+
+// Queue SCSI blocks of the current target to be erased by scsiDiskPoll.
+// Sets CHECK CONDITION status if the blocks can't be erased.
+void scsiDiskErase(uint64 lba, uint64 blocks)
+{
+	if (unlikely(!doTestUnitReady()))
+	{
+		// Status and sense codes already set by doTestUnitReady
+	}
+	else if (unlikely(blockDev.state & DISK_WP))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = ILLEGAL_REQUEST;
+		scsiDev.target->sense.asc = WRITE_PROTECTED;
+		scsiDev.phase = STATUS;
+	}
+	else if (unlikely(lba + blocks >
+		getScsiCapacity(
+			scsiDev.target->liveCfg.sdSectorStart,
+			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->liveCfg.packed,
+			scsiDev.target->liveCfg.scsiSectors)))
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = ILLEGAL_REQUEST;
+		scsiDev.target->sense.asc = LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+		scsiDev.phase = STATUS;
+	}
+	else if (blocks > 0)
+	{
+		uint32 sdLBA =
+			SCSISector2SD(
+				scsiDev.target->liveCfg.sdSectorStart,
+				scsiDev.target->liveCfg.bytesPerSector,
+				scsiDev.target->liveCfg.packed,
+				lba);
+		uint32 sdEnd = sdLBA +
+			SCSIBlocks2SD(
+				scsiDev.target->liveCfg.bytesPerSector,
+				scsiDev.target->liveCfg.packed,
+				lba,
+				blocks);
+
+		// Packed blocks may share their first and last SD sector with
+		// blocks outside the range. Leave those sectors alone.
+		if (SCSISectorOffset(
+			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->liveCfg.packed,
+			lba))
+		{
+			sdLBA++;
+		}
+		if (SCSISectorOffset(
+			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->liveCfg.packed,
+			lba + blocks))
+		{
+			sdEnd--;
+		}
+		if (sdEnd <= sdLBA)
+		{
+			return;
+		}
+
+		cacheInvalidate(sdLBA, sdEnd);
+
+		int tgtIndex = scsiDev.target - scsiDev.targets;
+		if (eraseQueue.active &&
+			((sdLBA > eraseQueue.sdEnd) ||
+				(sdEnd < eraseQueue.sdLBA) ||
+				(eraseQueue.targetIndex != tgtIndex) ||
+				(eraseQueue.lun != scsiDev.target->lun)))
+		{
+			// Only one range is queued, and errors are reported to the
+			// logical unit that queued it. Finish the old one first.
+			doErase(eraseQueue.sdEnd, 1);
+		}
+
+		if (eraseQueue.active)
+		{
+			// Overlapping or adjacent. Erasing a sector twice is harmless.
+			if (sdLBA < eraseQueue.sdLBA) eraseQueue.sdLBA = sdLBA;
+			if (sdEnd > eraseQueue.sdEnd) eraseQueue.sdEnd = sdEnd;
+		}
+		else
+		{
+			eraseQueue.active = 1;
+			eraseQueue.targetIndex = tgtIndex;
+			eraseQueue.lun = scsiDev.target->lun;
+			eraseQueue.sdLBA = sdLBA;
+			eraseQueue.sdEnd = sdEnd;
+		}
+	}
 }
 
 void scsiDiskReset()
@@ -783,6 +2968,26 @@ void scsiDiskInit()
 	transfer.inProgress = 0;
 	scsiDiskReset();
 
+	readAhead.active = 0;
+	readAhead.start = 0;
+	readAhead.buffered = 0;
+	readAhead.dmaActive = 0;
+	memset(readAhead.lastEnd, 0xFF, sizeof(readAhead.lastEnd));
+
+	writeCache.writeBack = 0;
+	writeCache.active = 0;
+	writeCache.start = 0;
+	writeCache.pending = 0;
+	writeCache.dmaActive = 0;
+	memset(writeCache.lastEnd, 0xFF, sizeof(writeCache.lastEnd));
+
+	eraseQueue.active = 0;
+	eraseQueue.chunkBlocks = 0;
+
+	formatFill.active = 0;
+
+	scsiDiskCacheClear();
+
 	// Don't require the host to send us a START STOP UNIT command
 	blockDev.state = DISK_STARTED;
 	// WP pin not available for micro-sd
@@ -28,7 +28,8 @@ typedef enum
 typedef enum
 {
 	TRANSFER_READ,
-	TRANSFER_WRITE
+	TRANSFER_WRITE,
+	TRANSFER_VERIFY // Host data compared against the SD card.
 } TRANSFER_DIR;
 
 typedef struct
@@ -41,18 +42,144 @@ typedef struct
 	int dir;
 	int multiBlock; // True if we're using a multi-block SPI transfer.
 	int inProgress; // True if we need to call sdComplete{Read|Write}
-	uint32 lba;
+	uint64 lba;
 	uint32 blocks;
 
 	uint32 currentBlock;
 } Transfer;
 
+// Sequential read-ahead.
+// The SD multi-block read is left open after a sequential READ, and the card
+// keeps streaming into the scsiDev.data ring while the bus is free. The next
+// sequential READ is then served straight from SRAM.
+typedef struct
+{
+	int active; // True if the multi-block read is still open on the SD card.
+	int streaming; // True if the current READ continues the previous one.
+	int targetIndex; // Index into scsiDev.targets owning the stream.
+	uint16_t bytesPerSector;
+	uint32 nextLBA; // SCSI LBA expected from the next READ.
+	uint32 sdLBA; // Next SD sector to be sent by the card.
+	uint32 sdEnd; // Never read ahead into the last SCSI sector.
+
+	int start; // Ring slot of the first buffered SD sector.
+	int buffered; // Number of SD sectors ready to send.
+	int dmaActive; // True if the SD sector after the buffered ones is in flight.
+	uint32 lastActivity;
+
+	uint32 lastEnd[MAX_SCSI_TARGETS]; // Per-target stream detection.
+
+	uint32 hits; // READ commands served from the open stream.
+	uint32 misses; // READ commands that had to discard the open stream.
+} ReadAhead;
+
+// Write-back cache and sequential write coalescing.
+// The SD multi-block write is left open after a sequential WRITE so the next
+// one can continue it without another ACMD23/CMD25 and stop token.
+// With WCE set, a WRITE also returns GOOD status as soon as all of its data
+// is in the scsiDev.data ring. The remaining sectors are written to the SD
+// card while the bus is free, or flushed before any command that needs the
+// card or the data buffer.
+typedef struct
+{
+	int writeBack; // True if the current WRITE may complete before the card.
+	int streaming; // True if the current WRITE continues the previous one.
+
+	int active; // True if the multi-block write is still open on the SD card.
+	int targetIndex; // Index into scsiDev.targets owning the data.
+	uint16_t bytesPerSector;
+	uint32 nextLBA; // SCSI LBA expected from the next WRITE.
+
+	int start; // Ring slot of the next SD sector to write.
+	int pending; // SD sectors still to be written, including the DMA.
+	int dmaActive; // True if the sector at start is in flight.
+	uint32 lastActivity;
+
+	uint32 lastEnd[MAX_SCSI_TARGETS]; // Per-target stream detection.
+
+	uint32 hits; // WRITE commands that continued the open stream.
+	uint32 misses; // WRITE commands that had to close the open stream.
+} WriteCache;
+
+// Background erase.
+// ERASE on MO targets, and FORMAT UNIT with CONFIG_ENABLE_FORMAT_ERASE,
+// queue a range of SD sectors and return GOOD status straight away. The
+// range is erased one allocation unit at a time while the bus is free.
+// A READ or WRITE of a queued sector waits for it to be erased first.
+typedef struct
+{
+	int active; // True if there are sectors left to erase.
+	int targetIndex; // Index into scsiDev.targets for errors.
+	int lun; // Logical unit of targetIndex for errors.
+	uint32 sdLBA; // First SD sector not yet erased.
+	uint32 sdEnd; // One past the last SD sector to erase.
+	uint32 chunkBlocks; // Size of the erase sent to the card, or 0.
+} EraseQueue;
+
+// WRITE SAME and FORMAT UNIT initialisation pattern fill.
+// The image of one SCSI block is received once, and the same buffer is sent
+// to the SD card for every block of a multi-block write. FORMAT UNIT with
+// IMMED set runs in the background while the bus is free. Until it's done,
+// the target reports FORMAT IN PROGRESS, and REQUEST SENSE reports the
+// progress.
+typedef struct
+{
+	int active; // True while the background fill is running.
+	int targetIndex; // Index into scsiDev.targets being filled.
+	uint8_t* pattern; // SD sector images for one SCSI block.
+	int patternSectors; // Number of SD sector images in pattern.
+	uint32 sdStart; // First SD sector. The start of a SCSI block.
+	uint32 sdLBA; // Next SD sector to write.
+	uint32 sdEnd; // One past the last SD sector.
+} PatternFill;
+
+// Block cache.
+// PRE-FETCH copies SD sectors into a small SRAM cache, and LOCK UNLOCK CACHE
+// pins them there. A READ of sectors that are all cached is sent without
+// touching the SD card, and WRITEs update any cached copy. Each target may
+// use up to cacheSectors entries from its config.
+// Each entry costs SD_SECTOR_SIZE bytes of SRAM, so the firmware doesn't
+// reserve any unless it's built with a larger BLOCK_CACHE_SECTORS, up to
+// CONFIG_CACHE_SECTORS.
+#ifndef BLOCK_CACHE_SECTORS
+#define BLOCK_CACHE_SECTORS 0
+#endif
+
+typedef struct
+{
+	uint32 sdLBA;
+	uint32 lastUse; // For least-recently-used replacement.
+	uint8_t valid;
+	uint8_t pinned; // Set by LOCK UNLOCK CACHE. Never replaced.
+	uint8_t targetIndex; // Index into scsiDev.targets that loaded it.
+	uint8_t reserved;
+} CacheEntry;
+
+typedef struct
+{
+	CacheEntry entries[BLOCK_CACHE_SECTORS];
+	int used; // Number of valid entries.
+	uint32 useCount;
+} BlockCache;
+
 extern BlockDevice blockDev;
 extern Transfer transfer;
+extern ReadAhead readAhead;
+extern WriteCache writeCache;
+extern EraseQueue eraseQueue;
+extern PatternFill formatFill;
+extern BlockCache blockCache;
 
 void scsiDiskInit(void);
 void scsiDiskReset(void);
 void scsiDiskPoll(void);
 int scsiDiskCommand(void);
+void scsiDiskCommandPrep(void);
+void scsiDiskReadAheadStop(void);
+void scsiDiskWriteCacheFlush(void);
+void scsiDiskErase(uint64 lba, uint64 blocks);
+int scsiDiskFormatProgress(uint16_t* progress);
+void scsiDiskCacheClear(void);
+int scsiDiskCacheSectors(const TargetConfig* cfg);
 
 #endif
@@ -20,14 +20,33 @@
 
 #include <string.h>
 
-uint32_t getScsiCapacity(
+uint64_t getScsiCapacity(
 	uint32_t sdSectorStart,
 	uint16_t bytesPerSector,
+	int packed,
 	uint32_t scsiSectors)
 {
-	uint32_t capacity =
-		(sdDev.capacity - sdSectorStart) /
-			SDSectorsPerSCSISector(bytesPerSector);
+	// SD cards only have 32 bit sector addresses, so the capacity always
+	// fits in 32 bits as well, unless packed sectors are smaller than 512
+	// bytes.
+	if (sdSectorStart >= sdDev.capacity)
+	{
+		return 0;
+	}
+
+	uint64_t capacity;
+	if (packed)
+	{
+		uint64_t bytes =
+			((uint64_t) (sdDev.capacity - sdSectorStart)) * SD_SECTOR_SIZE;
+		capacity = bytes / bytesPerSector;
+	}
+	else
+	{
+		capacity =
+			(sdDev.capacity - sdSectorStart) /
+				SDSectorsPerSCSISector(bytesPerSector);
+	}
 	if (scsiSectors && (capacity > scsiSectors))
 	{
 		capacity = scsiSectors;
@@ -39,11 +58,45 @@ uint32_t getScsiCapacity(
 uint32_t SCSISector2SD(
 	uint32_t sdSectorStart,
 	uint16_t bytesPerSector,
-	uint32_t scsiSector)
+	int packed,
+	uint64_t scsiSector)
 {
+	if (packed)
+	{
+		return (scsiSector * bytesPerSector) / SD_SECTOR_SIZE + sdSectorStart;
+	}
 	return scsiSector * SDSectorsPerSCSISector(bytesPerSector) + sdSectorStart;
 }
 
+uint32_t SCSIBlocks2SD(
+	uint16_t bytesPerSector,
+	int packed,
+	uint64_t scsiSector,
+	uint64_t blocks)
+{
+	if (packed && (blocks > 0))
+	{
+		uint64_t start = scsiSector * bytesPerSector;
+		uint64_t end = start + blocks * bytesPerSector;
+		return
+			(end + SD_SECTOR_SIZE - 1) / SD_SECTOR_SIZE -
+				start / SD_SECTOR_SIZE;
+	}
+	return blocks * SDSectorsPerSCSISector(bytesPerSector);
+}
+
+uint32_t SD2SCSIBlocks(
+	uint16_t bytesPerSector,
+	int packed,
+	uint32_t sdBlocks)
+{
+	if (packed)
+	{
+		return (((uint64_t) sdBlocks) * SD_SECTOR_SIZE) / bytesPerSector;
+	}
+	return sdBlocks / SDSectorsPerSCSISector(bytesPerSector);
+}
+
 // Standard mapping according to ECMA-107 and ISO/IEC 9293:1994
 // Sector always starts at 1. There is no 0 sector.
 uint64_t CHS2LBA(
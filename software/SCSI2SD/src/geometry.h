@@ -29,20 +29,57 @@ typedef enum
 	ADDRESS_PHYSICAL_SECTOR = 5
 } SCSI_ADDRESS_FORMAT;
 
+// Each SCSI sector starts on a new SD sector, unless packed is set. Then
+// SCSI sectors are stored back to back in the SD card byte stream, and the
+// first and last SD sector of a transfer may be shared with other SCSI
+// sectors. See CONFIG_ENABLE_PACKED_SECTORS.
 static inline int SDSectorsPerSCSISector(uint16_t bytesPerSector)
 {
 	return (bytesPerSector + SD_SECTOR_SIZE - 1) / SD_SECTOR_SIZE;
 }
 
-uint32_t getScsiCapacity(
+// SD sector addresses are 32 bits, but packed sectors smaller than
+// SD_SECTOR_SIZE give more SCSI sectors than that, so SCSI sector numbers
+// and counts are 64 bits.
+uint64_t getScsiCapacity(
 	uint32_t sdSectorStart,
 	uint16_t bytesPerSector,
+	int packed,
 	uint32_t scsiSectors);
 
+// Returns the SD sector holding the first byte of scsiSector.
 uint32_t SCSISector2SD(
 	uint32_t sdSectorStart,
 	uint16_t bytesPerSector,
-	uint32_t scsiSector);
+	int packed,
+	uint64_t scsiSector);
+
+// Returns the number of SD sectors holding any part of blocks SCSI sectors
+// starting at scsiSector.
+uint32_t SCSIBlocks2SD(
+	uint16_t bytesPerSector,
+	int packed,
+	uint64_t scsiSector,
+	uint64_t blocks);
+
+// Returns the number of whole SCSI sectors that fit in sdBlocks SD sectors,
+// starting at the beginning of an SD sector. The inverse of SCSIBlocks2SD.
+uint32_t SD2SCSIBlocks(
+	uint16_t bytesPerSector,
+	int packed,
+	uint32_t sdBlocks);
+
+// Returns the offset of scsiSector within the SD sector holding it.
+static inline int SCSISectorOffset(
+	uint16_t bytesPerSector,
+	int packed,
+	uint64_t scsiSector)
+{
+	// SD_SECTOR_SIZE divides 2^32, so only the low half of the product
+	// matters.
+	return packed ?
+		(((uint32_t) scsiSector) * bytesPerSector) % SD_SECTOR_SIZE : 0;
+}
 
 uint64_t CHS2LBA(
 	uint32_t c,
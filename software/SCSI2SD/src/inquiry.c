@@ -20,7 +20,10 @@
 #include "device.h"
 #include "scsi.h"
 #include "config.h"
+#include "disk.h"
+#include "geometry.h"
 #include "inquiry.h"
+#include "sd.h"
 
 #include <string.h>
 
@@ -93,6 +96,79 @@ static const uint8 AscImpOperatingDefinition[] =
 'S','C','S','I','-','2'
 };
 
+// The Block Limits page only applies to direct-access devices.
+static int hasBlockLimits()
+{
+	int deviceType = scsiDev.target->liveCfg.deviceType;
+	return (deviceType != CONFIG_OPTICAL) && (deviceType != CONFIG_SEQUENTIAL);
+}
+
+static void putBE32(uint8* out, uint32 value)
+{
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
+
+// Block Limits VPD page. Hosts that read it size their transfers from the
+// optimal transfer length. A whole SD card allocation unit is the fastest
+// write, and transfers in multiples of the data buffer keep the SCSI and SD
+// DMA pipeline full.
+static void blockLimits()
+{
+	const TargetConfig* config = scsiDev.target->cfg;
+	uint16_t bytesPerSector = scsiDev.target->liveCfg.bytesPerSector;
+	int packed = scsiDev.target->liveCfg.packed;
+
+	// 0 reports no limit. READ(12) and READ(16) have 32 bit transfer
+	// lengths, and each command only has to fit its own length field.
+	uint32 maxLength = config->maxTransferLength;
+
+	uint32 granularity = config->optimalTransferGranularity;
+	if (granularity == 0)
+	{
+		granularity = SD2SCSIBlocks(
+			bytesPerSector, packed, sizeof(scsiDev.data) / SD_SECTOR_SIZE);
+	}
+
+	uint32 optimalLength = config->optimalTransferLength;
+	if (optimalLength == 0)
+	{
+		optimalLength = SD2SCSIBlocks(bytesPerSector, packed, sdDev.auSectors);
+		if (optimalLength < granularity) optimalLength = granularity;
+		if (maxLength && (optimalLength > maxLength)) optimalLength = maxLength;
+	}
+
+	memset(scsiDev.data, 0, 64);
+	scsiDev.data[1] = 0xB0; // Page code
+	scsiDev.data[3] = 0x3C; // Page length
+
+	// WSNZ is clear. WRITE SAME with 0 blocks writes to the end of the
+	// medium.
+	scsiDev.data[6] = granularity > 0xFFFF ? 0xFF : granularity >> 8;
+	scsiDev.data[7] = granularity > 0xFFFF ? 0xFF : granularity;
+	putBE32(&scsiDev.data[8], maxLength);
+	putBE32(&scsiDev.data[12], optimalLength);
+
+	// PRE-FETCH is limited by the block cache. A packed range may start part
+	// way through an SD sector, so allow for one more.
+	uint32 cacheSectors = scsiDiskCacheSectors(config);
+	if (packed && cacheSectors)
+	{
+		cacheSectors--;
+	}
+	putBE32(
+		&scsiDev.data[16],
+		SD2SCSIBlocks(bytesPerSector, packed, cacheSectors));
+
+	// Maximum WRITE SAME length. Only WRITE SAME(10), with a 16 bit block
+	// count, is supported. Packed sectors reject it, so leave it unreported.
+	putBE32(&scsiDev.data[40], packed ? 0 : 0xFFFF);
+
+	scsiDev.dataLen = 64;
+}
+
 void scsiInquiry()
 {
 	uint8 evpd = scsiDev.cdb[1] & 1; // enable vital product data.
@@ -120,6 +196,10 @@ void scsiInquiry()
 			memcpy(&scsiDev.data[8], config->vendor, sizeof(config->vendor));
 			memcpy(&scsiDev.data[16], config->prodId, sizeof(config->prodId));
 			memcpy(&scsiDev.data[32], config->revision, sizeof(config->revision));
+			if (config->flags & CONFIG_ENABLE_TCQ)
+			{
+				scsiDev.data[7] |= 0x02; // CmdQue
+			}
 			scsiDev.dataLen = sizeof(StandardResponse) +
 				sizeof(config->vendor) +
 				sizeof(config->prodId) +
@@ -131,6 +211,11 @@ void scsiInquiry()
 	{
 		memcpy(scsiDev.data, SupportedVitalPages, sizeof(SupportedVitalPages));
 		scsiDev.dataLen = sizeof(SupportedVitalPages);
+		if (hasBlockLimits())
+		{
+			scsiDev.data[scsiDev.dataLen++] = 0xB0;
+			scsiDev.data[3]++;
+		}
 		scsiDev.phase = DATA_IN;
 	}
 	else if (pageCode == 0x80)
@@ -157,6 +242,11 @@ void scsiInquiry()
 		scsiDev.dataLen = sizeof(AscImpOperatingDefinition);
 		scsiDev.phase = DATA_IN;
 	}
+	else if ((pageCode == 0xB0) && hasBlockLimits())
+	{
+		blockLimits();
+		scsiDev.phase = DATA_IN;
+	}
 	else
 	{
 		// error.
@@ -195,27 +285,29 @@ void scsiInquiry()
 			scsiDev.dataLen = allocationLength;
 		}
 
-		// Set the device type as needed.
-		switch (scsiDev.target->cfg->deviceType)
+		// Set the device type as needed. Byte 1 of a VPD page is the page
+		// code, not the removable bit.
+		uint8 removable = evpd ? 0 : 0x80;
+		switch (scsiDev.target->liveCfg.deviceType)
 		{
 		case CONFIG_OPTICAL:
 			scsiDev.data[0] = 0x05; // device type
-			scsiDev.data[1] |= 0x80; // Removable bit.
+			scsiDev.data[1] |= removable;
 			break;
 
 		case CONFIG_SEQUENTIAL:
 			scsiDev.data[0] = 0x01; // device type
-			scsiDev.data[1] |= 0x80; // Removable bit.
+			scsiDev.data[1] |= removable;
 			break;
 			
 		case CONFIG_MO:
 			scsiDev.data[0] = 0x07; // device type
-			scsiDev.data[1] |= 0x80; // Removable bit.
+			scsiDev.data[1] |= removable;
 			break;
 
 		case CONFIG_FLOPPY_14MB:
 		case CONFIG_REMOVEABLE:
-			scsiDev.data[1] |= 0x80; // Removable bit.
+			scsiDev.data[1] |= removable;
 			break;
 		 default:
 			// Accept defaults for a fixed disk.
@@ -224,7 +316,7 @@ void scsiInquiry()
 	}
 
 	// Set the first byte to indicate LUN presence.
-	if (scsiDev.lun) // We only support lun 0
+	if (!scsiLunEnabled(scsiDev.target, scsiDev.lun))
 	{
 		scsiDev.data[0] = 0x7F;
 	}
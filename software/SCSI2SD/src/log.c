@@ -0,0 +1,193 @@
+//	Copyright (C) 2015 Michael McMaster <michael@codesrc.com>
+//
+//	This file is part of SCSI2SD.
+//
+//	SCSI2SD is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	SCSI2SD is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with SCSI2SD.  If not, see <http://www.gnu.org/licenses/>.
+#pragma GCC push_options
+#pragma GCC optimize("-flto")
+
+#include "device.h"
+#include "scsi.h"
+#include "disk.h"
+#include "log.h"
+#include "sd.h"
+#include "stats.h"
+#include "time.h"
+
+#include <string.h>
+
+// Vendor specific page with the performance counters.
+#define LOG_PAGE_PERFORMANCE 0x30
+
+static const uint8 SupportedLogPages[] =
+{
+	0x00, // Supported log pages
+	0x02, // Write error counter
+	0x03, // Read error counter
+	LOG_PAGE_PERFORMANCE
+};
+
+// Parameters below this code are left out. From the LOG SENSE CDB.
+static uint16 paramPointer;
+
+// Append a parameter with a len byte big-endian value to the page in
+// scsiDev.data. Returns the new page length.
+static int addParam(int pageLen, uint16 code, uint64 value, int len)
+{
+	if (code < paramPointer)
+	{
+		return pageLen;
+	}
+
+	uint8* param = &scsiDev.data[4 + pageLen];
+	param[0] = code >> 8;
+	param[1] = code;
+	param[2] = 0x00; // Bounded data counter
+	param[3] = len;
+
+	int i;
+	for (i = 0; i < len; ++i)
+	{
+		param[4 + i] = value >> (8 * (len - 1 - i));
+	}
+	return pageLen + 4 + len;
+}
+
+// Percentage of hits, or 0 if there haven't been any commands.
+static uint8 hitRatio(uint32 hits, uint32 misses)
+{
+	uint64 total = (uint64) hits + misses;
+	return total ? (uint8) ((uint64) hits * 100 / total) : 0;
+}
+
+// Read or write error counter page, for one CONFIG_STATS_CLASS. retries
+// is NULL if there's no count of rereads or rewrites.
+static int errorCounterPage(const CommandStats* s, const uint32_t* retries)
+{
+	int pageLen = 0;
+	if (retries)
+	{
+		pageLen = addParam(pageLen, 0x0002, *retries, 4); // Total rereads
+	}
+	pageLen = addParam(pageLen, 0x0005, s->bytes, 8); // Total bytes processed
+	pageLen = addParam(pageLen, 0x0006, s->errors, 4); // Uncorrected errors
+	return pageLen;
+}
+
+// Counters for tracking throughput from the host side. The read-ahead and
+// write cache counters are shared by all targets.
+static int performancePage(int tgtIndex)
+{
+	const CommandStats* s = stats[tgtIndex];
+	int pageLen = 0;
+
+	pageLen = addParam(pageLen, 0x0000, s[CONFIG_STATS_READ].commands, 4);
+	pageLen = addParam(pageLen, 0x0001, s[CONFIG_STATS_WRITE].commands, 4);
+	pageLen = addParam(pageLen, 0x0002, s[CONFIG_STATS_OTHER].commands, 4);
+	pageLen = addParam(pageLen, 0x0003, s[CONFIG_STATS_READ].bytes, 8);
+	pageLen = addParam(pageLen, 0x0004, s[CONFIG_STATS_WRITE].bytes, 8);
+
+	// SD card busy time, in milliseconds.
+	pageLen = addParam(
+		pageLen,
+		0x0005,
+		targetStats[tgtIndex].sdBusyCycles / (CYCLES_PER_US * 1000),
+		4);
+	pageLen = addParam(pageLen, 0x0006, targetStats[tgtIndex].disconnects, 4);
+
+	pageLen = addParam(pageLen, 0x0007, readAhead.hits, 4);
+	pageLen = addParam(pageLen, 0x0008, readAhead.misses, 4);
+	pageLen = addParam(
+		pageLen, 0x0009, hitRatio(readAhead.hits, readAhead.misses), 1);
+	pageLen = addParam(pageLen, 0x000A, writeCache.hits, 4);
+	pageLen = addParam(pageLen, 0x000B, writeCache.misses, 4);
+	pageLen = addParam(
+		pageLen, 0x000C, hitRatio(writeCache.hits, writeCache.misses), 1);
+	return pageLen;
+}
+
+void scsiLogSense()
+{
+	// LOG SENSE
+	int sp = scsiDev.cdb[1] & 0x01; // Save Parameters
+	int pc = scsiDev.cdb[2] >> 6; // Page Control
+	int pageCode = scsiDev.cdb[2] & 0x3F;
+	int allocLength =
+		(((uint16) scsiDev.cdb[7]) << 8) +
+		scsiDev.cdb[8];
+	int tgtIndex = scsiDev.target - scsiDev.targets;
+
+	paramPointer =
+		(((uint16) scsiDev.cdb[5]) << 8) +
+		scsiDev.cdb[6];
+
+	// There are no thresholds, and the counters can't be reset. Only the
+	// cumulative values are non-zero.
+	int pageLen = -1;
+	if (sp)
+	{
+		// Nowhere to save them.
+	}
+	else if (pageCode == 0x00)
+	{
+		pageLen = sizeof(SupportedLogPages);
+		memcpy(&scsiDev.data[4], SupportedLogPages, pageLen);
+	}
+	else if (pc != 1)
+	{
+		if ((pageCode == 0x02) || (pageCode == 0x03) ||
+			(pageCode == LOG_PAGE_PERFORMANCE))
+		{
+			pageLen = 0;
+		}
+	}
+	else if (pageCode == 0x02)
+	{
+		pageLen = errorCounterPage(&stats[tgtIndex][CONFIG_STATS_WRITE], NULL);
+	}
+	else if (pageCode == 0x03)
+	{
+		pageLen = errorCounterPage(
+			&stats[tgtIndex][CONFIG_STATS_READ], &sdDev.readRetries);
+	}
+	else if (pageCode == LOG_PAGE_PERFORMANCE)
+	{
+		pageLen = performancePage(tgtIndex);
+	}
+
+	if (pageLen < 0)
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = ILLEGAL_REQUEST;
+		scsiDev.target->sense.asc = INVALID_FIELD_IN_CDB;
+		scsiDev.phase = STATUS;
+	}
+	else
+	{
+		scsiDev.data[0] = pageCode;
+		scsiDev.data[1] = 0;
+		scsiDev.data[2] = pageLen >> 8;
+		scsiDev.data[3] = pageLen;
+
+		scsiDev.dataLen = 4 + pageLen;
+		if (scsiDev.dataLen > allocLength)
+		{
+			// Silently truncate results.
+			scsiDev.dataLen = allocLength;
+		}
+		scsiDev.phase = DATA_IN;
+	}
+}
+
+#pragma GCC pop_options
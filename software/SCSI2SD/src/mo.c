@@ -21,7 +21,34 @@
 #include "scsi.h"
 #include "config.h"
 #include "mo.h"
+#include "disk.h"
+#include "geometry.h"
 
+static void doMOErase(uint32 lba, uint32 blocks)
+{
+	uint64 eraseBlocks = blocks;
+	int era = scsiDev.cdb[1] & 0x04; // Erase all remaining blocks.
+	if (era)
+	{
+		uint64 capacity = getScsiCapacity(
+			scsiDev.target->liveCfg.sdSectorStart,
+			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->liveCfg.packed,
+			scsiDev.target->liveCfg.scsiSectors);
+		if (blocks || (lba > capacity))
+		{
+			scsiDev.status = CHECK_CONDITION;
+			scsiDev.target->sense.code = ILLEGAL_REQUEST;
+			scsiDev.target->sense.asc = INVALID_FIELD_IN_CDB;
+			scsiDev.phase = STATUS;
+			return;
+		}
+		eraseBlocks = capacity - lba;
+	}
+
+	// Writes to erased SD sectors are faster than overwrites.
+	scsiDiskErase(lba, eraseBlocks);
+}
 
 // Handle magneto-optical scsi device commands
 int scsiMOCommand()
@@ -29,11 +56,36 @@ int scsiMOCommand()
 	int commandHandled = 0;
 
 	uint8 command = scsiDev.cdb[0];
-	if ((command == 0x2C) || // ERASE(10)
-		(command == 0xAC)) // ERASE(12)
+	if (command == 0x2C)
+	{
+		// ERASE(10)
+		uint32 lba =
+			(((uint32) scsiDev.cdb[2]) << 24) +
+			(((uint32) scsiDev.cdb[3]) << 16) +
+			(((uint32) scsiDev.cdb[4]) << 8) +
+			scsiDev.cdb[5];
+		uint32 blocks =
+			(((uint32) scsiDev.cdb[7]) << 8) +
+			scsiDev.cdb[8];
+
+		doMOErase(lba, blocks);
+		commandHandled = 1;
+	}
+	else if (command == 0xAC)
 	{
-		// TODO consider sending an erase command to the SD card.
+		// ERASE(12)
+		uint32 lba =
+			(((uint32) scsiDev.cdb[2]) << 24) +
+			(((uint32) scsiDev.cdb[3]) << 16) +
+			(((uint32) scsiDev.cdb[4]) << 8) +
+			scsiDev.cdb[5];
+		uint32 blocks =
+			(((uint32) scsiDev.cdb[6]) << 24) +
+			(((uint32) scsiDev.cdb[7]) << 16) +
+			(((uint32) scsiDev.cdb[8]) << 8) +
+			scsiDev.cdb[9];
 
+		doMOErase(lba, blocks);
 		commandHandled = 1;
 	}
 
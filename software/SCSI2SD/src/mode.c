@@ -67,9 +67,10 @@ static const uint8 DisconnectReconnectPage[] =
 {
 0x02, // Page code
 0x0E, // Page length
-0, // Buffer full ratio
+0, // Buffer full ratio. Changeable.
 0, // Buffer empty ratio
-0x00, 10, // Bus inactivity limit, 100us increments. Allow 1ms.
+DEFAULT_BUS_INACTIVITY_LIMIT >> 8, // Bus inactivity limit, 100us increments.
+DEFAULT_BUS_INACTIVITY_LIMIT & 0xFF, // Changeable.
 0x00, 0x00, // Disconnect time limit
 0x00, 0x00, // Connect time limit
 0x00, 0x00, // Maximum burst size
@@ -81,9 +82,10 @@ static const uint8 DisconnectReconnectPage_SCSI1[] =
 {
 0x02, // Page code
 0x0A, // Page length
-0, // Buffer full ratio
+0, // Buffer full ratio. Changeable.
 0, // Buffer empty ratio
-0x00, 10, // Bus inactivity limit, 100us increments. Allow 1ms.
+DEFAULT_BUS_INACTIVITY_LIMIT >> 8, // Bus inactivity limit, 100us increments.
+DEFAULT_BUS_INACTIVITY_LIMIT & 0xFF, // Changeable.
 0x00, 0x00, // Disconnect time limit
 0x00, 0x00, // Connect time limit
 0x00, 0x00 // Maximum burst size
@@ -142,7 +144,7 @@ static const uint8 CachingPage[] =
 {
 0x08, // Page Code
 0x0A, // Page length
-0x01, // Read cache disable
+0x01, // Read cache disable. WCE set from liveCfg.
 0x00, // No useful rention policy.
 0x00, 0x00, // Pre-fetch always disabled
 0x00, 0x00, // Minimum pre-fetch
@@ -210,7 +212,7 @@ static void doModeSense(
 	uint8_t mediumType = 0;
 	uint8_t deviceSpecificParam = 0;
 	uint8_t density = 0;
-	switch (scsiDev.target->cfg->deviceType)
+	switch (scsiDev.target->liveCfg.deviceType)
 	{
 	case CONFIG_FIXED:
 	case CONFIG_REMOVEABLE:
@@ -323,6 +325,7 @@ static void doModeSense(
 	if (pageCode == 0x02 || pageCode == 0x3F)
 	{
 		pageFound = 1;
+		int pageIdx = idx;
 		if ((scsiDev.compatMode >= COMPAT_SCSI2))
 		{
 			pageIn(pc, idx, DisconnectReconnectPage, sizeof(DisconnectReconnectPage));
@@ -333,6 +336,22 @@ static void doModeSense(
 			pageIn(pc, idx, DisconnectReconnectPage_SCSI1, sizeof(DisconnectReconnectPage_SCSI1));
 			idx += sizeof(DisconnectReconnectPage_SCSI1);
 		}
+
+		// Both versions have the same layout for the fields we use.
+		if (pc == 0x01)
+		{
+			scsiDev.data[pageIdx+2] = 0xFF; // Buffer full ratio
+			scsiDev.data[pageIdx+4] = 0xFF; // Bus inactivity limit
+			scsiDev.data[pageIdx+5] = 0xFF;
+		}
+		else if (pc == 0x00)
+		{
+			// Saved and default values are the page defaults.
+			const LiveCfg* live = &scsiDev.target->liveCfg;
+			scsiDev.data[pageIdx+2] = live->bufferFullRatio;
+			scsiDev.data[pageIdx+4] = live->busInactivityLimit >> 8;
+			scsiDev.data[pageIdx+5] = live->busInactivityLimit & 0xFF;
+		}
 	}
 
 	if (pageCode == 0x03 || pageCode == 0x3F)
@@ -374,15 +393,18 @@ static void doModeSense(
 
 		if (pc != 0x01)
 		{
-			// Need to fill out the number of cylinders.
+			// Need to fill out the number of cylinders. There's only room
+			// for 24 bits, so a 32 bit capacity is plenty.
 			uint32 cyl;
 			uint8 head;
 			uint32 sector;
+			uint64 capacity = getScsiCapacity(
+				scsiDev.target->liveCfg.sdSectorStart,
+				scsiDev.target->liveCfg.bytesPerSector,
+				scsiDev.target->liveCfg.packed,
+				scsiDev.target->liveCfg.scsiSectors);
 			LBA2CHS(
-				getScsiCapacity(
-					scsiDev.target->cfg->sdSectorStart,
-					scsiDev.target->liveCfg.bytesPerSector,
-					scsiDev.target->cfg->scsiSectors),
+				(capacity > 0xFFFFFFFF) ? 0xFFFFFFFF : capacity,
 				&cyl,
 				&head,
 				&sector,
@@ -419,6 +441,21 @@ static void doModeSense(
 	{
 		pageFound = 1;
 		pageIn(pc, idx, CachingPage, sizeof(CachingPage));
+		if (pc == 0x01)
+		{
+			scsiDev.data[idx+2] = 0x04; // WCE is changeable.
+		}
+		else
+		{
+			// Saved and default values come from flash.
+			int wce = (pc == 0x00) ?
+				(scsiDev.target->liveCfg.flags & CONFIG_ENABLE_WRITE_CACHE) :
+				configWriteCache(scsiDev.target->cfg, scsiDev.target->lun);
+			if (wce)
+			{
+				scsiDev.data[idx+2] |= 0x04; // WCE
+			}
+		}
 		idx += sizeof(CachingPage);
 	}
 
@@ -427,10 +464,17 @@ static void doModeSense(
 	{
 		pageFound = 1;
 		pageIn(pc, idx, ControlModePage, sizeof(ControlModePage));
+		if ((pc != 0x01) &&
+			(scsiDev.target->cfg->flags & CONFIG_ENABLE_TCQ))
+		{
+			// Unrestricted reordering allowed, tagged queuing enabled.
+			// QErr is 0. Queued commands wait out a contingent allegiance.
+			scsiDev.data[idx+3] = 0x10;
+		}
 		idx += sizeof(ControlModePage);
 	}
 
-	if ((scsiDev.target->cfg->deviceType == CONFIG_SEQUENTIAL) &&
+	if ((scsiDev.target->liveCfg.deviceType == CONFIG_SEQUENTIAL) &&
 		(pageCode == 0x10 || pageCode == 0x3F))
 	{
 		pageFound = 1;
@@ -518,11 +562,13 @@ static void doModeSelect(void)
 			}
 			else
 			{
+				// Only written to flash if it has changed.
 				scsiDev.target->liveCfg.bytesPerSector = bytesPerSector;
-				if (bytesPerSector != scsiDev.target->cfg->bytesPerSector)
-				{
-					configSave(scsiDev.target->targetId, bytesPerSector);
-				}
+				configSave(
+					scsiDev.target->targetId,
+					scsiDev.target->lun,
+					bytesPerSector,
+					-1);
 			}
 		}
 		idx += blockDescLen;
@@ -535,6 +581,18 @@ static void doModeSelect(void)
 			int pageCode = scsiDev.data[idx] & 0x3F;
 			switch (pageCode)
 			{
+			case 0x02: // Disconnect-Reconnect Page
+			{
+				if (pageLen < 4) goto bad;
+
+				// Only used for reads. See scsiDiskPoll.
+				// There's nowhere to save these, so ignore the SP flag.
+				scsiDev.target->liveCfg.bufferFullRatio = scsiDev.data[idx+2];
+				scsiDev.target->liveCfg.busInactivityLimit =
+					(((uint16_t)scsiDev.data[idx+4]) << 8) |
+					scsiDev.data[idx+5];
+			}
+			break;
 			case 0x03: // Format Device Page
 			{
 				if (pageLen != 0x16) goto bad;
@@ -554,7 +612,37 @@ static void doModeSelect(void)
 				scsiDev.target->liveCfg.bytesPerSector = bytesPerSector;
 				if (scsiDev.cdb[1] & 1) // SP Save Pages flag
 				{
-					configSave(scsiDev.target->targetId, bytesPerSector);
+					configSave(
+						scsiDev.target->targetId,
+						scsiDev.target->lun,
+						bytesPerSector,
+						-1);
+				}
+			}
+			break;
+			case 0x08: // Caching Page
+			{
+				if (pageLen < 1) goto bad;
+
+				// Any cached writes have already been flushed by
+				// scsiDiskCommandPrep.
+				if (scsiDev.data[idx+2] & 0x04) // WCE
+				{
+					scsiDev.target->liveCfg.flags |= CONFIG_ENABLE_WRITE_CACHE;
+				}
+				else
+				{
+					scsiDev.target->liveCfg.flags &= ~CONFIG_ENABLE_WRITE_CACHE;
+				}
+
+				if (scsiDev.cdb[1] & 1) // SP Save Pages flag
+				{
+					configSave(
+						scsiDev.target->targetId,
+						scsiDev.target->lun,
+						scsiDev.target->liveCfg.bytesPerSector,
+						(scsiDev.target->liveCfg.flags &
+							CONFIG_ENABLE_WRITE_CACHE) ? 1 : 0);
 				}
 			}
 			break;
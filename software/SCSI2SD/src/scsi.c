@@ -26,8 +26,10 @@
 #include "disk.h"
 #include "inquiry.h"
 #include "led.h"
+#include "log.h"
 #include "mode.h"
 #include "disk.h"
+#include "stats.h"
 #include "time.h"
 #include "cdrom.h"
 #include "debug.h"
@@ -46,6 +48,9 @@ static void enter_DataIn(int len);
 static void process_DataIn(void);
 static void process_DataOut(void);
 static void process_Command(void);
+static void execute_Command(void);
+static void process_Reselection(void);
+static void queueCommand(void);
 
 static void doReserveRelease(void);
 
@@ -105,6 +110,7 @@ void process_MessageIn()
 		scsiDev.status = GOOD;
 		transfer.blocks = 0;
 		transfer.currentBlock = 0;
+		statsCommandStart();
 	}
 	else /*if (scsiDev.msgIn == MSG_COMMAND_COMPLETE)*/
 	{
@@ -153,6 +159,15 @@ void process_Status()
 		message = MSG_COMMAND_COMPLETE;
 	}
 	scsiWriteByte(scsiDev.status);
+	statsCommandDone();
+
+	if (scsiDev.status == CHECK_CONDITION)
+	{
+		// Hold any queued commands from this I_T_L nexus until the
+		// initiator has had a chance to fetch the sense data.
+		scsiDev.target->contingentId[scsiDev.lun & 7] =
+			scsiDev.initiatorId;
+	}
 
 	scsiDev.lastStatus = scsiDev.status;
 	scsiDev.lastSense = scsiDev.target->sense.code;
@@ -185,6 +200,7 @@ static void process_DataIn()
 		scsiEnterPhase(DATA_IN);
 		scsiWrite(scsiDev.data + scsiDev.dataPtr, len);
 		scsiDev.dataPtr += len;
+		scsiDev.cmdDataBytes += len;
 	}
 
 	if ((scsiDev.dataPtr >= scsiDev.dataLen) &&
@@ -211,6 +227,7 @@ static void process_DataOut()
 
 		scsiRead(scsiDev.data + scsiDev.dataPtr, len);
 		scsiDev.dataPtr += len;
+		scsiDev.cmdDataBytes += len;
 
 		if (scsiDev.parityError &&
 			(scsiDev.target->cfg->flags & CONFIG_ENABLE_PARITY) &&
@@ -236,11 +253,10 @@ static void process_DataOut()
 	}
 }
 
-static const uint8 CmdGroupBytes[8] = {6, 10, 10, 6, 6, 12, 6, 6};
+static const uint8 CmdGroupBytes[8] = {6, 10, 10, 6, 16, 12, 6, 6};
 static void process_Command()
 {
 	int group;
-	uint8 command;
 	uint8 control;
 
 	scsiEnterPhase(COMMAND);
@@ -253,8 +269,6 @@ static void process_Command()
 	scsiDev.cdbLen = CmdGroupBytes[group];
 	scsiRead(scsiDev.cdb + 1, scsiDev.cdbLen - 1);
 
-	command = scsiDev.cdb[0];
-
 	// Prefer LUN's set by IDENTIFY messages for newer hosts.
 	if (scsiDev.lun < 0)
 	{
@@ -266,6 +280,12 @@ static void process_Command()
 	scsiDev.cmdCount++;
 	TargetConfig* cfg = scsiDev.target->cfg;
 
+	// Any new command from the initiator ends its contingent allegiance.
+	if (scsiDev.target->contingentId[scsiDev.lun & 7] == scsiDev.initiatorId)
+	{
+		scsiDev.target->contingentId[scsiDev.lun & 7] = -1;
+	}
+
 	if (unlikely(scsiDev.resetFlag))
 	{
 		// Don't log bogus commands
@@ -281,7 +301,103 @@ static void process_Command()
 		scsiDev.target->sense.asc = SCSI_PARITY_ERROR;
 		enter_Status(CHECK_CONDITION);
 	}
-	else if ((control & 0x02) && ((control & 0x01) == 0))
+	else if (unlikely(scsiDev.queueOnly) ||
+		(((scsiDev.tagType == MSG_SIMPLE_QUEUE_TAG) ||
+				(scsiDev.tagType == MSG_ORDERED_QUEUE_TAG)) &&
+			scsiDev.discPriv &&
+			scsiDev.queueLen &&
+			!(control & 0x01))) // Linked commands must run back-to-back.
+	{
+		// Wait behind the commands already queued.
+		queueCommand();
+	}
+	else
+	{
+		// Untagged, HEAD OF QUEUE, or nothing else to wait for.
+		execute_Command();
+	}
+}
+
+int scsiLunEnabled(const TargetState* target, int lun)
+{
+	return (lun == 0) ||
+		((lun > 0) &&
+			(lun < CONFIG_MAX_LUNS) &&
+			(target->cfg->luns[lun - 1].flags & CONFIG_LUN_ENABLED));
+}
+
+static void saveLun(TargetState* target)
+{
+	LunState* state = &target->luns[target->lun];
+	state->liveCfg = target->liveCfg;
+	state->sense = target->sense;
+	state->unitAttention = target->unitAttention;
+	state->deferredSense = target->deferredSense;
+	state->deferredReported = target->deferredReported;
+	state->reservedId = target->reservedId;
+	state->reserverId = target->reserverId;
+}
+
+static void loadLun(TargetState* target, int lun)
+{
+	const LunState* state = &target->luns[lun];
+	target->liveCfg = state->liveCfg;
+	target->sense = state->sense;
+	target->unitAttention = state->unitAttention;
+	target->deferredSense = state->deferredSense;
+	target->deferredReported = state->deferredReported;
+	target->reservedId = state->reservedId;
+	target->reserverId = state->reserverId;
+	target->lun = lun;
+}
+
+// Make lun the logical unit that the target's per-LUN fields describe.
+// The read-ahead and write cache streams are addressed by SCSI LBA, so any
+// belonging to the previous LUN are closed and forgotten first. Background
+// format fills report their errors against whichever LUN is current.
+static void scsiSelectLun(TargetState* target, int lun)
+{
+	if ((target->lun != lun) && scsiLunEnabled(target, lun))
+	{
+		int tgtIndex = target - scsiDev.targets;
+		if (readAhead.active && (readAhead.targetIndex == tgtIndex))
+		{
+			scsiDiskReadAheadStop();
+		}
+		if (writeCache.active && (writeCache.targetIndex == tgtIndex))
+		{
+			scsiDiskWriteCacheFlush();
+		}
+		readAhead.lastEnd[tgtIndex] = 0xFFFFFFFF;
+		writeCache.lastEnd[tgtIndex] = 0xFFFFFFFF;
+
+		saveLun(target);
+		loadLun(target, lun);
+	}
+}
+
+// Run the command in scsiDev.cdb. It has either just been received, or has
+// been taken from the queue after reselection.
+static void execute_Command()
+{
+	uint8 command = scsiDev.cdb[0];
+	uint8 control = scsiDev.cdb[scsiDev.cdbLen - 1];
+	const TargetConfig* cfg = scsiDev.target->cfg;
+
+	scsiSelectLun(scsiDev.target, scsiDev.lun);
+	scsiDiskCommandPrep();
+
+	if (unlikely(scsiDev.target->deferredReported) && (command != 0x03))
+	{
+		// The initiator didn't ask for the deferred error.
+		scsiDev.target->deferredSense.code = NO_SENSE;
+		scsiDev.target->deferredSense.asc = NO_ADDITIONAL_SENSE_INFORMATION;
+		scsiDev.target->deferredReported = 0;
+	}
+
+	uint8_t deviceType = scsiDev.target->liveCfg.deviceType;
+
+	if ((control & 0x02) && ((control & 0x01) == 0))
 	{
 		// FLAG set without LINK flag.
 		scsiDev.target->sense.code = ILLEGAL_REQUEST;
@@ -301,9 +417,20 @@ static void process_Command()
 		// Newer initiators won't be specifying 0 anyway.
 		if (allocLength == 0) allocLength = 4;
 
+		// A write that failed after GOOD status was returned is reported
+		// as a deferred error, ahead of any sense for the current command.
+		int deferred = scsiDev.target->deferredSense.code != NO_SENSE;
+		const ScsiSense* sense = deferred ?
+			&scsiDev.target->deferredSense : &scsiDev.target->sense;
+
 		memset(scsiDev.data, 0, 256); // Max possible alloc length
-		scsiDev.data[0] = 0xF0;
-		scsiDev.data[2] = scsiDev.target->sense.code & 0x0F;
+		// The information field only has room for 32 bit LBAs.
+		scsiDev.data[0] = deferred ? 0x71 : 0x70;
+		if (!(transfer.lba >> 32))
+		{
+			scsiDev.data[0] |= 0x80; // Valid
+		}
+		scsiDev.data[2] = sense->code & 0x0F;
 
 		scsiDev.data[3] = transfer.lba >> 24;
 		scsiDev.data[4] = transfer.lba >> 16;
@@ -312,15 +439,40 @@ static void process_Command()
 
 		// Additional bytes if there are errors to report
 		scsiDev.data[7] = 10; // additional length
-		scsiDev.data[12] = scsiDev.target->sense.asc >> 8;
-		scsiDev.data[13] = scsiDev.target->sense.asc;
+		scsiDev.data[12] = sense->asc >> 8;
+		scsiDev.data[13] = sense->asc;
+
+		uint16_t progress;
+		if (!deferred &&
+			scsiDiskFormatProgress(&progress) &&
+			((scsiDev.target->sense.code == NO_SENSE) ||
+				(scsiDev.target->sense.asc ==
+					LOGICAL_UNIT_NOT_READY_FORMAT_IN_PROGRESS)))
+		{
+			// Sense key specific progress indication.
+			scsiDev.data[2] = NOT_READY;
+			scsiDev.data[12] = LOGICAL_UNIT_NOT_READY_FORMAT_IN_PROGRESS >> 8;
+			scsiDev.data[13] = LOGICAL_UNIT_NOT_READY_FORMAT_IN_PROGRESS & 0xFF;
+			scsiDev.data[15] = 0x80; // SKSV
+			scsiDev.data[16] = progress >> 8;
+			scsiDev.data[17] = progress;
+		}
 
 		// Silently truncate results. SCSI-2 spec 8.2.14.
 		enter_DataIn(allocLength);
 
 		// This is a good time to clear out old sense information.
-		scsiDev.target->sense.code = NO_SENSE;
-		scsiDev.target->sense.asc = NO_ADDITIONAL_SENSE_INFORMATION;
+		if (deferred)
+		{
+			scsiDev.target->deferredSense.code = NO_SENSE;
+			scsiDev.target->deferredSense.asc = NO_ADDITIONAL_SENSE_INFORMATION;
+			scsiDev.target->deferredReported = 0;
+		}
+		else
+		{
+			scsiDev.target->sense.code = NO_SENSE;
+			scsiDev.target->sense.asc = NO_ADDITIONAL_SENSE_INFORMATION;
+		}
 	}
 	// Some old SCSI drivers do NOT properly support
 	// unitAttention. eg. the Mac Plus would trigger a SCSI reset
@@ -338,7 +490,16 @@ static void process_Command()
 
 		enter_Status(CHECK_CONDITION);
 	}
-	else if (scsiDev.lun)
+	else if (unlikely(scsiDev.target->deferredSense.code != NO_SENSE))
+	{
+		// A cached write failed after we returned GOOD status. The sense
+		// stays in deferredSense until REQUEST SENSE.
+		scsiDev.target->deferredReported = 1;
+		enter_Status(CHECK_CONDITION);
+		scsiDev.lastSense = scsiDev.target->deferredSense.code;
+		scsiDev.lastSenseASC = scsiDev.target->deferredSense.asc;
+	}
+	else if (!scsiLunEnabled(scsiDev.target, scsiDev.lun))
 	{
 		scsiDev.target->sense.code = ILLEGAL_REQUEST;
 		scsiDev.target->sense.asc = LOGICAL_UNIT_NOT_SUPPORTED;
@@ -355,9 +516,9 @@ static void process_Command()
 	}
 	// Handle odd device types first that may override basic read and
 	// write commands. Will fall-through to generic disk handling.
-	else if (((cfg->deviceType == CONFIG_OPTICAL) && scsiCDRomCommand()) ||
-		((cfg->deviceType == CONFIG_SEQUENTIAL) && scsiTapeCommand()) ||
-		((cfg->deviceType == CONFIG_MO) && scsiMOCommand()))
+	else if (((deviceType == CONFIG_OPTICAL) && scsiCDRomCommand()) ||
+		((deviceType == CONFIG_SEQUENTIAL) && scsiTapeCommand()) ||
+		((deviceType == CONFIG_MO) && scsiMOCommand()))
 	{
 		// Already handled.
 	}
@@ -367,6 +528,10 @@ static void process_Command()
 		// check for the performance-critical read/write
 		// commands ASAP.
 	}
+	else if (command == 0x4D)
+	{
+		scsiLogSense();
+	}
 	else if (command == 0x1C)
 	{
 		scsiReceiveDiagnostic();
@@ -398,6 +563,221 @@ static void process_Command()
 
 }
 
+// Only READ commands may be reordered. Anything else runs in the order it
+// was received, after all of the commands before it.
+static int isReorderable(const TargetState* target, const QueuedCommand* q)
+{
+	const LiveCfg* liveCfg = (q->lun == target->lun) ?
+		&target->liveCfg : &target->luns[q->lun & 7].liveCfg;
+	return (q->tagType == MSG_SIMPLE_QUEUE_TAG) &&
+		((q->cdb[0] == 0x08) || (q->cdb[0] == 0x28) ||
+			(q->cdb[0] == 0xA8) || (q->cdb[0] == 0x88)) &&
+		(liveCfg->deviceType != CONFIG_SEQUENTIAL);
+}
+
+static uint32 queuedLBA(const QueuedCommand* q)
+{
+	if (q->cdb[0] == 0x08)
+	{
+		return
+			(((uint32) q->cdb[1] & 0x1F) << 16) +
+			(((uint32) q->cdb[2]) << 8) +
+			q->cdb[3];
+	}
+	else if (q->cdb[0] == 0x88)
+	{
+		// Only the low 32 bits, like readAhead.lastEnd. Only packed
+		// sectors go any higher.
+		return
+			(((uint32) q->cdb[6]) << 24) +
+			(((uint32) q->cdb[7]) << 16) +
+			(((uint32) q->cdb[8]) << 8) +
+			q->cdb[9];
+	}
+	else
+	{
+		return
+			(((uint32) q->cdb[2]) << 24) +
+			(((uint32) q->cdb[3]) << 16) +
+			(((uint32) q->cdb[4]) << 8) +
+			q->cdb[5];
+	}
+}
+
+static int isBlocked(const TargetState* target, const QueuedCommand* q)
+{
+	return target->contingentId[q->lun & 7] == q->initiatorId;
+}
+
+// Index of the next command to run, or -1 if they're all blocked by a
+// contingent allegiance. Commands run in the order they were received,
+// except that a READ continuing the read-ahead stream is moved ahead of
+// the reads before it. The SD card has no seek time, so sorting the other
+// reads by address gains nothing. See test/tcqSim.c. Only reads for the
+// current LUN, received before any non-reorderable command, are considered.
+static int queueNext(const TargetState* target)
+{
+	int first = 0;
+	while ((first < target->queueLen) &&
+		isBlocked(target, &target->queue[first]))
+	{
+		++first;
+	}
+	if ((first == target->queueLen) ||
+		(target->queue[first].lun != target->lun))
+	{
+		// Nothing to run, or no read-ahead stream to continue.
+		return first < target->queueLen ? first : -1;
+	}
+
+	uint32 head = readAhead.lastEnd[target - scsiDev.targets];
+	int i;
+	for (i = first; i < target->queueLen; ++i)
+	{
+		const QueuedCommand* q = &target->queue[i];
+		if ((q->lun != target->lun) || isBlocked(target, q))
+		{
+			continue;
+		}
+		else if (!isReorderable(target, q))
+		{
+			break;
+		}
+		else if (queuedLBA(q) == head)
+		{
+			return i;
+		}
+	}
+	return first;
+}
+
+// Remove queued commands from a target. An initiatorId or tag of -1 matches
+// anything.
+static void queueRemove(TargetState* target, int initiatorId, int tag)
+{
+	int i = 0;
+	while (i < target->queueLen)
+	{
+		QueuedCommand* q = &target->queue[i];
+		if (((initiatorId < 0) || (q->initiatorId == initiatorId)) &&
+			((tag < 0) || (q->tag == tag)))
+		{
+			target->queueLen--;
+			scsiDev.queueLen--;
+			memmove(q, q + 1, (target->queueLen - i) * sizeof(QueuedCommand));
+		}
+		else
+		{
+			++i;
+		}
+	}
+}
+
+// Save the received command and disconnect. The initiator is reselected
+// once the command reaches the front of the queue.
+static void queueCommand()
+{
+	TargetState* target = scsiDev.target;
+	if (!scsiDev.discPriv ||
+		(scsiDev.cdb[scsiDev.cdbLen - 1] & 0x01)) // Linked
+	{
+		// Another command is using the SD card, and this one can't wait
+		// for it while disconnected.
+		enter_Status(BUSY);
+	}
+	else if (target->queueLen >= SCSI_QUEUE_DEPTH)
+	{
+		enter_Status(scsiDev.tagType ? QUEUE_FULL : BUSY);
+	}
+	else
+	{
+		QueuedCommand* q = &target->queue[target->queueLen];
+		memcpy(q->cdb, scsiDev.cdb, sizeof(q->cdb));
+		q->cdbLen = scsiDev.cdbLen;
+		q->tagType = scsiDev.tagType;
+		q->tag = scsiDev.tag;
+		q->lun = scsiDev.lun;
+		q->initiatorId = scsiDev.initiatorId;
+		q->startTime = scsiDev.cmdStartTime;
+		target->queueLen++;
+		scsiDev.queueLen++;
+
+		scsiEnterPhase(MESSAGE_IN);
+		scsiWriteByte(0x04); // disconnect msg.
+		statsDisconnect();
+		enter_BusFree();
+	}
+}
+
+static void process_Reselection()
+{
+	// Take turns between targets so a busy one can't starve the others.
+	TargetState* target = NULL;
+	int tgtIndex = 0;
+	int next = -1;
+	int i;
+	for (i = 0; (i < MAX_SCSI_TARGETS) && (next < 0); ++i)
+	{
+		tgtIndex = (scsiDev.nextReselect + i) % MAX_SCSI_TARGETS;
+		target = &scsiDev.targets[tgtIndex];
+		next = target->queueLen ? queueNext(target) : -1;
+	}
+	if (next < 0)
+	{
+		// Waiting for REQUEST SENSE.
+		return;
+	}
+
+	QueuedCommand* q = &target->queue[next];
+
+	if (readAhead.active &&
+		(readAhead.targetIndex == tgtIndex) &&
+		(readAhead.buffered == 0) &&
+		(readAhead.sdLBA < readAhead.sdEnd) &&
+		(q->lun == target->lun) &&
+		isReorderable(target, q) &&
+		(queuedLBA(q) == readAhead.nextLBA))
+	{
+		// Stay off the bus until the card has sent us something.
+		// scsiDiskPoll keeps the read-ahead going in the meantime.
+		return;
+	}
+
+	enter_SelectionPhase();
+	scsiDev.target = target;
+	scsiDev.initiatorId = q->initiatorId;
+	scsiDev.lun = q->lun;
+	scsiDev.discPriv = 1;
+	scsiDev.tagType = q->tagType;
+	scsiDev.tag = q->tag;
+	memcpy(scsiDev.cdb, q->cdb, sizeof(scsiDev.cdb));
+	scsiDev.cdbLen = q->cdbLen;
+
+	// scsiReconnect returns to this phase after the IDENTIFY message.
+	scsiDev.phase = MESSAGE_IN;
+	if (scsiReconnect())
+	{
+		// Count from the original selection, but only our own SD time.
+		statsCommandStart();
+		scsiDev.cmdStartTime = q->startTime;
+
+		scsiDev.nextReselect = (tgtIndex + 1) % MAX_SCSI_TARGETS;
+		target->queueLen--;
+		scsiDev.queueLen--;
+		memmove(q, q + 1, (target->queueLen - next) * sizeof(QueuedCommand));
+
+		scsiDev.phase = COMMAND;
+		execute_Command();
+	}
+	else
+	{
+		// Lost arbitration, or the initiator didn't respond. Try again
+		// next time the bus is free.
+		scsiDev.target = NULL;
+		scsiDev.phase = BUS_FREE;
+	}
+}
+
 static void doReserveRelease()
 {
 	int extentReservation = scsiDev.cdb[1] & 1;
@@ -478,9 +858,37 @@ static void scsiReset()
 		scsiDev.target->reserverId = -1;
 		scsiDev.target->sense.code = NO_SENSE;
 		scsiDev.target->sense.asc = NO_ADDITIONAL_SENSE_INFORMATION;
+
+		// And the same for the other logical units.
+		int lun;
+		for (lun = 0; lun < CONFIG_MAX_LUNS; ++lun)
+		{
+			LunState* state = &scsiDev.target->luns[lun];
+			if (state->unitAttention != POWER_ON_RESET)
+			{
+				state->unitAttention = SCSI_BUS_RESET;
+			}
+			state->reservedId = -1;
+			state->reserverId = -1;
+			state->sense.code = NO_SENSE;
+			state->sense.asc = NO_ADDITIONAL_SENSE_INFORMATION;
+		}
 	}
 	scsiDev.target = NULL;
+
+	int i;
+	for (i = 0; i < MAX_SCSI_TARGETS; ++i)
+	{
+		scsiDev.targets[i].queueLen = 0;
+		memset(scsiDev.targets[i].contingentId, 0xFF,
+			sizeof(scsiDev.targets[i].contingentId));
+	}
+	scsiDev.queueLen = 0;
+	scsiDev.tagType = 0;
+
 	scsiDiskReset();
+	scsiDiskReadAheadStop();
+	scsiDiskWriteCacheFlush();
 
 	scsiDev.postDataOutHook = NULL;
 
@@ -508,6 +916,7 @@ static void enter_SelectionPhase()
 	scsiDev.phase = SELECTION;
 	scsiDev.lun = -1;
 	scsiDev.discPriv = 0;
+	scsiDev.tagType = 0;
 
 	scsiDev.initiatorId = -1;
 	scsiDev.target = NULL;
@@ -586,6 +995,7 @@ static void process_SelectionPhase()
 		ledOn();
 
 		scsiDev.selCount++;
+		statsCommandStart();
 
 		// Wait until the end of the selection phase.
 		while (likely(!scsiDev.resetFlag))
@@ -654,6 +1064,24 @@ static void process_MessageOut()
 	else if (scsiDev.msgOut == 0x06)
 	{
 		// ABORT
+		queueRemove(scsiDev.target, scsiDev.initiatorId, -1);
+		scsiDiskReset();
+		enter_BusFree();
+	}
+	else if (scsiDev.msgOut == 0x0D)
+	{
+		// ABORT TAG
+		if (scsiDev.tagType)
+		{
+			queueRemove(scsiDev.target, scsiDev.initiatorId, scsiDev.tag);
+		}
+		scsiDiskReset();
+		enter_BusFree();
+	}
+	else if (scsiDev.msgOut == 0x0E)
+	{
+		// CLEAR QUEUE
+		queueRemove(scsiDev.target, -1, -1);
 		scsiDiskReset();
 		enter_BusFree();
 	}
@@ -661,13 +1089,26 @@ static void process_MessageOut()
 	{
 		// BUS DEVICE RESET
 
+		queueRemove(scsiDev.target, -1, -1);
 		scsiDiskReset();
+		memset(scsiDev.target->contingentId, 0xFF,
+			sizeof(scsiDev.target->contingentId));
 
 		scsiDev.target->unitAttention = SCSI_BUS_RESET;
 
 		// ANY initiator can reset the reservation state via this message.
 		scsiDev.target->reservedId = -1;
 		scsiDev.target->reserverId = -1;
+
+		// The whole target is reset, not just the selected logical unit.
+		int lun;
+		for (lun = 0; lun < CONFIG_MAX_LUNS; ++lun)
+		{
+			LunState* state = &scsiDev.target->luns[lun];
+			state->unitAttention = SCSI_BUS_RESET;
+			state->reservedId = -1;
+			state->reserverId = -1;
+		}
 		enter_BusFree();
 	}
 	else if (scsiDev.msgOut == 0x05)
@@ -716,6 +1157,14 @@ static void process_MessageOut()
 			((scsiDev.msgOut & 0x40) && (scsiDev.initiatorId >= 0))
 				? 1 : 0;
 	}
+	else if ((scsiDev.msgOut >= MSG_SIMPLE_QUEUE_TAG) &&
+		(scsiDev.msgOut <= MSG_ORDERED_QUEUE_TAG) &&
+		(scsiDev.target->cfg->flags & CONFIG_ENABLE_TCQ) &&
+		(scsiDev.compatMode >= COMPAT_SCSI2))
+	{
+		scsiDev.tagType = scsiDev.msgOut;
+		scsiDev.tag = scsiReadByte();
+	}
 	else if (scsiDev.msgOut >= 0x20 && scsiDev.msgOut <= 0x2F)
 	{
 		// Two byte message. We don't support these. read and discard.
@@ -791,6 +1240,10 @@ void scsiPoll(void)
 		{
 			enter_SelectionPhase();
 		}
+		else if (scsiDev.queueLen)
+		{
+			process_Reselection();
+		}
 	break;
 
 	case BUS_BUSY:
@@ -905,6 +1358,15 @@ void scsiInit()
 			scsiDev.targets[i].cfg = cfg;
 
 			scsiDev.targets[i].liveCfg.bytesPerSector = cfg->bytesPerSector;
+			scsiDev.targets[i].liveCfg.flags = cfg->flags;
+			scsiDev.targets[i].liveCfg.packed =
+				(cfg->flags2 & CONFIG_ENABLE_PACKED_SECTORS) ? 1 : 0;
+			scsiDev.targets[i].liveCfg.bufferFullRatio = 0;
+			scsiDev.targets[i].liveCfg.busInactivityLimit =
+				DEFAULT_BUS_INACTIVITY_LIMIT;
+			scsiDev.targets[i].liveCfg.deviceType = cfg->deviceType;
+			scsiDev.targets[i].liveCfg.sdSectorStart = cfg->sdSectorStart;
+			scsiDev.targets[i].liveCfg.scsiSectors = cfg->scsiSectors;
 		}
 		else
 		{
@@ -916,7 +1378,36 @@ void scsiInit()
 		scsiDev.targets[i].unitAttention = POWER_ON_RESET;
 		scsiDev.targets[i].sense.code = NO_SENSE;
 		scsiDev.targets[i].sense.asc = NO_ADDITIONAL_SENSE_INFORMATION;
+		scsiDev.targets[i].deferredSense.code = NO_SENSE;
+		scsiDev.targets[i].deferredSense.asc = NO_ADDITIONAL_SENSE_INFORMATION;
+		scsiDev.targets[i].deferredReported = 0;
+		scsiDev.targets[i].queueLen = 0;
+		memset(scsiDev.targets[i].contingentId, 0xFF,
+			sizeof(scsiDev.targets[i].contingentId));
+
+		// Every LUN starts with the same state as LUN 0, apart from the
+		// volume it describes.
+		int lun;
+		for (lun = 0; lun < CONFIG_MAX_LUNS; ++lun)
+		{
+			scsiDev.targets[i].lun = lun;
+			saveLun(&scsiDev.targets[i]);
+			if (cfg && (lun > 0))
+			{
+				const LunConfig* lunCfg = &cfg->luns[lun - 1];
+				LiveCfg* liveCfg = &scsiDev.targets[i].luns[lun].liveCfg;
+				liveCfg->bytesPerSector = lunCfg->bytesPerSector;
+				liveCfg->flags = configWriteCache(cfg, lun) ?
+					(cfg->flags | CONFIG_ENABLE_WRITE_CACHE) :
+					(cfg->flags & ~CONFIG_ENABLE_WRITE_CACHE);
+				liveCfg->deviceType = lunCfg->deviceType;
+				liveCfg->sdSectorStart = lunCfg->sdSectorStart;
+				liveCfg->scsiSectors = lunCfg->scsiSectors;
+			}
+		}
+		scsiDev.targets[i].lun = 0;
 	}
+	scsiDev.queueLen = 0;
 }
 
 void scsiDisconnect()
@@ -924,6 +1415,7 @@ void scsiDisconnect()
 	scsiEnterPhase(MESSAGE_IN);
 	scsiWriteByte(0x02); // save data pointer
 	scsiWriteByte(0x04); // disconnect msg.
+	statsDisconnect();
 
 	// For now, the caller is responsible for tracking the disconnected
 	// state, and calling scsiReconnect.
@@ -1003,8 +1495,15 @@ int scsiReconnect()
 				SCSI_Out_Ctl_Write(0);
 				scsiEnterPhase(MESSAGE_IN);
 
-				// Send identify command
-				scsiWriteByte(0x80);
+				// Send identify command, with the LUN of the command being
+				// resumed.
+				scsiWriteByte(0x80 | (scsiDev.lun & 0x7));
+				if (scsiDev.tagType)
+				{
+					// Tell the initiator which queued command this is.
+					scsiWriteByte(MSG_SIMPLE_QUEUE_TAG);
+					scsiWriteByte(scsiDev.tag);
+				}
 
 				scsiEnterPhase(scsiDev.phase);
 				reconnected = 1;
@@ -1022,4 +1521,131 @@ int scsiReconnect()
 	return reconnected;
 }
 
+// The parts of scsiDev and transfer belonging to a disconnected command.
+typedef struct
+{
+	TargetState* target;
+	int phase;
+	int parityError;
+	int dataPtr;
+	int savedDataPtr;
+	int dataLen;
+	uint8 cdb[16];
+	uint8 cdbLen;
+	int8 lun;
+	uint8 discPriv;
+	uint8_t compatMode;
+	uint8 tagType;
+	uint8 tag;
+	int initiatorId;
+	uint8 status;
+	void (*postDataOutHook)(void);
+	uint32_t cmdStartTime;
+	uint32_t cmdStartSDBusy;
+	uint32_t cmdDataBytes;
+	Transfer transfer;
+} SavedCommand;
+
+// Called by scsiDiskPoll while it's disconnected, waiting on the SD card.
+// Accepts a selection of any of our targets and queues the new command,
+// rather than leaving the host to time out the selection. Commands that
+// can't disconnect get BUSY status.
+// This doesn't overlap commands. There's only one SD card and one data
+// buffer, so queued commands, even for other targets, only start once the
+// disconnected one has finished.
+// Returns 1 if the initiator aborted the disconnected command.
+int scsiAcceptDisconnected()
+{
+	if (likely(!SCSI_ReadFilt(SCSI_Filt_SEL)))
+	{
+		return 0;
+	}
+
+	SavedCommand saved;
+	saved.target = scsiDev.target;
+	saved.phase = scsiDev.phase;
+	saved.parityError = scsiDev.parityError;
+	saved.dataPtr = scsiDev.dataPtr;
+	saved.savedDataPtr = scsiDev.savedDataPtr;
+	saved.dataLen = scsiDev.dataLen;
+	memcpy(saved.cdb, scsiDev.cdb, sizeof(saved.cdb));
+	saved.cdbLen = scsiDev.cdbLen;
+	saved.lun = scsiDev.lun;
+	saved.discPriv = scsiDev.discPriv;
+	saved.compatMode = scsiDev.compatMode;
+	saved.tagType = scsiDev.tagType;
+	saved.tag = scsiDev.tag;
+	saved.initiatorId = scsiDev.initiatorId;
+	saved.status = scsiDev.status;
+	saved.postDataOutHook = scsiDev.postDataOutHook;
+	saved.cmdStartTime = scsiDev.cmdStartTime;
+	saved.cmdStartSDBusy = scsiDev.cmdStartSDBusy;
+	saved.cmdDataBytes = scsiDev.cmdDataBytes;
+	saved.transfer = transfer;
+
+	// Stop scsiDiskReset from closing our SD transfer if the new
+	// connection sends ABORT.
+	transfer.inProgress = 0;
+	transfer.multiBlock = 0;
+
+	uint8 msgCount = scsiDev.msgCount;
+	enter_SelectionPhase();
+	process_SelectionPhase();
+
+	scsiDev.queueOnly = 1;
+	while ((scsiDev.phase >= 0) && likely(!scsiDev.resetFlag))
+	{
+		// COMMAND and MESSAGE phases only. The command is queued.
+		scsiPoll();
+	}
+	scsiDev.queueOnly = 0;
+
+	int aborted = 0;
+	if ((scsiDev.target == saved.target) &&
+		(scsiDev.msgCount != msgCount))
+	{
+		// These messages all end the connection, so will be the last one.
+		int sameInitiator = (scsiDev.initiatorId == saved.initiatorId);
+		switch (scsiDev.msgOut)
+		{
+		case 0x0C: // BUS DEVICE RESET
+		case 0x0E: // CLEAR QUEUE
+			aborted = 1;
+			break;
+		case 0x06: // ABORT
+			aborted = sameInitiator;
+			break;
+		case 0x0D: // ABORT TAG
+			aborted = sameInitiator &&
+				saved.tagType &&
+				(scsiDev.tagType) &&
+				(scsiDev.tag == saved.tag);
+			break;
+		}
+	}
+
+	scsiDev.target = saved.target;
+	scsiDev.phase = saved.phase;
+	scsiDev.parityError = saved.parityError;
+	scsiDev.dataPtr = saved.dataPtr;
+	scsiDev.savedDataPtr = saved.savedDataPtr;
+	scsiDev.dataLen = saved.dataLen;
+	memcpy(scsiDev.cdb, saved.cdb, sizeof(saved.cdb));
+	scsiDev.cdbLen = saved.cdbLen;
+	scsiDev.lun = saved.lun;
+	scsiDev.discPriv = saved.discPriv;
+	scsiDev.compatMode = saved.compatMode;
+	scsiDev.tagType = saved.tagType;
+	scsiDev.tag = saved.tag;
+	scsiDev.initiatorId = saved.initiatorId;
+	scsiDev.status = saved.status;
+	scsiDev.postDataOutHook = saved.postDataOutHook;
+	scsiDev.cmdStartTime = saved.cmdStartTime;
+	scsiDev.cmdStartSDBusy = saved.cmdStartSDBusy;
+	scsiDev.cmdDataBytes = saved.cmdDataBytes;
+	transfer = saved.transfer;
+
+	return aborted;
+}
+
 #pragma GCC pop_options
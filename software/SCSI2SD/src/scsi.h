@@ -44,9 +44,11 @@ typedef enum
 {
 	GOOD = 0,
 	CHECK_CONDITION = 2,
+	CONDITION_MET = 4,
 	BUSY = 0x8,
 	INTERMEDIATE = 0x10,
-	CONFLICT = 0x18
+	CONFLICT = 0x18,
+	QUEUE_FULL = 0x28
 } SCSI_STATUS;
 
 typedef enum
@@ -54,7 +56,10 @@ typedef enum
 	MSG_COMMAND_COMPLETE = 0,
 	MSG_REJECT = 0x7,
 	MSG_LINKED_COMMAND_COMPLETE = 0x0A,
-	MSG_LINKED_COMMAND_COMPLETE_WITH_FLAG = 0x0B
+	MSG_LINKED_COMMAND_COMPLETE_WITH_FLAG = 0x0B,
+	MSG_SIMPLE_QUEUE_TAG = 0x20,
+	MSG_HEAD_OF_QUEUE_TAG = 0x21,
+	MSG_ORDERED_QUEUE_TAG = 0x22
 } SCSI_MESSAGE;
 
 typedef enum
@@ -68,29 +73,93 @@ typedef enum
 #define MAX_SECTOR_SIZE 8192
 #define MIN_SECTOR_SIZE 64
 
+// Default Disconnect-Reconnect page bus inactivity limit, in 100us units.
+// Long enough for a normal CMD18 start, short enough to give up the bus
+// during an SD card garbage collection pause.
+#define DEFAULT_BUS_INACTIVITY_LIMIT 50
+
 // Shadow parameters, possibly not saved to flash yet.
 // Set via Mode Select
 typedef struct
 {
 	uint16_t bytesPerSector;
+	uint8_t flags; // CONFIG_FLAGS. Only CONFIG_ENABLE_WRITE_CACHE may change.
+	uint8_t packed; // CONFIG_ENABLE_PACKED_SECTORS. See SCSISector2SD.
+
+	// Disconnect-Reconnect page. Never saved.
+	uint8_t bufferFullRatio; // x/256 of the buffer. 0 for a single sector.
+	uint16_t busInactivityLimit; // 100us units. 0 for no limit.
+
+	// From the TargetConfig, or the LunConfig for LUNs other than 0.
+	uint8_t deviceType; // CONFIG_TYPE
+	uint32_t sdSectorStart;
+	uint32_t scsiSectors;
 } LiveCfg;
 
+// The parts of TargetState that belong to each logical unit. Saved here
+// while another LUN of the same target is in use.
+typedef struct
+{
+	LiveCfg liveCfg;
+	ScsiSense sense;
+	uint16 unitAttention;
+	ScsiSense deferredSense;
+	uint8 deferredReported;
+	int8 reservedId;
+	int8 reserverId;
+} LunState;
+
+// Tagged commands waiting to be executed. Small, as each target has its own
+// queue and we're short on RAM.
+#define SCSI_QUEUE_DEPTH 4
+
+typedef struct
+{
+	uint8 cdb[16];
+	uint8 cdbLen;
+	uint8 tagType; // SCSI_MESSAGE queue tag type
+	uint8 tag;
+	int8 lun;
+	int8 initiatorId;
+	uint32_t startTime; // getTime_cycles() at selection.
+} QueuedCommand;
+
 typedef struct
 {
 	uint8_t targetId;
 
 	const TargetConfig* cfg;
 
+	// The logical unit that liveCfg, sense, unitAttention, deferredSense
+	// and the reservation belong to. See scsiSelectLun.
+	uint8 lun;
+	LunState luns[CONFIG_MAX_LUNS];
+
 	LiveCfg liveCfg;
 
 	ScsiSense sense;
 
 	uint16 unitAttention; // Set to the sense qualifier key to be returned.
 
+	// Error from a write that completed after GOOD status was returned.
+	// Returned as CHECK CONDITION on the next command, and lost if the
+	// command after that isn't REQUEST SENSE.
+	ScsiSense deferredSense;
+	uint8 deferredReported;
+
 	// Only let the reserved initiator talk to us.
 	// A 3rd party may be sending the RESERVE/RELEASE commands
 	int reservedId; // 0 -> 7 if reserved. -1 if not reserved.
 	int reserverId; // 0 -> 7 if reserved. -1 if not reserved.
+
+	// Disconnected tagged commands, in the order they were received.
+	QueuedCommand queue[SCSI_QUEUE_DEPTH];
+	uint8 queueLen;
+
+	// Contingent allegiance. The initiator that was sent CHECK CONDITION
+	// for each LUN, or -1. Its queued commands for that LUN wait until it
+	// sends another command, normally REQUEST SENSE.
+	int8 contingentId[CONFIG_MAX_LUNS];
 } TargetState;
 
 typedef struct
@@ -115,11 +184,19 @@ typedef struct
 	int savedDataPtr; // Index into data, initially 0.
 	int dataLen;
 
-	uint8 cdb[12]; // command descriptor block
-	uint8 cdbLen; // 6, 10, or 12 byte message.
+	uint8 cdb[16]; // command descriptor block
+	uint8 cdbLen; // 6, 10, 12 or 16 byte message.
 	int8 lun; // Target lun, set by IDENTIFY message.
 	uint8 discPriv; // Disconnect priviledge.
 	uint8_t compatMode; // SCSI_COMPAT_MODE
+	uint8 tagType; // Queue tag message for this command. 0 if untagged.
+	uint8 tag;
+	uint8 queueLen; // Total queued commands for all targets.
+	uint8 nextReselect; // Target index to reselect first. Round-robin.
+
+	// Set while another command is disconnected. New commands are only
+	// queued, and run after it finishes. See scsiAcceptDisconnected.
+	uint8 queueOnly;
 
 	// Only let the reserved initiator talk to us.
 	// A 3rd party may be sending the RESERVE/RELEASE commands
@@ -142,6 +219,11 @@ typedef struct
 	uint8 lastStatus;
 	uint8 lastSense;
 	uint16_t lastSenseASC;
+
+	// The current command, for stats.c
+	uint32_t cmdStartTime; // getTime_cycles() at selection.
+	uint32_t cmdStartSDBusy; // sdDev.busyCycles when the command started.
+	uint32_t cmdDataBytes; // DATA IN and DATA OUT bytes so far.
 } ScsiDevice;
 
 extern ScsiDevice scsiDev;
@@ -153,6 +235,10 @@ void scsiInit(void);
 void scsiPoll(void);
 void scsiDisconnect(void);
 int scsiReconnect(void);
+int scsiAcceptDisconnected(void);
+
+// Returns 1 if the target has the logical unit.
+int scsiLunEnabled(const TargetState* target, int lun);
 
 
 // Utility macros, consistent with the Linux Kernel code.
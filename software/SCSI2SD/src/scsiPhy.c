@@ -29,19 +29,20 @@
 // but we round down to nearest multiple of 4 bytes..
 #define MAX_DMA_BYTES 4088
 
+// Enough chained descriptors to transfer all of scsiDev.data without
+// re-arming the DMA channel.
+#define SCSI_DMA_TDS \
+	((sizeof(scsiDev.data) + MAX_DMA_BYTES - 1) / MAX_DMA_BYTES)
+
 // Private DMA variables.
 static int dmaInProgress = 0;
-// used when transferring > MAX_DMA_BYTES.
-static uint8_t* dmaBuffer = NULL;
-static uint32_t dmaSentCount = 0;
-static uint32_t dmaTotalCount = 0;
 
 static uint8 scsiDmaRxChan = CY_DMA_INVALID_CHANNEL;
 static uint8 scsiDmaTxChan = CY_DMA_INVALID_CHANNEL;
 
 // DMA descriptors
-static uint8 scsiDmaRxTd[1] = { CY_DMA_INVALID_TD };
-static uint8 scsiDmaTxTd[1] = { CY_DMA_INVALID_TD };
+static uint8 scsiDmaRxTd[SCSI_DMA_TDS];
+static uint8 scsiDmaTxTd[SCSI_DMA_TDS];
 
 // Source of dummy bytes for DMA reads
 static uint8 dummyBuffer = 0xFF;
@@ -106,6 +107,7 @@ scsiReadByte(void)
 
 	trace(trace_spinTxComplete);
 	while (!(scsiPhyStatus() & SCSI_PHY_TX_COMPLETE) && likely(!scsiDev.resetFlag)) {}
+	trace(trace_spinDone);
 
 	return val;
 }
@@ -132,39 +134,54 @@ scsiReadPIO(uint8* data, uint32 count)
 		}
 	}
 	scsiDev.parityError = scsiDev.parityError || SCSI_Parity_Error_Read();
+	trace(trace_spinTxComplete);
 	while (!(scsiPhyStatus() & SCSI_PHY_TX_COMPLETE) && likely(!scsiDev.resetFlag)) {}
+	trace(trace_spinDone);
 }
 
 static void
-doRxSingleDMA(uint8* data, uint32 count)
+doRxDMA(uint8* data, uint32 count)
 {
 	// Prepare DMA transfer
 	dmaInProgress = 1;
 	trace(trace_doRxSingleDMA);
 
-	CyDmaTdSetConfiguration(
-		scsiDmaTxTd[0],
-		count,
-		CY_DMA_DISABLE_TD, // Disable the DMA channel when TD completes count bytes
-		SCSI_TX_DMA__TD_TERMOUT_EN // Trigger interrupt when complete
-		);
-	CyDmaTdSetConfiguration(
-		scsiDmaRxTd[0],
-		count,
-		CY_DMA_DISABLE_TD, // Disable the DMA channel when TD completes count bytes
-		TD_INC_DST_ADR |
-			SCSI_RX_DMA__TD_TERMOUT_EN // Trigger interrupt when complete
-		);
-
-	CyDmaTdSetAddress(
-		scsiDmaTxTd[0],
-		LO16((uint32)&dummyBuffer),
-		LO16((uint32)scsiTarget_datapath__F0_REG));
-	CyDmaTdSetAddress(
-		scsiDmaRxTd[0],
-		LO16((uint32)scsiTarget_datapath__F1_REG),
-		LO16((uint32)data)
-		);
+	// Split the transfer over a chain of descriptors. Only the last
+	// descriptor disables the channel and triggers the interrupt.
+	int td = 0;
+	while (count > 0)
+	{
+		uint32 tdCount = (count > MAX_DMA_BYTES) ? MAX_DMA_BYTES : count;
+		count -= tdCount;
+		int last = (count == 0);
+
+		CyDmaTdSetConfiguration(
+			scsiDmaTxTd[td],
+			tdCount,
+			last ? CY_DMA_DISABLE_TD : scsiDmaTxTd[td + 1],
+			last ? SCSI_TX_DMA__TD_TERMOUT_EN : 0
+			);
+		CyDmaTdSetConfiguration(
+			scsiDmaRxTd[td],
+			tdCount,
+			last ? CY_DMA_DISABLE_TD : scsiDmaRxTd[td + 1],
+			TD_INC_DST_ADR |
+				(last ? SCSI_RX_DMA__TD_TERMOUT_EN : 0)
+			);
+
+		CyDmaTdSetAddress(
+			scsiDmaTxTd[td],
+			LO16((uint32)&dummyBuffer),
+			LO16((uint32)scsiTarget_datapath__F0_REG));
+		CyDmaTdSetAddress(
+			scsiDmaRxTd[td],
+			LO16((uint32)scsiTarget_datapath__F1_REG),
+			LO16((uint32)data)
+			);
+
+		data += tdCount;
+		++td;
+	}
 
 	CyDmaChSetInitialTd(scsiDmaTxChan, scsiDmaTxTd[0]);
 	CyDmaChSetInitialTd(scsiDmaRxChan, scsiDmaRxTd[0]);
@@ -185,13 +202,7 @@ doRxSingleDMA(uint8* data, uint32 count)
 void
 scsiReadDMA(uint8* data, uint32 count)
 {
-	dmaSentCount = 0;
-	dmaTotalCount = count;
-	dmaBuffer = data;
-
-	uint32_t singleCount = (count > MAX_DMA_BYTES) ? MAX_DMA_BYTES : count;
-	doRxSingleDMA(data, singleCount);
-	dmaSentCount += count;
+	doRxDMA(data, count);
 }
 
 int
@@ -203,23 +214,11 @@ scsiReadDMAPoll()
 		// a few cycles.
 		trace(trace_spinTxComplete);
 		while (!(scsiPhyStatus() & SCSI_PHY_TX_COMPLETE)) {}
+		trace(trace_spinDone);
 
-		if (likely(dmaSentCount == dmaTotalCount))
-		{
-			dmaInProgress = 0;
-			scsiDev.parityError = scsiDev.parityError || SCSI_Parity_Error_Read();
-			return 1;
-		}
-		else
-		{
-			// Transfer was too large for a single DMA transfer. Continue
-			// to send remaining bytes.
-			uint32_t count = dmaTotalCount - dmaSentCount;
-			if (unlikely(count > MAX_DMA_BYTES)) count = MAX_DMA_BYTES;
-			doRxSingleDMA(dmaBuffer + dmaSentCount, count);
-			dmaSentCount += count;
-			return 0;
-		}
+		dmaInProgress = 0;
+		scsiDev.parityError = scsiDev.parityError || SCSI_Parity_Error_Read();
+		return 1;
 	}
 	else
 	{
@@ -266,6 +265,7 @@ scsiWriteByte(uint8 value)
 
 	trace(trace_spinTxComplete);
 	while (!(scsiPhyStatus() & SCSI_PHY_TX_COMPLETE) && likely(!scsiDev.resetFlag)) {}
+	trace(trace_spinDone);
 	scsiPhyRxFifoClear();
 }
 
@@ -285,27 +285,42 @@ scsiWritePIO(const uint8_t* data, uint32_t count)
 
 	trace(trace_spinTxComplete);
 	while (!(scsiPhyStatus() & SCSI_PHY_TX_COMPLETE) && likely(!scsiDev.resetFlag)) {}
+	trace(trace_spinDone);
 	scsiPhyRxFifoClear();
 }
 
 static void
-doTxSingleDMA(const uint8* data, uint32 count)
+doTxDMA(const uint8* data, uint32 count)
 {
 	// Prepare DMA transfer
 	dmaInProgress = 1;
 	trace(trace_doTxSingleDMA);
 
-	CyDmaTdSetConfiguration(
-		scsiDmaTxTd[0],
-		count,
-		CY_DMA_DISABLE_TD, // Disable the DMA channel when TD completes count bytes
-		TD_INC_SRC_ADR |
-			SCSI_TX_DMA__TD_TERMOUT_EN // Trigger interrupt when complete
-		);
-	CyDmaTdSetAddress(
-		scsiDmaTxTd[0],
-		LO16((uint32)data),
-		LO16((uint32)scsiTarget_datapath__F0_REG));
+	// Split the transfer over a chain of descriptors. Only the last
+	// descriptor disables the channel and triggers the interrupt.
+	int td = 0;
+	while (count > 0)
+	{
+		uint32 tdCount = (count > MAX_DMA_BYTES) ? MAX_DMA_BYTES : count;
+		count -= tdCount;
+		int last = (count == 0);
+
+		CyDmaTdSetConfiguration(
+			scsiDmaTxTd[td],
+			tdCount,
+			last ? CY_DMA_DISABLE_TD : scsiDmaTxTd[td + 1],
+			TD_INC_SRC_ADR |
+				(last ? SCSI_TX_DMA__TD_TERMOUT_EN : 0)
+			);
+		CyDmaTdSetAddress(
+			scsiDmaTxTd[td],
+			LO16((uint32)data),
+			LO16((uint32)scsiTarget_datapath__F0_REG));
+
+		data += tdCount;
+		++td;
+	}
+
 	CyDmaChSetInitialTd(scsiDmaTxChan, scsiDmaTxTd[0]);
 
 	// The DMA controller is a bit trigger-happy. It will retain
@@ -322,13 +337,7 @@ doTxSingleDMA(const uint8* data, uint32 count)
 void
 scsiWriteDMA(const uint8* data, uint32 count)
 {
-	dmaSentCount = 0;
-	dmaTotalCount = count;
-	dmaBuffer = data;
-
-	uint32_t singleCount = (count > MAX_DMA_BYTES) ? MAX_DMA_BYTES : count;
-	doTxSingleDMA(data, singleCount);
-	dmaSentCount += count;
+	doTxDMA(data, count);
 }
 
 int
@@ -340,23 +349,11 @@ scsiWriteDMAPoll()
 		// a few cycles.
 		trace(trace_spinTxComplete);
 		while (!(scsiPhyStatus() & SCSI_PHY_TX_COMPLETE)) {}
+		trace(trace_spinDone);
 
-		if (likely(dmaSentCount == dmaTotalCount))
-		{
-			scsiPhyRxFifoClear();
-			dmaInProgress = 0;
-			return 1;
-		}
-		else
-		{
-			// Transfer was too large for a single DMA transfer. Continue
-			// to send remaining bytes.
-			uint32_t count = dmaTotalCount - dmaSentCount;
-			if (unlikely(count > MAX_DMA_BYTES)) count = MAX_DMA_BYTES;
-			doTxSingleDMA(dmaBuffer + dmaSentCount, count);
-			dmaSentCount += count;
-			return 0;
-		}
+		scsiPhyRxFifoClear();
+		dmaInProgress = 0;
+		return 1;
 	}
 	else
 	{
@@ -422,9 +419,6 @@ void scsiPhyReset()
 	if (dmaInProgress)
 	{
 		dmaInProgress = 0;
-		dmaBuffer = NULL;
-		dmaSentCount = 0;
-		dmaTotalCount = 0;
 		CyDmaChSetRequest(scsiDmaTxChan, CY_DMA_CPU_TERM_CHAIN);
 		CyDmaChSetRequest(scsiDmaRxChan, CY_DMA_CPU_TERM_CHAIN);
 		
@@ -433,6 +427,7 @@ void scsiPhyReset()
 		trace(trace_spinDMAReset);
 		while (CyDmaChGetRequest(scsiDmaTxChan) & CY_DMA_CPU_TERM_CHAIN) {}
 		while (CyDmaChGetRequest(scsiDmaRxChan) & CY_DMA_CPU_TERM_CHAIN) {}
+		trace(trace_spinDone);
 
 		CyDmaChDisable(scsiDmaTxChan);
 		CyDmaChDisable(scsiDmaRxChan);
@@ -488,8 +483,12 @@ static void scsiPhyInitDMA()
 		CyDmaChDisable(scsiDmaRxChan);
 		CyDmaChDisable(scsiDmaTxChan);
 
-		scsiDmaRxTd[0] = CyDmaTdAllocate();
-		scsiDmaTxTd[0] = CyDmaTdAllocate();
+		uint32 i;
+		for (i = 0; i < SCSI_DMA_TDS; ++i)
+		{
+			scsiDmaRxTd[i] = CyDmaTdAllocate();
+			scsiDmaTxTd[i] = CyDmaTdAllocate();
+		}
 
 		SCSI_RX_DMA_COMPLETE_StartEx(scsiRxCompleteISR);
 		SCSI_TX_DMA_COMPLETE_StartEx(scsiTxCompleteISR);
@@ -36,6 +36,9 @@ SdDevice sdDev;
 enum SD_IO_STATE { SD_DMA, SD_ACCEPTED, SD_BUSY, SD_IDLE };
 static int sdIOState = SD_IDLE;
 
+// When the current sector transfer started. See sdDev.busyCycles.
+static uint32_t sdBusyStart;
+
 // Private DMA variables.
 static uint8 sdDMARxChan = CY_DMA_INVALID_CHANNEL;
 static uint8 sdDMATxChan = CY_DMA_INVALID_CHANNEL;
@@ -43,6 +46,9 @@ static uint8 sdDMATxChan = CY_DMA_INVALID_CHANNEL;
 // Dummy location for DMA to send unchecked CRC bytes to
 static uint8 discardBuffer __attribute__((aligned(4)));
 
+// CRC16 sent by the card after each sector read. See sdReadSectorCRC.
+static uint8_t sdReadCRC[2] __attribute__((aligned(4)));
+
 // 2 bytes CRC, response, 8bits to close the clock..
 // "NCR" time is up to 8 bytes.
 static uint8_t writeResponseBuffer[8]  __attribute__((aligned(4)));
@@ -95,15 +101,54 @@ static uint8_t sdSpiByte(uint8_t value)
 	return SDCard_ReadRxData();
 }
 
-static uint16_t sdDoCommand(
-	uint8_t cmd,
-	uint32_t param,
-	int useCRC,
-	int use2byteResponse)
+// Non-blocking command engine. Each call to sdCommandPoll checks the SPI
+// FIFO or DMA flags once and returns, so the multi-block read and write
+// commands can run while scsiDiskPoll services the SCSI bus.
+enum SD_CMD_STATE
+{
+	SD_CMD_IDLE,
+	SD_CMD_BUSY, // Waiting for the card to finish the previous operation.
+	SD_CMD_SEND, // DMA of the command bytes.
+	SD_CMD_STUFF, // Discarding the CMD12 stuff byte.
+	SD_CMD_RESPONSE // Waiting for the R1 response.
+};
+
+static struct
+{
+	int state;
+	int stuffByte; // True for CMD12.
+	uint32_t start; // Response timeout start, in ms.
+	uint8_t response;
+} sdCmd = { SD_CMD_IDLE, 0, 0, 0 };
+
+static void sdCommandSend()
+{
+	sdCmd.state = SD_CMD_SEND;
+	trace(trace_sdCmdSend);
+
+	// The DMA controller is a bit trigger-happy. It will retain
+	// a drq request that was triggered while the channel was
+	// disabled.
+	CyDmaChSetRequest(sdDMATxChan, CY_DMA_CPU_REQ);
+	CyDmaClearPendingDrq(sdDMARxChan);
+
+	// There is no flow control, so we must ensure we can read the bytes
+	// before we start transmitting
+	CyDmaChEnable(sdDMARxChan, 1);
+	CyDmaChEnable(sdDMATxChan, 1);
+}
+
+static void sdCommandStart(uint8_t cmd, uint32_t param, int useCRC)
 {
 	int waitWhileBusy = (cmd != SD_GO_IDLE_STATE) && (cmd != SD_STOP_TRANSMISSION);
 
-	// "busy" probe. We'll examine the results later.
+	// Stuff byte is required for CMD12 only.
+	// Part 1 Simplified standard 3.01
+	// "The stop command has an execution delay due to the serial command
+	// transmission."
+	sdCmd.stuffByte = (cmd == SD_STOP_TRANSMISSION);
+
+	// "busy" probe. We'll examine the results in sdCommandPoll.
 	if (waitWhileBusy)
 	{
 		SDCard_WriteTxData(0xFF);
@@ -150,47 +195,85 @@ static uint16_t sdDoCommand(
 	// reads.
 	if (waitWhileBusy)
 	{
-		trace(trace_spinSDRxFIFO);
-		while (!(SDCard_ReadRxStatus() & SDCard_STS_RX_FIFO_NOT_EMPTY)) {}
-		int busy = SDCard_ReadRxData() != 0xFF;
-		if (unlikely(busy))
+		sdCmd.state = SD_CMD_BUSY;
+		trace(trace_sdCmdBusy);
+	}
+	else
+	{
+		sdCommandSend();
+	}
+}
+
+// Returns 1 once the R1 response is in sdCmd.response.
+static int sdCommandPoll()
+{
+	switch (sdCmd.state)
+	{
+	case SD_CMD_BUSY:
+		if (SDCard_ReadRxStatus() & SDCard_STS_RX_FIFO_NOT_EMPTY)
 		{
-			trace(trace_spinSDBusy);
-			while (sdSpiByte(0xFF) != 0xFF) {}
+			if (SDCard_ReadRxData() == 0xFF)
+			{
+				sdCommandSend();
+			}
+			else
+			{
+				SDCard_WriteTxData(0xFF); // Probe again.
+			}
 		}
-	}
+		return 0;
 
-	// The DMA controller is a bit trigger-happy. It will retain
-	// a drq request that was triggered while the channel was
-	// disabled.
-	CyDmaChSetRequest(sdDMATxChan, CY_DMA_CPU_REQ);
-	CyDmaClearPendingDrq(sdDMARxChan);
+	case SD_CMD_SEND:
+		if (sdTxDMAComplete && sdRxDMAComplete)
+		{
+			sdCmd.state = sdCmd.stuffByte ? SD_CMD_STUFF : SD_CMD_RESPONSE;
+			sdCmd.start = getTime_ms();
+			trace(trace_sdCmdResponse);
+			SDCard_WriteTxData(0xFF);
+		}
+		return 0;
 
-	// There is no flow control, so we must ensure we can read the bytes
-	// before we start transmitting
-	CyDmaChEnable(sdDMARxChan, 1);
-	CyDmaChEnable(sdDMATxChan, 1);
+	case SD_CMD_STUFF:
+		if (SDCard_ReadRxStatus() & SDCard_STS_RX_FIFO_NOT_EMPTY)
+		{
+			SDCard_ReadRxData();
+			sdCmd.state = SD_CMD_RESPONSE;
+			SDCard_WriteTxData(0xFF);
+		}
+		return 0;
 
-	trace(trace_spinSDDMA);
-	while (!(sdTxDMAComplete && sdRxDMAComplete)) { __WFI(); }
+	case SD_CMD_RESPONSE:
+		if (SDCard_ReadRxStatus() & SDCard_STS_RX_FIFO_NOT_EMPTY)
+		{
+			uint8_t response = SDCard_ReadRxData();
+			if ((response & 0x80) &&
+				likely(elapsedTime_ms(sdCmd.start) <= 200))
+			{
+				SDCard_WriteTxData(0xFF);
+				return 0;
+			}
+			sdCmd.response = response;
+			sdCmd.state = SD_CMD_IDLE;
+			trace(trace_sdCmdDone);
+			return 1;
+		}
+		return 0;
 
-	uint16_t response = sdSpiByte(0xFF); // Result code or stuff byte
-	if (unlikely(cmd == SD_STOP_TRANSMISSION))
-	{
-		// Stuff byte is required for this command only.
-		// Part 1 Simplified standard 3.01
-		// "The stop command has an execution delay due to the serial command
-		// transmission."
-		response = sdSpiByte(0xFF);
+	default:
+		return 1;
 	}
+}
 
-	uint32_t start = getTime_ms();
+static uint16_t sdDoCommand(
+	uint8_t cmd,
+	uint32_t param,
+	int useCRC,
+	int use2byteResponse)
+{
+	sdCommandStart(cmd, param, useCRC);
+	while (!sdCommandPoll()) {}
 
-	trace(trace_spinSDBusy);
-	while ((response & 0x80) && likely(elapsedTime_ms(start) <= 200))
-	{
-		response = sdSpiByte(0xFF);
-	}
+	uint16_t response = sdCmd.response;
 	if (unlikely(use2byteResponse))
 	{
 		response = (response << 8) | sdSpiByte(0xFF);
@@ -217,72 +300,170 @@ static void sdClearStatus()
 	(void) r2;
 }
 
-void
-sdReadMultiSectorPrep()
+// Multi-block command sequence started by sdReadMultiSectorPrep or
+// sdWriteMultiSectorPrep, still running on the command engine.
+enum SD_PREP_STATE
 {
-	uint8 v;
-	uint32 scsiLBA = (transfer.lba + transfer.currentBlock);
-	uint32 sdLBA =
-		SCSISector2SD(
-			scsiDev.target->cfg->sdSectorStart,
-			scsiDev.target->liveCfg.bytesPerSector,
-			scsiLBA);
+	SD_PREP_NONE,
+	SD_PREP_APP_CMD, // CMD55, before ACMD23
+	SD_PREP_ERASE_COUNT, // ACMD23
+	SD_PREP_BLOCK_COUNT, // CMD23, before CMD18
+	SD_PREP_OPEN // CMD18 or CMD25
+};
+static int sdPrepState = SD_PREP_NONE;
+static uint32_t sdPrepBlocks;
+static uint32_t sdPrepLBA;
+
+// Sectors left in a CMD18 read started with CMD23. The card stops by
+// itself after the last one, so there's no CMD12. 0 if open-ended.
+static uint32_t sdReadBlocksLeft;
+
+// Set if the current CMD18 read was started with a block count.
+static int sdReadCounted;
+
+// Returns 1 once the multi-block read or write is open, and sectors may be
+// transferred.
+int
+sdMultiSectorPrepPoll()
+{
+	if (likely(sdPrepState == SD_PREP_NONE))
+	{
+		return 1;
+	}
+	else if (!sdCommandPoll())
+	{
+		return 0;
+	}
+
+	switch (sdPrepState)
+	{
+	case SD_PREP_APP_CMD:
+		sdCommandStart(SD_APP_SET_WR_BLK_ERASE_COUNT, sdPrepBlocks, 0);
+		sdPrepState = SD_PREP_ERASE_COUNT;
+		return 0;
+
+	case SD_PREP_ERASE_COUNT:
+		// We don't care about the response - if the command is not
+		// accepted, writes will just be a bit slower.
+		sdCommandStart(SD_WRITE_MULTIPLE_BLOCK, sdPrepLBA, 0);
+		sdPrepState = SD_PREP_OPEN;
+		return 0;
+
+	case SD_PREP_BLOCK_COUNT:
+		if (unlikely(sdCmd.response))
+		{
+			// Not supported after all. Stop with CMD12 as usual.
+			sdDev.cmd23 = 0;
+			sdReadBlocksLeft = 0;
+			sdReadCounted = 0;
+		}
+		sdCommandStart(SD_READ_MULTIPLE_BLOCK, sdPrepLBA, 0);
+		sdPrepState = SD_PREP_OPEN;
+		return 0;
+
+	default:
+		sdPrepState = SD_PREP_NONE;
+		trace(trace_sdPrepDone);
+		if (unlikely(sdCmd.response))
+		{
+			// Nothing to stop.
+			transfer.inProgress = 0;
+			scsiDiskReset();
+			sdClearStatus();
+
+			scsiDev.status = CHECK_CONDITION;
+			scsiDev.target->sense.code = HARDWARE_ERROR;
+			scsiDev.target->sense.asc = LOGICAL_UNIT_COMMUNICATION_FAILURE;
+			scsiDev.phase = STATUS;
+			return 0;
+		}
+		return 1;
+	}
+}
+
+static void sdMultiSectorPrepWait()
+{
+	while (unlikely(sdPrepState != SD_PREP_NONE))
+	{
+		sdMultiSectorPrepPoll();
+	}
+}
 
+// Start CMD18 at an SD sector. Completed by sdMultiSectorPrepPoll.
+void
+sdReadMultiSectorStart(uint32_t sdLBA, uint32_t sdBlocks)
+{
 	if (!sdDev.ccs)
 	{
 		sdLBA = sdLBA * SD_SECTOR_SIZE;
 	}
-	v = sdCommandAndResponse(SD_READ_MULTIPLE_BLOCK, sdLBA);
-	if (unlikely(v))
+	if (sdBlocks && sdDev.cmd23 && (sdBlocks <= 0xFFFF))
 	{
-		scsiDiskReset();
-		sdClearStatus();
-
-		scsiDev.status = CHECK_CONDITION;
-		scsiDev.target->sense.code = HARDWARE_ERROR;
-		scsiDev.target->sense.asc = LOGICAL_UNIT_COMMUNICATION_FAILURE;
-		scsiDev.phase = STATUS;
+		sdPrepLBA = sdLBA;
+		sdReadBlocksLeft = sdBlocks;
+		sdReadCounted = 1;
+		sdCommandStart(SD_SET_BLOCK_COUNT, sdBlocks, 0);
+		sdPrepState = SD_PREP_BLOCK_COUNT;
 	}
 	else
 	{
-		transfer.inProgress = 1;
+		sdReadBlocksLeft = 0;
+		sdReadCounted = 0;
+		sdCommandStart(SD_READ_MULTIPLE_BLOCK, sdLBA, 0);
+		sdPrepState = SD_PREP_OPEN;
 	}
+
+	// sdCompleteRead waits for the command if we're reset first.
+	transfer.inProgress = 1;
 }
 
-static void
-dmaReadSector(uint8_t* outputBuffer)
+// Start CMD18. Completed by sdMultiSectorPrepPoll.
+// If sdBlocks is non-zero, and the card supports CMD23, the read ends after
+// that many SD sectors. Otherwise it's left open until sdCompleteRead.
+void
+sdReadMultiSectorPrep(uint32_t sdBlocks)
 {
-	// Wait for a start-block token.
-	// Don't wait more than 200ms.  The standard recommends 100ms.
-	uint32_t start = getTime_ms();
-	uint8_t token = sdSpiByte(0xFF);
-	trace(trace_spinSDBusy);
-	while (token != 0xFE && likely(elapsedTime_ms(start) <= 200))
+	uint64 scsiLBA = (transfer.lba + transfer.currentBlock);
+	uint32 sdLBA =
+		SCSISector2SD(
+			scsiDev.target->liveCfg.sdSectorStart,
+			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->liveCfg.packed,
+			scsiLBA);
+	sdReadMultiSectorStart(sdLBA, sdBlocks);
+}
+
+// Restart the multi-block read at sdLBA after a CRC error. Any sectors the
+// card has already sent past that point are thrown away. sdBlocks is the
+// number of SD sectors left in the transfer.
+// Completed by sdMultiSectorPrepPoll.
+void
+sdReadMultiSectorRetry(uint32_t sdLBA, uint32_t sdBlocks)
+{
+	sdDev.readRetries++;
+	sdMultiSectorPrepWait();
+	if (unlikely(sdIOState != SD_IDLE))
 	{
-		if (unlikely(token && ((token & 0xE0) == 0)))
-		{
-			// Error token!
-			break;
-		}
-		token = sdSpiByte(0xFF);
+		while (!sdReadSectorDMAPoll()) { /* spin */ }
 	}
-	if (unlikely(token != 0xFE))
+
+	if (transfer.inProgress)
 	{
-		if (transfer.multiBlock)
-		{
-			sdCompleteRead();
-		}
-		if (scsiDev.status != CHECK_CONDITION)
+		uint8 r1b = sdCommandAndResponse(SD_STOP_TRANSMISSION, 0);
+		if (unlikely(r1b))
 		{
-			scsiDev.status = CHECK_CONDITION;
-			scsiDev.target->sense.code = HARDWARE_ERROR;
-			scsiDev.target->sense.asc = UNRECOVERED_READ_ERROR;
-			scsiDev.phase = STATUS;
+			sdClearStatus();
 		}
-		sdClearStatus();
-		return;
 	}
 
+	sdReadMultiSectorStart(sdLBA, sdReadCounted ? sdBlocks : 0);
+}
+
+// Start the DMA transfer of a sector once the start-block token has been
+// received.
+static void
+dmaReadSectorData(uint8_t* outputBuffer)
+{
 	static uint8_t dmaRxTd[2] = { CY_DMA_INVALID_TD, CY_DMA_INVALID_TD};
 	static uint8_t dmaTxTd = CY_DMA_INVALID_TD;
 	if (unlikely(dmaRxTd[0] == CY_DMA_INVALID_TD))
@@ -293,8 +474,8 @@ dmaReadSector(uint8_t* outputBuffer)
 		
 		// Receive 512 bytes of data and then 2 bytes CRC.
 		CyDmaTdSetConfiguration(dmaRxTd[0], SD_SECTOR_SIZE, dmaRxTd[1], TD_INC_DST_ADR);
-		CyDmaTdSetConfiguration(dmaRxTd[1], 2, CY_DMA_DISABLE_TD, SD_RX_DMA__TD_TERMOUT_EN);
-		CyDmaTdSetAddress(dmaRxTd[1], LO16((uint32)SDCard_RXDATA_PTR), LO16((uint32)&discardBuffer));
+		CyDmaTdSetConfiguration(dmaRxTd[1], 2, CY_DMA_DISABLE_TD, SD_RX_DMA__TD_TERMOUT_EN|TD_INC_DST_ADR);
+		CyDmaTdSetAddress(dmaRxTd[1], LO16((uint32)SDCard_RXDATA_PTR), LO16((uint32)&sdReadCRC));
 	
 		CyDmaTdSetConfiguration(dmaTxTd, SD_SECTOR_SIZE + 2, CY_DMA_DISABLE_TD, SD_TX_DMA__TD_TERMOUT_EN);
 		CyDmaTdSetAddress(dmaTxTd, LO16((uint32)&dummyBuffer), LO16((uint32)SDCard_TXDATA_PTR));
@@ -303,6 +484,7 @@ dmaReadSector(uint8_t* outputBuffer)
 	CyDmaTdSetAddress(dmaRxTd[0], LO16((uint32)SDCard_RXDATA_PTR), LO16((uint32)outputBuffer));
 
 	sdIOState = SD_DMA;
+	sdBusyStart = getTime_cycles();
 	sdTxDMAComplete = 0;
 	sdRxDMAComplete = 0;
 
@@ -324,13 +506,41 @@ dmaReadSector(uint8_t* outputBuffer)
 	CyDmaChEnable(sdDMATxChan, 1);
 }
 
+// Called when the card sends an error token, or doesn't send the
+// start-block token within SD_READ_TOKEN_TIMEOUT_MS.
+void
+sdReadSectorError()
+{
+	if (transfer.multiBlock)
+	{
+		sdCompleteRead();
+	}
+	if (scsiDev.status != CHECK_CONDITION)
+	{
+		scsiDev.status = CHECK_CONDITION;
+		scsiDev.target->sense.code = HARDWARE_ERROR;
+		scsiDev.target->sense.asc = UNRECOVERED_READ_ERROR;
+		scsiDev.phase = STATUS;
+	}
+	sdClearStatus();
+}
+
 int
 sdReadSectorDMAPoll()
 {
 	if (sdRxDMAComplete && sdTxDMAComplete)
 	{
 		// DMA transfer is complete
+		if (sdIOState == SD_DMA)
+		{
+			sdDev.busyCycles += getTime_cycles() - sdBusyStart;
+		}
 		sdIOState = SD_IDLE;
+		if (sdReadBlocksLeft && (--sdReadBlocksLeft == 0))
+		{
+			// Last sector of a CMD23 read. Nothing to stop.
+			transfer.inProgress = 0;
+		}
 		return 1;
 	}
 	else
@@ -339,7 +549,17 @@ sdReadSectorDMAPoll()
 	}
 }
 
-void sdReadSingleSectorDMA(uint32_t lba, uint8_t* outputBuffer)
+// CRC16 of the sector last completed by sdReadSectorDMAPoll, as sent by the
+// card. The card always sends it in SPI mode, even with CMD59 CRC checking
+// turned off.
+uint16_t sdReadSectorCRC()
+{
+	return (((uint16_t)sdReadCRC[0]) << 8) | sdReadCRC[1];
+}
+
+// Returns 1 if the CMD17 was accepted. The sector is then read with
+// sdReadSectorDMAStart.
+int sdReadSingleSectorPrep(uint32_t lba)
 {
 	uint8 v;
 	if (!sdDev.ccs)
@@ -356,23 +576,53 @@ void sdReadSingleSectorDMA(uint32_t lba, uint8_t* outputBuffer)
 		scsiDev.target->sense.code = HARDWARE_ERROR;
 		scsiDev.target->sense.asc = LOGICAL_UNIT_COMMUNICATION_FAILURE;
 		scsiDev.phase = STATUS;
+		return 0;
 	}
-	else
+	return 1;
+}
+
+// Start the DMA transfer of the next sector, without waiting for the card.
+// Returns 1 if the sector transfer was started, 0 if the card hasn't sent
+// the start-block token yet, or -1 on an error token.
+int
+sdReadSectorDMAStart(uint8_t* outputBuffer)
+{
+	// Pre: sdReadMultiSectorPrep or sdReadSingleSectorPrep called.
+	uint8_t token = sdSpiByte(0xFF);
+	if (likely(token == 0xFE))
+	{
+		dmaReadSectorData(outputBuffer);
+		return 1;
+	}
+	else if (unlikely(token && ((token & 0xE0) == 0)))
 	{
-		dmaReadSector(outputBuffer);
+		return -1;
 	}
+	return 0;
 }
 
-void
-sdReadMultiSectorDMA(uint8_t* outputBuffer)
+// Close a multi-block read left open by the read-ahead engine.
+// There's no command to report errors against, so just clear the card
+// status. Any real problem will show up again on the next command.
+void sdCompleteReadAhead()
 {
-	// Pre: sdReadMultiSectorPrep called.
-	dmaReadSector(outputBuffer);
-}
+	if (unlikely(sdIOState != SD_IDLE))
+	{
+		trace(trace_spinSDCompleteRead);
+		while (!sdReadSectorDMAPoll()) { /* spin */ }
+		trace(trace_spinDone);
+	}
 
+	uint8 r1b = sdCommandAndResponse(SD_STOP_TRANSMISSION, 0);
+	if (unlikely(r1b))
+	{
+		sdClearStatus();
+	}
+}
 
 void sdCompleteRead()
 {
+	sdMultiSectorPrepWait();
 	if (unlikely(sdIOState != SD_IDLE))
 	{
 		// Not much choice but to wait until we've completed the transfer.
@@ -380,10 +630,13 @@ void sdCompleteRead()
 		// the SD card.
 		trace(trace_spinSDCompleteRead);
 		while (!sdReadSectorDMAPoll()) { /* spin */ }
+		trace(trace_spinDone);
 	}
 	
+	sdReadBlocksLeft = 0;
 	if (transfer.inProgress)
 	{
+		// Also used to abandon a CMD23 read early.
 		transfer.inProgress = 0;
 		uint8 r1b = sdCommandAndResponse(SD_STOP_TRANSMISSION, 0);
 
@@ -442,6 +695,7 @@ sdWriteMultiSectorDMA(uint8_t* outputBuffer)
 
 
 	sdIOState = SD_DMA;
+	sdBusyStart = getTime_cycles();
 	// The DMA controller is a bit trigger-happy. It will retain
 	// a drq request that was triggered while the channel was
 	// disabled.
@@ -463,6 +717,88 @@ sdWriteMultiSectorDMA(uint8_t* outputBuffer)
 	CyDmaChEnable(sdDMATxChan, 1);
 }
 
+// Limits for the thresholds chosen from sdDev.writeLatency.
+// Hosts such as the NCR 53C700 give up after 250ms without a byte being
+// transferred, so keep well clear of that.
+#define SD_DISCONNECT_MIN_MS 10
+#define SD_DISCONNECT_MAX_MS 100
+#define SD_EARLY_STATUS_MIN_MS 50
+#define SD_EARLY_STATUS_MAX_MS 200
+
+// When the card started programming the last sector written.
+static uint32_t sdWriteBusyStart;
+
+// Upper bound, in ms, of the bucket containing the n'th fastest sample.
+static uint8_t sdLatencyPercentile(uint32_t n)
+{
+	const SdLatency* lat = &sdDev.writeLatency;
+	uint32_t sum = 0;
+	int i;
+	for (i = 0; i < SD_LATENCY_BUCKETS - 1; ++i)
+	{
+		sum += lat->count[i];
+		if (sum >= n)
+		{
+			break;
+		}
+	}
+	return 1 << i;
+}
+
+static void sdWriteLatencyRecord(uint32_t ms)
+{
+	SdLatency* lat = &sdDev.writeLatency;
+	int bucket = 0;
+	int i;
+	while ((bucket < SD_LATENCY_BUCKETS - 1) && (ms >> bucket))
+	{
+		++bucket;
+	}
+
+	if (unlikely(lat->count[bucket] == 0xFFFF))
+	{
+		for (i = 0; i < SD_LATENCY_BUCKETS; ++i)
+		{
+			lat->count[i] >>= 1;
+		}
+	}
+	lat->count[bucket]++;
+
+	uint32_t total = 0;
+	for (i = 0; i < SD_LATENCY_BUCKETS; ++i)
+	{
+		total += lat->count[i];
+	}
+	if (total < SD_LATENCY_MIN_SAMPLES)
+	{
+		return;
+	}
+
+	lat->p50_ms = sdLatencyPercentile((total + 1) / 2);
+	lat->p99_ms = sdLatencyPercentile(total - (total / 100));
+
+	// Writes that finish within the 99th percentile are normal for this
+	// card, and aren't worth a disconnect and reselection. Anything
+	// longer is probably a garbage collection pause.
+	uint32_t disconnect = lat->p99_ms;
+	if (disconnect < SD_DISCONNECT_MIN_MS) disconnect = SD_DISCONNECT_MIN_MS;
+	if (disconnect > SD_DISCONNECT_MAX_MS) disconnect = SD_DISCONNECT_MAX_MS;
+	lat->disconnect_ms = disconnect;
+
+	// Leave enough time for one more slow write before the host times
+	// out. Fast cards wait longer before pretending to be finished.
+	uint32_t earlyStatus = SD_EARLY_STATUS_MAX_MS - lat->p99_ms;
+	if (earlyStatus < SD_EARLY_STATUS_MIN_MS) earlyStatus = SD_EARLY_STATUS_MIN_MS;
+	lat->earlyStatus_ms = earlyStatus;
+}
+
+static void sdWriteLatencyReset()
+{
+	memset(&sdDev.writeLatency, 0, sizeof(sdDev.writeLatency));
+	sdDev.writeLatency.disconnect_ms = SD_DEFAULT_DISCONNECT_MS;
+	sdDev.writeLatency.earlyStatus_ms = SD_DEFAULT_EARLY_STATUS_MS;
+}
+
 int
 sdWriteSectorDMAPoll(int sendStopToken)
 {
@@ -485,6 +821,7 @@ sdWriteSectorDMAPoll(int sendStopToken)
 			if (unlikely(((dataToken & 0x1F) >> 1) != 0x2)) // Accepted.
 			{
 				sdIOState = SD_IDLE;
+				sdDev.busyCycles += getTime_cycles() - sdBusyStart;
 
 				sdWaitWriteBusy();
 				sdSpiByte(0xFD); // STOP TOKEN
@@ -502,6 +839,7 @@ sdWriteSectorDMAPoll(int sendStopToken)
 			else
 			{
 				sdIOState = SD_ACCEPTED;
+				sdWriteBusyStart = getTime_ms();
 			}
 		}
 
@@ -510,6 +848,7 @@ sdWriteSectorDMAPoll(int sendStopToken)
 			// Wait while the SD card is busy
 			if (sdSpiByte(0xFF) == 0xFF)
 			{
+				sdWriteLatencyRecord(elapsedTime_ms(sdWriteBusyStart));
 				if (sendStopToken)
 				{
 					sdIOState = SD_BUSY;
@@ -520,6 +859,7 @@ sdWriteSectorDMAPoll(int sendStopToken)
 				else
 				{
 					sdIOState = SD_IDLE;
+					sdDev.busyCycles += getTime_cycles() - sdBusyStart;
 				}
 			}
 		}
@@ -530,6 +870,7 @@ sdWriteSectorDMAPoll(int sendStopToken)
 			if (sdSpiByte(0xFF) == 0xFF)
 			{
 				sdIOState = SD_IDLE;
+				sdDev.busyCycles += getTime_cycles() - sdBusyStart;
 			}
 		}
 
@@ -543,6 +884,7 @@ sdWriteSectorDMAPoll(int sendStopToken)
 
 void sdCompleteWrite()
 {
+	sdMultiSectorPrepWait();
 	if (unlikely(sdIOState != SD_IDLE))
 	{
 		// Not much choice but to wait until we've completed the transfer.
@@ -550,9 +892,17 @@ void sdCompleteWrite()
 		// the SD card.
 		trace(trace_spinSDCompleteWrite);
 		while (!sdWriteSectorDMAPoll(1)) { /* spin */ }
+		trace(trace_spinDone);
+	}
+	else if (transfer.inProgress)
+	{
+		// Stopped between sectors. The multi-block write is still open.
+		sdWaitWriteBusy();
+		sdSpiByte(0xFD); // STOP TOKEN
+		sdWaitWriteBusy();
 	}
 
-	if (transfer.inProgress && likely(scsiDev.phase == DATA_OUT))
+	if (likely(scsiDev.phase == DATA_OUT))
 	{
 		uint16_t r2 = sdDoCommand(SD_SEND_STATUS, 0, 0, 1);
 		if (unlikely(r2))
@@ -568,6 +918,105 @@ void sdCompleteWrite()
 }
 
 
+// Close a multi-block write left open by the write cache, once all sectors
+// have been written. Returns non-zero if the card reported an error.
+int sdCompleteCachedWrite()
+{
+	sdWaitWriteBusy();
+	sdSpiByte(0xFD); // STOP TOKEN
+	sdWaitWriteBusy();
+
+	uint16_t r2 = sdDoCommand(SD_SEND_STATUS, 0, 0, 1);
+	if (unlikely(r2))
+	{
+		sdClearStatus();
+	}
+	return r2 != 0;
+}
+
+// Erase sequence started by sdEraseStart. CMD32, CMD33 and CMD38 must be
+// sent back-to-back, so the only place it can be abandoned is while
+// waiting for the card to finish the previous operation.
+enum SD_ERASE_STATE
+{
+	SD_ERASE_NONE,
+	SD_ERASE_BUSY, // Waiting for the card before CMD32.
+	SD_ERASE_START, // CMD32
+	SD_ERASE_END, // CMD33
+	SD_ERASE_ERASE // CMD38
+};
+static int sdEraseState = SD_ERASE_NONE;
+static uint32_t sdEraseFirst;
+static uint32_t sdEraseLast;
+
+void sdEraseStart(uint32_t sdLBA, uint32_t sdBlocks)
+{
+	sdEraseFirst = sdLBA;
+	sdEraseLast = sdLBA + sdBlocks - 1;
+	if (!sdDev.ccs)
+	{
+		sdEraseFirst = sdEraseFirst * SD_SECTOR_SIZE;
+		sdEraseLast = sdEraseLast * SD_SECTOR_SIZE;
+	}
+	sdEraseState = SD_ERASE_BUSY;
+}
+
+int sdErasePoll()
+{
+	switch (sdEraseState)
+	{
+	case SD_ERASE_BUSY:
+		// One byte per call, so there's nothing left in the SPI FIFO if
+		// we're cancelled.
+		if (sdSpiByte(0xFF) == 0xFF)
+		{
+			sdCommandStart(SD_ERASE_WR_BLK_START, sdEraseFirst, 0);
+			sdEraseState = SD_ERASE_START;
+		}
+		return 0;
+
+	case SD_ERASE_START:
+	case SD_ERASE_END:
+	case SD_ERASE_ERASE:
+		if (!sdCommandPoll())
+		{
+			return 0;
+		}
+		else if (unlikely(sdCmd.response))
+		{
+			sdEraseState = SD_ERASE_NONE;
+			sdClearStatus();
+			return -1;
+		}
+		else if (sdEraseState == SD_ERASE_START)
+		{
+			sdCommandStart(SD_ERASE_WR_BLK_END, sdEraseLast, 0);
+			sdEraseState = SD_ERASE_END;
+			return 0;
+		}
+		else if (sdEraseState == SD_ERASE_END)
+		{
+			sdCommandStart(SD_ERASE, 0, 0);
+			sdEraseState = SD_ERASE_ERASE;
+			return 0;
+		}
+		sdEraseState = SD_ERASE_NONE;
+		return 1;
+
+	default:
+		return 1;
+	}
+}
+
+int sdEraseCancel()
+{
+	if (sdEraseState == SD_ERASE_BUSY)
+	{
+		sdEraseState = SD_ERASE_NONE;
+	}
+	return sdEraseState == SD_ERASE_NONE;
+}
+
 // SD Version 2 (SDHC) support
 static int sendIfCond()
 {
@@ -676,6 +1125,76 @@ static void sdReadCID()
 	sdSpiByte(0xFF); // CRC
 }
 
+// ACMD51. Only used to check for CMD23 support. Cards that don't respond
+// just use CMD12 as before.
+static void sdReadSCR()
+{
+	uint8 startToken;
+	int maxWait, i;
+
+	sdCRCCommandAndResponse(SD_APP_CMD, 0);
+	uint8 status = sdCRCCommandAndResponse(SD_APP_SEND_SCR, 0);
+	if(status){sdClearStatus(); return;}
+
+	maxWait = 1023;
+	do
+	{
+		startToken = sdSpiByte(0xFF);
+	} while(maxWait-- && (startToken != 0xFE));
+	if (startToken != 0xFE) { return; }
+
+	for (i = 0; i < 8; ++i)
+	{
+		sdDev.scr[i] = sdSpiByte(0xFF);
+	}
+	sdSpiByte(0xFF); // CRC
+	sdSpiByte(0xFF); // CRC
+
+	// CMD_SUPPORT in bits [35:32]. Bit 33 is CMD23.
+	sdDev.cmd23 = (sdDev.scr[3] & 0x02) ? 1 : 0;
+}
+
+// ACMD13. Only used for the allocation unit size. Cards that don't respond
+// keep SD_DEFAULT_AU_SECTORS.
+static void sdReadSDStatus()
+{
+	uint8 startToken;
+	int maxWait;
+	uint32 i;
+	uint8_t status[64];
+
+	sdCRCCommandAndResponse(SD_APP_CMD, 0);
+	uint16_t r2 = sdDoCommand(SD_APP_SD_STATUS, 0, 1, 1);
+	if(r2){sdClearStatus(); return;}
+
+	maxWait = 1023;
+	do
+	{
+		startToken = sdSpiByte(0xFF);
+	} while(maxWait-- && (startToken != 0xFE));
+	if (startToken != 0xFE) { return; }
+
+	for (i = 0; i < sizeof(status); ++i)
+	{
+		status[i] = sdSpiByte(0xFF);
+	}
+	sdSpiByte(0xFF); // CRC
+	sdSpiByte(0xFF); // CRC
+
+	// AU_SIZE in bits [431:428]. 16kB to 4MB in powers of 2, then 8MB to
+	// 64MB in SDXC steps.
+	static const uint32_t largeAU[] = {16384, 24576, 32768, 49152, 65536, 131072};
+	uint8_t auSize = status[10] >> 4;
+	if ((auSize >= 1) && (auSize <= 9))
+	{
+		sdDev.auSectors = 32 << (auSize - 1);
+	}
+	else if (auSize > 9)
+	{
+		sdDev.auSectors = largeAU[auSize - 10];
+	}
+}
+
 static int sdReadCSD()
 {
 	uint8 startToken;
@@ -768,6 +1287,10 @@ int sdInit()
 	sdDev.capacity = 0;
 	memset(sdDev.csd, 0, sizeof(sdDev.csd));
 	memset(sdDev.cid, 0, sizeof(sdDev.cid));
+	memset(sdDev.scr, 0, sizeof(sdDev.scr));
+	sdDev.cmd23 = 0;
+	sdDev.auSectors = SD_DEFAULT_AU_SECTORS;
+	sdWriteLatencyReset();
 
 	sdInitDMA();
 
@@ -830,6 +1353,8 @@ int sdInit()
 
 	if (!sdReadCSD()) goto bad;
 	sdReadCID();
+	sdReadSCR();
+	sdReadSDStatus();
 
 	result = 1;
 	goto out;
@@ -845,52 +1370,74 @@ out:
 
 }
 
+// Start ACMD23 and CMD25 for the current transfer. Completed by
+// sdMultiSectorPrepPoll.
 void sdWriteMultiSectorPrep()
 {
-	uint8 v;
-
-	// Set the number of blocks to pre-erase by the multiple block write command
-	// We don't care about the response - if the command is not accepted, writes
-	// will just be a bit slower.
-	// Max 22bit parameter.
+	uint64 scsiLBA = (transfer.lba + transfer.currentBlock);
 	uint32_t sdBlocks =
-		transfer.blocks *
-			SDSectorsPerSCSISector(scsiDev.target->liveCfg.bytesPerSector);
-	uint32 blocks = sdBlocks > 0x7FFFFF ? 0x7FFFFF : sdBlocks;
-	sdCommandAndResponse(SD_APP_CMD, 0);
-	sdCommandAndResponse(SD_APP_SET_WR_BLK_ERASE_COUNT, blocks);
-
-	uint32 scsiLBA = (transfer.lba + transfer.currentBlock);
+		SCSIBlocks2SD(
+			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->liveCfg.packed,
+			scsiLBA,
+			transfer.blocks);
 	uint32 sdLBA =
 		SCSISector2SD(
-			scsiDev.target->cfg->sdSectorStart,
+			scsiDev.target->liveCfg.sdSectorStart,
 			scsiDev.target->liveCfg.bytesPerSector,
+			scsiDev.target->liveCfg.packed,
 			scsiLBA);
+	sdWriteMultiSectorStart(sdLBA, sdBlocks);
+}
+
+// Start ACMD23 and CMD25. Completed by sdMultiSectorPrepPoll.
+void sdWriteMultiSectorStart(uint32_t sdLBA, uint32_t sdBlocks)
+{
+	// Set the number of blocks to pre-erase by the multiple block write command
+	// Max 22bit parameter.
+	sdPrepBlocks = sdBlocks > 0x7FFFFF ? 0x7FFFFF : sdBlocks;
+
 	if (!sdDev.ccs)
 	{
 		sdLBA = sdLBA * SD_SECTOR_SIZE;
 	}
-	v = sdCommandAndResponse(SD_WRITE_MULTIPLE_BLOCK, sdLBA);
-	if (unlikely(v))
-	{
-		scsiDiskReset();
-		sdClearStatus();
-		scsiDev.status = CHECK_CONDITION;
-		scsiDev.target->sense.code = HARDWARE_ERROR;
-		scsiDev.target->sense.asc = LOGICAL_UNIT_COMMUNICATION_FAILURE;
-		scsiDev.phase = STATUS;
-	}
-	else
+	sdPrepLBA = sdLBA;
+	sdCommandStart(SD_APP_CMD, 0, 0);
+	sdPrepState = SD_PREP_APP_CMD;
+
+	// sdCompleteWrite waits for the commands if we're reset first.
+	transfer.inProgress = 1;
+}
+
+// Tell the host, on every logical unit, that the SD card has changed.
+static void sdParametersChanged()
+{
+	int i;
+	for (i = 0; i < MAX_SCSI_TARGETS; ++i)
 	{
-		transfer.inProgress = 1;
+		TargetState* target = &scsiDev.targets[i];
+		target->unitAttention = PARAMETERS_CHANGED;
+
+		int lun;
+		for (lun = 0; target->cfg && (lun < CONFIG_MAX_LUNS); ++lun)
+		{
+			if (scsiLunEnabled(target, lun))
+			{
+				target->luns[lun].unitAttention = PARAMETERS_CHANGED;
+			}
+		}
 	}
 }
 
 void sdPoll()
 {
 	// Check if there's an SD card present.
+	// Toggling CS would break an open read-ahead stream or cached write.
+	// They're closed again soon after the host goes idle.
 	if ((scsiDev.phase == BUS_FREE) &&
-		(sdIOState == SD_IDLE))
+		(sdIOState == SD_IDLE) &&
+		!readAhead.active &&
+		!writeCache.active)
 	{
 		// The CS line is pulled high by the SD card.
 		// De-assert the line, and check if it's high.
@@ -918,11 +1465,7 @@ void sdPoll()
 
 				if (!firstInit)
 				{
-					int i;
-					for (i = 0; i < MAX_SCSI_TARGETS; ++i)
-					{
-						scsiDev.targets[i].unitAttention = PARAMETERS_CHANGED;
-					}
+					sdParametersChanged();
 				}
 				firstInit = 0;
 			}
@@ -932,11 +1475,8 @@ void sdPoll()
 			sdDev.capacity = 0;
 			blockDev.state &= ~DISK_PRESENT;
 			blockDev.state &= ~DISK_INITIALISED;
-			int i;
-			for (i = 0; i < MAX_SCSI_TARGETS; ++i)
-			{
-				scsiDev.targets[i].unitAttention = PARAMETERS_CHANGED;
-			}
+			scsiDiskCacheClear();
+			sdParametersChanged();
 		}
 	}
 }
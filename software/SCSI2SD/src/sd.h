@@ -28,12 +28,18 @@ typedef enum
 	SD_SEND_CID = 10,
 	SD_STOP_TRANSMISSION = 12,
 	SD_SEND_STATUS = 13,
+	SD_APP_SD_STATUS = 13,
 	SD_SET_BLOCKLEN = 16,
 	SD_READ_SINGLE_BLOCK = 17,
 	SD_READ_MULTIPLE_BLOCK = 18,
+	SD_SET_BLOCK_COUNT = 23, // Optional. See SdDevice.cmd23
 	SD_APP_SET_WR_BLK_ERASE_COUNT = 23,
 	SD_WRITE_MULTIPLE_BLOCK = 25,
+	SD_ERASE_WR_BLK_START = 32,
+	SD_ERASE_WR_BLK_END = 33,
+	SD_ERASE = 38,
 	SD_APP_SEND_OP_COND = 41,
+	SD_APP_SEND_SCR = 51,
 	SD_APP_CMD = 55,
 	SD_READ_OCR = 58,
 	SD_CRC_ON_OFF = 59
@@ -50,6 +56,34 @@ typedef enum
 	SD_R1_PARAMETER = 0x40
 } SD_R1;
 
+// Moving distribution of the time the card stays busy after accepting each
+// written sector. One bucket per power of 2 milliseconds: bucket 0 is under
+// 1ms, bucket 1 is 1ms, bucket 2 is 2-3ms, ... and the last bucket is 64ms
+// or more.
+#define SD_LATENCY_BUCKETS 8
+
+// Thresholds used until there are enough samples.
+#define SD_LATENCY_MIN_SAMPLES 64
+#define SD_DEFAULT_DISCONNECT_MS 20
+#define SD_DEFAULT_EARLY_STATUS_MS 150
+
+typedef struct
+{
+	// All counts are halved when one of them overflows, so old samples
+	// fade out.
+	uint16_t count[SD_LATENCY_BUCKETS];
+
+	// Upper bounds of the 50th and 99th percentiles.
+	uint8_t p50_ms;
+	uint8_t p99_ms;
+
+	// Disconnect from the bus after waiting this long for the card.
+	uint8_t disconnect_ms;
+
+	// If we can't disconnect, report GOOD status after waiting this long.
+	uint8_t earlyStatus_ms;
+} SdLatency;
+
 typedef struct
 {
 	int version; // SDHC = version 2.
@@ -58,6 +92,22 @@ typedef struct
 
 	uint8_t csd[16]; // Unparsed CSD
 	uint8_t cid[16]; // Unparsed CID
+	uint8_t scr[8]; // Unparsed SCR
+
+	int cmd23; // SET_BLOCK_COUNT supported. From the SCR.
+
+	// Allocation unit size in sectors, from the SD Status. Erases are split
+	// on these boundaries.
+	uint32_t auSectors;
+
+	SdLatency writeLatency;
+
+	// Total time spent transferring sectors, including write programming.
+	// In getTime_cycles() units, and wraps.
+	uint32_t busyCycles;
+
+	// Multi-block reads restarted after a CRC error.
+	uint32_t readRetries;
 } SdDevice;
 
 extern SdDevice sdDev;
@@ -69,16 +119,45 @@ int sdInit(void);
 #define sdDMABusy() (!(sdRxDMAComplete && sdTxDMAComplete))
 
 void sdWriteMultiSectorPrep(void);
+void sdWriteMultiSectorStart(uint32_t sdLBA, uint32_t sdBlocks);
 void sdWriteMultiSectorDMA(uint8_t* outputBuffer);
 int sdWriteSectorDMAPoll(int sendStopToken);
 void sdCompleteWrite(void);
+int sdCompleteCachedWrite(void);
+
+// Don't wait longer than this for a start-block token.
+// The standard recommends 100ms.
+#define SD_READ_TOKEN_TIMEOUT_MS 200
+
+// Re-read a sector this many times if CONFIG_ENABLE_SD_CRC is set and the
+// CRC doesn't match.
+#define SD_CRC_RETRIES 3
 
-void sdReadMultiSectorPrep(void);
-void sdReadMultiSectorDMA(uint8_t* outputBuffer);
-void sdReadSingleSectorDMA(uint32_t lba, uint8_t* outputBuffer);
+int sdMultiSectorPrepPoll(void);
+
+void sdReadMultiSectorPrep(uint32_t sdBlocks);
+void sdReadMultiSectorStart(uint32_t sdLBA, uint32_t sdBlocks);
+void sdReadMultiSectorRetry(uint32_t sdLBA, uint32_t sdBlocks);
+int sdReadSingleSectorPrep(uint32_t lba);
+int sdReadSectorDMAStart(uint8_t* outputBuffer);
+void sdReadSectorError(void);
 int sdReadSectorDMAPoll();
+uint16_t sdReadSectorCRC(void);
 void sdCompleteRead(void);
 
+void sdCompleteReadAhead(void);
+
+// Start CMD32/CMD33/CMD38 for one range. sdErasePoll returns 1 once the
+// card has accepted the erase, and -1 on error. The card stays busy while
+// it erases, and the next command waits for it.
+#define SD_DEFAULT_AU_SECTORS 8192 // 4MB
+void sdEraseStart(uint32_t sdLBA, uint32_t sdBlocks);
+int sdErasePoll(void);
+
+// Abandon the erase if it hasn't been sent to the card yet. Returns 0 if
+// sdErasePoll must be called until it completes.
+int sdEraseCancel(void);
+
 void sdPoll();
 
 #endif
@@ -58,6 +58,7 @@ typedef enum
 	DEFECT_LIST_ERROR_IN_PRIMARY_LIST                      = 0x1902,
 	DEFECT_LIST_NOT_AVAILABLE                              = 0x1901,
 	DEFECT_LIST_NOT_FOUND                                  = 0x1C00,
+	ERASE_FAILURE                                          = 0x5100,
 	DEFECT_LIST_UPDATE_FAILURE                             = 0x3201,
 	ERROR_LOG_OVERFLOW                                     = 0x0A00,
 	ERROR_TOO_LONG_TO_CORRECT                              = 0x1102,
@@ -69,6 +70,7 @@ typedef enum
 	INCOMPATIBLE_MEDIUM_INSTALLED                          = 0x3000,
 	INITIATOR_DETECTED_ERROR_MESSAGE_RECEIVED              = 0x4800,
 	INQUIRY_DATA_HAS_CHANGED                               = 0x3F03,
+	INSUFFICIENT_RESOURCES                                 = 0x5503,
 	INTERNAL_TARGET_FAILURE                                = 0x4400,
 	INVALID_BITS_IN_IDENTIFY_MESSAGE                       = 0x3D00,
 	INVALID_COMMAND_OPERATION_CODE                         = 0x2000,
@@ -85,12 +87,14 @@ typedef enum
 	LOGICAL_UNIT_COMMUNICATION_TIMEOUT                     = 0x0801,
 	LOGICAL_UNIT_DOES_NOT_RESPOND_TO_SELECTION             = 0x0500,
 	LOGICAL_UNIT_FAILED_SELF_CONFIGURATION                 = 0x4C00,
+	LOGICAL_UNIT_FAILED_SELF_TEST                          = 0x3E03,
 	LOGICAL_UNIT_HAS_NOT_SELF_CONFIGURED_YET               = 0x3E00,
 	LOGICAL_UNIT_IS_IN_PROCESS_OF_BECOMING_READY           = 0x0401,
 	LOGICAL_UNIT_NOT_READY_CAUSE_NOT_REPORTABLE            = 0x0400,
 	LOGICAL_UNIT_NOT_READY_FORMAT_IN_PROGRESS              = 0x0404,
 	LOGICAL_UNIT_NOT_READY_INITIALIZING_COMMAND_REQUIRED   = 0x0402,
 	LOGICAL_UNIT_NOT_READY_MANUAL_INTERVENTION_REQUIRED    = 0x0403,
+	LOGICAL_UNIT_NOT_READY_OPERATION_IN_PROGRESS           = 0x0407,
 	LOGICAL_UNIT_NOT_SUPPORTED                             = 0x2500,
 	MECHANICAL_POSITIONING_ERROR                           = 0x1501,
 	MEDIA_LOAD_OR_EJECT_FAILED                             = 0x5300,
@@ -0,0 +1,97 @@
+//	Copyright (C) 2015 Michael McMaster <michael@codesrc.com>
+//
+//	This file is part of SCSI2SD.
+//
+//	SCSI2SD is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	SCSI2SD is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with SCSI2SD.  If not, see <http://www.gnu.org/licenses/>.
+#pragma GCC push_options
+#pragma GCC optimize("-flto")
+
+#include "device.h"
+#include "scsi.h"
+#include "sd.h"
+#include "stats.h"
+#include "time.h"
+
+CommandStats stats[MAX_SCSI_TARGETS][CONFIG_STATS_CLASSES];
+TargetStats targetStats[MAX_SCSI_TARGETS];
+
+static int statsClass(uint8 command)
+{
+	switch (command)
+	{
+	case 0x08: // READ(6)
+	case 0x28: // READ(10)
+	case 0xA8: // READ(12)
+	case 0x88: // READ(16)
+		return CONFIG_STATS_READ;
+
+	case 0x0A: // WRITE(6)
+	case 0x2A: // WRITE(10)
+	case 0xAA: // WRITE(12)
+	case 0x8A: // WRITE(16)
+	case 0x2E: // WRITE AND VERIFY
+		return CONFIG_STATS_WRITE;
+
+	default:
+		return CONFIG_STATS_OTHER;
+	}
+}
+
+// Histogram bucket for a time in getTime_cycles() units.
+static int statsBucket(uint32_t cycles)
+{
+	uint32_t us = cycles / CYCLES_PER_US;
+	int bucket = 0;
+	while ((bucket < CONFIG_STATS_BUCKETS - 1) && (us >> bucket))
+	{
+		++bucket;
+	}
+	return bucket;
+}
+
+void statsCommandStart()
+{
+	scsiDev.cmdStartTime = getTime_cycles();
+	scsiDev.cmdStartSDBusy = sdDev.busyCycles;
+	scsiDev.cmdDataBytes = 0;
+}
+
+void statsCommandDone()
+{
+	int tgtIndex = scsiDev.target - scsiDev.targets;
+	CommandStats* s = &stats[tgtIndex][statsClass(scsiDev.cdb[0])];
+	uint32_t sdBusy = sdDev.busyCycles - scsiDev.cmdStartSDBusy;
+
+	s->commands++;
+	if ((scsiDev.status != GOOD) && (scsiDev.status != INTERMEDIATE))
+	{
+		s->errors++;
+	}
+	s->bytes += scsiDev.cmdDataBytes;
+
+	// Histogram buckets are only 16 bits, so they stick at their maximum
+	// rather than wrapping.
+	int bucket = statsBucket(getTime_cycles() - scsiDev.cmdStartTime);
+	if (s->latency[bucket] != 0xFFFF) s->latency[bucket]++;
+	bucket = statsBucket(sdBusy);
+	if (s->sdBusy[bucket] != 0xFFFF) s->sdBusy[bucket]++;
+	targetStats[tgtIndex].sdBusyCycles += sdBusy;
+}
+
+void statsDisconnect()
+{
+	targetStats[scsiDev.target - scsiDev.targets].disconnects++;
+}
+
+#pragma GCC pop_options
@@ -0,0 +1,44 @@
+//	Copyright (C) 2015 Michael McMaster <michael@codesrc.com>
+//
+//	This file is part of SCSI2SD.
+//
+//	SCSI2SD is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	SCSI2SD is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with SCSI2SD.  If not, see <http://www.gnu.org/licenses/>.
+#ifndef STATS_H
+#define STATS_H
+
+#include "device.h"
+#include "scsi2sd.h"
+
+// Read by the CONFIG_STATS command.
+extern CommandStats stats[MAX_SCSI_TARGETS][CONFIG_STATS_CLASSES];
+
+// Totals for each target since power-on, read by LOG SENSE.
+typedef struct
+{
+	uint64_t sdBusyCycles; // Sum of the per-command SD card busy times.
+	uint32_t disconnects; // DISCONNECT messages sent.
+} TargetStats;
+
+extern TargetStats targetStats[MAX_SCSI_TARGETS];
+
+// Called at selection, and again when a linked or queued command starts.
+void statsCommandStart(void);
+
+// Called once the status byte has been sent.
+void statsCommandDone(void);
+
+// Called when we send a DISCONNECT message.
+void statsDisconnect(void);
+
+#endif
@@ -38,6 +38,16 @@ void timeInit()
 	// Ensure the cycle count is < 24bit.
 	// At 50MHz bus clock, counter is 50000.
 	SysTick_Config((BCLK__BUS_CLK__HZ + 999u) / 1000u);
+
+	// Free-running bus clock cycle counter, for timing shorter than 1ms.
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+uint32_t getTime_cycles()
+{
+	return DWT->CYCCNT;
 }
 
 uint32_t getTime_ms()
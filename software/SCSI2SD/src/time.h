@@ -24,4 +24,9 @@ uint32_t getTime_ms(void); // Returns milliseconds since init
 uint32_t diffTime_ms(uint32_t start, uint32_t end);
 uint32_t elapsedTime_ms(uint32_t since);
 
+// Wraps every 85 seconds. Differences are still correct if unsigned
+// subtraction is used.
+uint32_t getTime_cycles(void);
+#define CYCLES_PER_US (BCLK__BUS_CLK__HZ / 1000000)
+
 #endif
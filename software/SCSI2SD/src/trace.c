@@ -46,6 +46,18 @@
 
 #define TPIU_FFCR_ENFCONT	(1 << 1)
 
+#ifdef TRACE_RAM
+TraceRecord traceRing[TRACE_RAM_SLOTS];
+volatile uint32_t traceCount;
+volatile uint8_t tracePaused;
+
+void traceInit(void) {
+	// The cycle counter is already running. See timeInit.
+	traceCount = 0;
+	tracePaused = 0;
+	trace(trace_begin);
+}
+#else
 void traceInit(void) {
 	// enable the trace module clocks
 	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
@@ -71,3 +83,4 @@ void traceInit(void) {
 	
 	trace(trace_begin);
 }
+#endif
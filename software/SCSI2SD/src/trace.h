@@ -17,6 +17,10 @@
 
 // Trace event IDs to be output. 1 and 9 are generated as headers on ports 0
 // and 1 respectively, and should not be used.
+//
+// Define TRACE to send events out the SWV pin, or TRACE_RAM to record
+// them with a cycle count in an SRAM ring that can be read with the
+// CONFIG_TRACE HID command. tools/traceDecode.pl decodes either.
 enum trace_event {
 	trace_begin = 0,
 
@@ -46,6 +50,14 @@ enum trace_event {
 
 	// completion
 	trace_sdSpiByte = 0x40,
+	trace_spinDone, // End of any spin loop without its own completion event.
+
+	// SD command engine states. See sdCommandPoll.
+	trace_sdCmdBusy = 0x60,
+	trace_sdCmdSend,
+	trace_sdCmdResponse,
+	trace_sdCmdDone,
+	trace_sdPrepDone,
 };
 
 void traceInit(void);
@@ -70,6 +82,34 @@ void traceInit(void);
 		wait_fifo(1);
 		ITM->PORT[1].u8 = ch;
 	}
+#elif defined(TRACE_RAM)
+	#include <core_cm3_psoc5.h>
+	#include "scsi2sd.h"
+
+	// Must be a power of 2. 8 bytes per record.
+	#ifndef TRACE_RAM_SLOTS
+	#define TRACE_RAM_SLOTS 512
+	#endif
+
+	extern TraceRecord traceRing[TRACE_RAM_SLOTS];
+	extern volatile uint32_t traceCount;
+	extern volatile uint8_t tracePaused;
+
+	// Interrupts are masked so an ISR can't claim the same slot.
+	static inline void traceRam(enum trace_event ch, uint8_t irq) {
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		if (!tracePaused) {
+			TraceRecord* rec = &traceRing[traceCount & (TRACE_RAM_SLOTS - 1)];
+			rec->cycles = DWT->CYCCNT;
+			rec->event = ch;
+			rec->irq = irq;
+			++traceCount;
+		}
+		__set_PRIMASK(primask);
+	}
+	#define trace(ev) traceRam(ev, 0)
+	#define traceIrq(ev) traceRam(ev, 1)
 #else
 	#define trace(ev)
 	#define traceIrq(ev)
@@ -0,0 +1,208 @@
+//	Copyright (C) 2015 Michael McMaster <michael@codesrc.com>
+//
+//	This file is part of SCSI2SD.
+//
+//	SCSI2SD is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	SCSI2SD is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with SCSI2SD.  If not, see <http://www.gnu.org/licenses/>.
+
+// Checks crc16() against a bit-at-a-time reference, and models the cost of
+// checking the CRC of SD read data in scsiDiskPoll(). Each sector is checked
+// while the card sends the next one.
+// gcc -iquote ../src -o crc16Test crc16Test.c ../src/crc16.c && ./crc16Test
+
+#include "crc16.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// All times in microseconds. See readAheadSim.c
+#define SD_OPEN_US 1000
+#define SD_SECTOR_US 175 // 25MHz SPI
+#define SCSI_SECTOR_US 150
+#define SCSI_CMD_US 60
+#define HOST_GAP_US 250
+
+// Table lookup, shift and xor. About 8 cycles per byte at 50MHz, with flash
+// wait states.
+#define CRC_CYCLES_PER_BYTE 8
+#define CRC_US (512.0 * CRC_CYCLES_PER_BYTE / 50)
+
+#define RING_SECTORS 32
+#define COMMANDS 1024
+
+static double max(double a, double b) { return a > b ? a : b; }
+
+static uint16_t crc16Reference(const uint8_t* buf, uint32_t len)
+{
+	uint16_t crc = 0;
+	uint32_t i;
+	for (i = 0; i < len; ++i)
+	{
+		int bit;
+		crc ^= ((uint16_t)buf[i]) << 8;
+		for (bit = 0; bit < 8; ++bit)
+		{
+			crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+		}
+	}
+	return crc;
+}
+
+static void testCRC()
+{
+	// From the SD Physical Layer Simplified Specification, 4.5
+	uint8_t ones[512];
+	memset(ones, 0xFF, sizeof(ones));
+	assert(crc16(ones, sizeof(ones)) == 0x7FA1);
+
+	static uint8_t buf[520] __attribute__((aligned(4)));
+	int i;
+	for (i = 0; i < (int)sizeof(buf); ++i)
+	{
+		buf[i] = rand();
+	}
+
+	// Every alignment and tail length of the word-wide loop.
+	int offset;
+	for (offset = 0; offset < 4; ++offset)
+	{
+		int len;
+		for (len = 0; len <= 512; ++len)
+		{
+			assert(crc16(buf + offset, len) ==
+				crc16Reference(buf + offset, len));
+		}
+	}
+
+	// A single bit error is always detected.
+	uint16_t good = crc16(buf, 512);
+	for (i = 0; i < 512 * 8; ++i)
+	{
+		buf[i / 8] ^= 1 << (i % 8);
+		assert(crc16(buf, 512) != good);
+		buf[i / 8] ^= 1 << (i % 8);
+	}
+}
+
+// Sequential READ commands, with the read-ahead engine keeping the stream
+// open. Returns the elapsed time.
+static double simulate(int sectorsPerCmd, int checkCRC)
+{
+	static double sdDone[COMMANDS * 128];
+	static double verified[COMMANDS * 128];
+	static double sent[COMMANDS * 128];
+	int total = COMMANDS * sectorsPerCmd;
+	assert(total <= (int)(sizeof(sdDone) / sizeof(sdDone[0])));
+
+	double crc = checkCRC ? CRC_US : 0;
+	double now = 0;
+	int s = 0;
+	int cmd;
+	for (cmd = 0; cmd < COMMANDS; ++cmd)
+	{
+		now += SCSI_CMD_US;
+
+		int j;
+		for (j = 0; j < sectorsPerCmd; ++j, ++s)
+		{
+			// The next sector DMA is started before the previous sector is
+			// checked, so the card never waits for the CRC.
+			double cardFree = (s == 0) ? now + SD_OPEN_US : sdDone[s - 1];
+			if (s >= RING_SECTORS)
+			{
+				cardFree = max(cardFree, sent[s - RING_SECTORS]);
+			}
+			sdDone[s] = cardFree + SD_SECTOR_US;
+
+			// One sector is checked at a time.
+			verified[s] =
+				max(sdDone[s], (s == 0) ? 0 : verified[s - 1]) + crc;
+		}
+
+		double scsiDone = now;
+		for (j = s - sectorsPerCmd; j < s; ++j)
+		{
+			scsiDone = max(verified[j], scsiDone) + SCSI_SECTOR_US;
+			sent[j] = scsiDone;
+		}
+		now = scsiDone + HOST_GAP_US;
+	}
+	return now;
+}
+
+// Random single-sector READ commands. The CRC of the only sector can't be
+// overlapped with anything.
+static double simulateRandom(int checkCRC)
+{
+	double perCmd =
+		SCSI_CMD_US + SD_OPEN_US + SD_SECTOR_US + SCSI_SECTOR_US + HOST_GAP_US;
+	if (checkCRC)
+	{
+		perCmd += CRC_US;
+	}
+	return perCmd * COMMANDS;
+}
+
+static double hostNsPerSector()
+{
+	static uint8_t buf[512] __attribute__((aligned(4)));
+	memset(buf, 0x5A, sizeof(buf));
+
+	const int loops = 100000;
+	volatile uint16_t sink = 0;
+	clock_t start = clock();
+	int i;
+	for (i = 0; i < loops; ++i)
+	{
+		buf[0] = i;
+		sink ^= crc16(buf, sizeof(buf));
+	}
+	clock_t end = clock();
+	(void)sink;
+	return (double)(end - start) / CLOCKS_PER_SEC * 1e9 / loops;
+}
+
+int main()
+{
+	testCRC();
+
+	printf("CRC per sector: %.1fus modelled on target, %.0fns on this host\n",
+		CRC_US, hostNsPerSector());
+	assert(CRC_US < SD_SECTOR_US);
+
+	printf("Size     No CRC (kB/s)   CRC (kB/s)   Cost\n");
+	int sectors;
+	for (sectors = 1; sectors <= 128; sectors *= 2)
+	{
+		double bytes = (double)COMMANDS * sectors * 512;
+		double plain = bytes / simulate(sectors, 0) * 1000000 / 1024;
+		double checked = bytes / simulate(sectors, 1) * 1000000 / 1024;
+		double cost = (plain - checked) / plain * 100;
+		printf("%5dB   %13.0f   %10.0f   %3.1f%%\n",
+			sectors * 512, plain, checked, cost);
+
+		// Hidden behind the next sector transfer.
+		assert(cost < 5);
+	}
+
+	double bytes = (double)COMMANDS * 512;
+	double plain = bytes / simulateRandom(0) * 1000000 / 1024;
+	double checked = bytes / simulateRandom(1) * 1000000 / 1024;
+	printf("Random   %13.0f   %10.0f   %3.1f%%\n",
+		plain, checked, (plain - checked) / plain * 100);
+	return 0;
+}
@@ -0,0 +1,157 @@
+//	Copyright (C) 2015 Michael McMaster <michael@codesrc.com>
+//
+//	This file is part of SCSI2SD.
+//
+//	SCSI2SD is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	SCSI2SD is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with SCSI2SD.  If not, see <http://www.gnu.org/licenses/>.
+
+// Host-side timing model of back-to-back sequential READ commands, with and
+// without the read-ahead engine in disk.c.
+// gcc -o readAheadSim readAheadSim.c && ./readAheadSim
+
+#include <assert.h>
+#include <stdio.h>
+
+// All times in microseconds.
+// SD card open latency: CMD17/CMD18 plus the wait for the first start token.
+#define SD_OPEN_US 1000
+// 512 bytes + token + CRC at 25MHz SPI, plus the gap between tokens.
+#define SD_SECTOR_US 175
+// CMD12 and the stuff byte.
+#define SD_STOP_US 30
+// 512 bytes over an asynchronous SCSI bus at ~3.5MB/s.
+#define SCSI_SECTOR_US 150
+// Selection, CDB, status and message phases.
+#define SCSI_CMD_US 60
+// Time the host spends between commands.
+#define HOST_GAP_US 250
+
+// scsiDev.data ring size, in SD sectors.
+#define RING_SECTORS 32
+
+#define COMMANDS 1024
+
+static double max(double a, double b) { return a > b ? a : b; }
+
+// Every READ opens and closes its own SD transfer.
+static double simulateOld(int sectorsPerCmd)
+{
+	double now = 0;
+	int cmd;
+	for (cmd = 0; cmd < COMMANDS; ++cmd)
+	{
+		now += SCSI_CMD_US;
+
+		double cardReady = now + SD_OPEN_US;
+		double scsiDone = now;
+		int j;
+		for (j = 0; j < sectorsPerCmd; ++j)
+		{
+			// The SD card reads the next sector while the previous one is
+			// sent over the SCSI bus.
+			cardReady += SD_SECTOR_US;
+			scsiDone = max(cardReady, scsiDone) + SCSI_SECTOR_US;
+		}
+		now = scsiDone;
+		if (sectorsPerCmd > 1)
+		{
+			now += SD_STOP_US; // CMD18 needs CMD12. CMD17 doesn't.
+		}
+		now += HOST_GAP_US;
+	}
+	return now;
+}
+
+// The card keeps streaming into the ring between commands.
+static double simulateReadAhead(int sectorsPerCmd, double* hitRatio)
+{
+	static double ready[COMMANDS * 16];
+	static double sent[COMMANDS * 16];
+	int total = COMMANDS * sectorsPerCmd;
+	assert(total <= (int)(sizeof(ready) / sizeof(ready[0])));
+
+	double now = 0;
+	int hits = 0;
+	int s = 0;
+	int cmd;
+	for (cmd = 0; cmd < COMMANDS; ++cmd)
+	{
+		now += SCSI_CMD_US;
+
+		int j;
+		for (j = 0; j < sectorsPerCmd; ++j, ++s)
+		{
+			double cardFree;
+			if (s == 0)
+			{
+				// First READ opens the stream. The second READ is the
+				// first one that can be served from the ring.
+				cardFree = now + SD_OPEN_US;
+			}
+			else
+			{
+				cardFree = ready[s - 1];
+			}
+			if (s >= RING_SECTORS)
+			{
+				// Wait for a free slot.
+				cardFree = max(cardFree, sent[s - RING_SECTORS]);
+			}
+			ready[s] = cardFree + SD_SECTOR_US;
+		}
+
+		if (cmd > 0 && ready[s - 1] <= now)
+		{
+			++hits;
+		}
+
+		double scsiDone = now;
+		for (j = s - sectorsPerCmd; j < s; ++j)
+		{
+			scsiDone = max(ready[j], scsiDone) + SCSI_SECTOR_US;
+			sent[j] = scsiDone;
+		}
+		now = scsiDone + HOST_GAP_US;
+	}
+	*hitRatio = (double)hits / COMMANDS;
+	return now;
+}
+
+int main()
+{
+	printf("Size   Old (kB/s)   Read-ahead (kB/s)   Gain   Fully buffered\n");
+
+	int sectors;
+	for (sectors = 1; sectors <= 8; sectors *= 2)
+	{
+		double bytes = (double)COMMANDS * sectors * 512;
+		double oldTime = simulateOld(sectors);
+		double hitRatio;
+		double newTime = simulateReadAhead(sectors, &hitRatio);
+
+		double oldRate = bytes / oldTime * 1000000 / 1024;
+		double newRate = bytes / newTime * 1000000 / 1024;
+
+		printf("%4dB  %10.0f   %17.0f   %4.2fx  %13.0f%%\n",
+			sectors * 512,
+			oldRate,
+			newRate,
+			newRate / oldRate,
+			hitRatio * 100);
+
+		// The stream never makes things slower.
+		assert(newTime <= oldTime);
+	}
+	return 0;
+}
+
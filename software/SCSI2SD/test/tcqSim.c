@@ -0,0 +1,285 @@
+//	Copyright (C) 2015 Michael McMaster <michael@codesrc.com>
+//
+//	This file is part of SCSI2SD.
+//
+//	SCSI2SD is free software: you can redistribute it and/or modify
+//	it under the terms of the GNU General Public License as published by
+//	the Free Software Foundation, either version 3 of the License, or
+//	(at your option) any later version.
+//
+//	SCSI2SD is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//	GNU General Public License for more details.
+//
+//	You should have received a copy of the GNU General Public License
+//	along with SCSI2SD.  If not, see <http://www.gnu.org/licenses/>.
+
+// Host-side timing model of a mixed random/sequential READ load at queue
+// depth 4. Compares untagged commands (run in the order the host issues
+// them) against tagged commands picked the same way as queueNext() in scsi.c.
+// Also checks that reselection identifies the right command when several LUNs
+// have commands queued with the same tag.
+// gcc -o tcqSim tcqSim.c && ./tcqSim
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// All times in microseconds. See readAheadSim.c
+#define SD_OPEN_US 1000
+#define SD_SECTOR_US 175
+#define SD_STOP_US 30
+#define SCSI_SECTOR_US 150
+#define SCSI_CMD_US 60
+#define HOST_GAP_US 250
+
+// DISCONNECT message, bus free, arbitration, reselection, IDENTIFY and
+// SIMPLE QUEUE TAG.
+#define RESELECT_US 40
+
+#define RING_SECTORS 32
+#define QUEUE_DEPTH 4
+#define BLOCKS 8 // 4kB reads.
+#define DISK_SECTORS (1 << 21)
+#define COMMANDS 4096
+
+static double max(double a, double b) { return a > b ? a : b; }
+
+static uint32_t seed;
+static uint32_t random32()
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+typedef struct
+{
+	uint32_t lba;
+	uint32_t issued; // Host issue order.
+	double arrival;
+} Command;
+
+typedef struct
+{
+	int active; // Multi-block read left open.
+	uint32_t nextLBA;
+	double nextReady; // When the card has the next sector in the ring.
+	uint32_t lastEnd;
+} Card;
+
+// Run one command starting at "now". Returns the completion time.
+static double execute(Card* card, uint32_t lba, double now, int* hit)
+{
+	double ready;
+	if (card->active && (card->nextLBA == lba))
+	{
+		// Served from the read-ahead ring. The card stops once the ring is
+		// full.
+		*hit = 1;
+		ready = max(card->nextReady, now - RING_SECTORS * SD_SECTOR_US);
+	}
+	else
+	{
+		*hit = 0;
+		if (card->active)
+		{
+			now += SD_STOP_US;
+		}
+		ready = now + SD_OPEN_US + SD_SECTOR_US;
+	}
+
+	double scsiDone = now;
+	int i;
+	for (i = 0; i < BLOCKS; ++i)
+	{
+		scsiDone = max(ready, scsiDone) + SCSI_SECTOR_US;
+		ready += SD_SECTOR_US;
+	}
+
+	card->active = 1;
+	card->nextLBA = lba + BLOCKS;
+	card->nextReady = ready;
+	card->lastEnd = lba + BLOCKS;
+	return scsiDone;
+}
+
+// Returns the elapsed time for COMMANDS reads. seqPercent of the commands
+// continue a single sequential stream, the rest are random.
+static double simulate(int seqPercent, int tagged, double* hitRatio)
+{
+	Command queue[QUEUE_DEPTH];
+	Card card = {0, 0, 0, 0xFFFFFFFF};
+	uint32_t streamLBA = 0;
+	uint32_t issued = 0;
+	double now = 0;
+	int hits = 0;
+	int i;
+
+	seed = 1;
+	for (i = 0; i < QUEUE_DEPTH; ++i)
+	{
+		queue[i].arrival = 0;
+		queue[i].issued = 0;
+	}
+
+	int done;
+	for (done = 0; done < COMMANDS; ++done)
+	{
+		// Generate commands for any free host slots.
+		for (i = 0; i < QUEUE_DEPTH; ++i)
+		{
+			if (queue[i].issued == 0)
+			{
+				if ((int)(random32() % 100) < seqPercent)
+				{
+					queue[i].lba = streamLBA;
+					streamLBA += BLOCKS;
+				}
+				else
+				{
+					queue[i].lba = (random32() % (DISK_SECTORS / BLOCKS)) * BLOCKS;
+				}
+				queue[i].issued = ++issued;
+			}
+		}
+
+		// Wait for a command if none have arrived.
+		double first = queue[0].arrival;
+		for (i = 1; i < QUEUE_DEPTH; ++i)
+		{
+			if (queue[i].arrival < first) first = queue[i].arrival;
+		}
+		now = max(now, first);
+
+		// Host order. Tagged commands that continue the read-ahead stream
+		// go first.
+		int next = -1;
+		for (i = 0; i < QUEUE_DEPTH; ++i)
+		{
+			if (queue[i].arrival > now) continue;
+			if (next < 0 || queue[i].issued < queue[next].issued)
+			{
+				next = i;
+			}
+		}
+		assert(next >= 0);
+		for (i = 0; tagged && (i < QUEUE_DEPTH); ++i)
+		{
+			if ((queue[i].arrival <= now) && (queue[i].lba == card.lastEnd))
+			{
+				next = i;
+			}
+		}
+
+		now += SCSI_CMD_US;
+		if (tagged)
+		{
+			now += RESELECT_US;
+		}
+
+		int hit;
+		now = execute(&card, queue[next].lba, now, &hit);
+		hits += hit;
+
+		queue[next].arrival = now + HOST_GAP_US;
+		queue[next].issued = 0;
+	}
+
+	*hitRatio = (double)hits / COMMANDS;
+	return now;
+}
+
+// Tags are only unique per I_T_L nexus, so the initiator needs the LUN from
+// the IDENTIFY message as well as the tag to find the command being resumed.
+#define LUNS 4
+typedef struct
+{
+	int lun;
+	int tag;
+	int done;
+} Outstanding;
+
+// Same message bytes as scsiReconnect()
+static int reselectMessages(int lun, int tag, uint8_t* msg)
+{
+	msg[0] = 0x80 | (lun & 0x7); // IDENTIFY
+	msg[1] = 0x20; // SIMPLE QUEUE TAG
+	msg[2] = tag;
+	return 3;
+}
+
+static void checkMultiLunReselect()
+{
+	Outstanding cmds[LUNS * 2];
+	int count = 0;
+	int lun;
+	int tag;
+	for (tag = 0; tag < 2; ++tag)
+	{
+		for (lun = 0; lun < LUNS; ++lun)
+		{
+			cmds[count].lun = lun;
+			cmds[count].tag = tag;
+			cmds[count].done = 0;
+			++count;
+		}
+	}
+
+	// The target resumes them in reverse order.
+	int i;
+	for (i = count - 1; i >= 0; --i)
+	{
+		uint8_t msg[3];
+		reselectMessages(cmds[i].lun, cmds[i].tag, msg);
+		assert(msg[0] & 0x80);
+
+		int j;
+		int found = -1;
+		for (j = 0; j < count; ++j)
+		{
+			if (!cmds[j].done &&
+				(cmds[j].lun == (msg[0] & 0x7)) &&
+				(cmds[j].tag == msg[2]))
+			{
+				assert(found < 0); // Ambiguous nexus.
+				found = j;
+			}
+		}
+		assert(found == i);
+		cmds[found].done = 1;
+	}
+	printf("Multi-LUN reselect: %d commands resumed on the right LUN\n", count);
+}
+
+int main()
+{
+	checkMultiLunReselect();
+
+	printf("Sequential   Untagged (IOPS)  Hits   Tagged (IOPS)  Hits   Gain\n");
+
+	int seqPercent;
+	for (seqPercent = 0; seqPercent <= 100; seqPercent += 25)
+	{
+		double untaggedHits;
+		double taggedHits;
+		double untaggedTime = simulate(seqPercent, 0, &untaggedHits);
+		double taggedTime = simulate(seqPercent, 1, &taggedHits);
+
+		double untaggedIOPS = COMMANDS / untaggedTime * 1000000;
+		double taggedIOPS = COMMANDS / taggedTime * 1000000;
+
+		printf("%9d%%  %15.0f  %3.0f%%  %13.0f  %3.0f%%  %4.2fx\n",
+			seqPercent,
+			untaggedIOPS,
+			untaggedHits * 100,
+			taggedIOPS,
+			taggedHits * 100,
+			taggedIOPS / untaggedIOPS);
+
+		// Sorting never loses read-ahead hits.
+		assert(taggedHits >= untaggedHits);
+	}
+	return 0;
+}
+
@@ -86,9 +86,27 @@ typedef enum
 	CONFIG_ENABLE_UNIT_ATTENTION = 1,
 	CONFIG_ENABLE_PARITY = 2,
 	CONFIG_ENABLE_SCSI2 = 4,
-	CONFIG_DISABLE_GLITCH = 8
+	CONFIG_DISABLE_GLITCH = 8,
+	CONFIG_ENABLE_WRITE_CACHE = 16, // Caching mode page WCE. Set via MODE SELECT.
+	CONFIG_ENABLE_TCQ = 32, // SCSI-2 tagged command queuing.
+	CONFIG_ENABLE_SD_CRC = 128 // Check the CRC16 of SD read data.
 } CONFIG_FLAGS;
 
+typedef enum
+{
+	// Erase the whole SD card range on FORMAT UNIT.
+	CONFIG_ENABLE_FORMAT_ERASE = 1,
+
+	// Store SCSI sectors back to back in the SD card, instead of starting
+	// each one on a 512-byte boundary. Only matters for sector sizes that
+	// aren't a multiple of 512.
+	CONFIG_ENABLE_PACKED_SECTORS = 2
+} CONFIG_FLAGS2;
+
+// Maximum TargetConfig.cacheSectors. The block cache is shared by all
+// targets.
+#define CONFIG_CACHE_SECTORS 8
+
 typedef enum
 {
 	CONFIG_FIXED,
@@ -106,6 +124,27 @@ typedef enum
 	CONFIG_QUIRKS_APPLE
 } CONFIG_QUIRKS;
 
+// Logical units per target, including LUN 0.
+#define CONFIG_MAX_LUNS 8
+
+typedef enum
+{
+	CONFIG_LUN_ENABLED = 1,
+	CONFIG_LUN_WRITE_CACHE = 2 // CONFIG_ENABLE_WRITE_CACHE for this LUN.
+} CONFIG_LUN_FLAGS;
+
+// LUNs 1 to 7 of a target. Each is a separate volume on the SD card.
+// Everything else, including the SCSI ID, flags and INQUIRY strings, is
+// shared with LUN 0, apart from the Caching page WCE bit.
+typedef struct __attribute__((packed))
+{
+	uint8_t flags; // CONFIG_LUN_FLAGS
+	uint8_t deviceType; // CONFIG_TYPE
+	uint16_t bytesPerSector;
+	uint32_t sdSectorStart;
+	uint32_t scsiSectors;
+} LunConfig;
+
 typedef struct __attribute__((packed))
 {
 	uint8_t deviceType;
@@ -144,7 +183,23 @@ typedef struct __attribute__((packed))
 
 	uint16_t quirks; // CONFIG_QUIRKS
 
-	uint8_t reserved[960]; // Pad out to 1024 bytes for main section.
+	uint8_t flags2; // CONFIG_FLAGS2
+
+	// 512-byte block cache entries for PRE-FETCH and LOCK UNLOCK CACHE.
+	// 0 to CONFIG_CACHE_SECTORS.
+	uint8_t cacheSectors;
+
+	// Block Limits VPD page transfer lengths, in SCSI sectors. 0 uses a
+	// value derived from the SD card allocation unit and the data buffer,
+	// or no limit for maxTransferLength.
+	uint16_t optimalTransferGranularity;
+	uint32_t optimalTransferLength;
+	uint32_t maxTransferLength;
+
+	// LUNs 1 to 7. LUN 0 is described by the fields above.
+	LunConfig luns[CONFIG_MAX_LUNS - 1];
+
+	uint8_t reserved[864]; // Pad out to 1024 bytes for main section.
 
 	uint8_t vpd[3072]; // Total size is 4k.
 } TargetConfig;
@@ -193,9 +248,77 @@ typedef enum
 	// Response:
 	// CONFIG_STATUS
 	// uint8_t result code (0 = passed)
-	CONFIG_SCSITEST
+	CONFIG_SCSITEST,
+
+	// Command content:
+	// uint8_t CONFIG_STATS
+	// uint8_t target index, 0 to MAX_SCSI_TARGETS - 1
+	// uint8_t CONFIG_STATS_CLASS
+	// uint8_t clear. Reset the counters after reading if non-zero.
+	// Response:
+	// CONFIG_STATUS
+	// CommandStats
+	CONFIG_STATS,
+
+	// Command content:
+	// uint8_t CONFIG_TRACE
+	// uint8_t pause. Stop recording while non-zero, so a dump spread over
+	//   several commands is consistent.
+	// uint8_t[2] first ring slot to return, big-endian.
+	// Response:
+	// CONFIG_STATUS. CONFIG_STATUS_ERR if the firmware was built without
+	//   TRACE_RAM.
+	// TraceHeader
+	// TraceRecord[CONFIG_TRACE_RECORDS], or fewer at the end of the ring.
+	CONFIG_TRACE
 } CONFIG_COMMAND;
 
+typedef enum
+{
+	CONFIG_STATS_READ, // READ(6), READ(10), READ(12), READ(16)
+	CONFIG_STATS_WRITE, // WRITE(6), WRITE(10), WRITE(12), WRITE(16), WRITE AND VERIFY
+	CONFIG_STATS_OTHER,
+	CONFIG_STATS_CLASSES
+} CONFIG_STATS_CLASS;
+
+// Histograms have one bucket per power of 2 microseconds. Bucket 0 is under
+// 1us, bucket 1 is 1us, bucket 2 is 2-3us, ... and the last bucket also
+// counts everything longer.
+#define CONFIG_STATS_BUCKETS 20
+
+// Counters for one target and CONFIG_STATS_CLASS, since power-on.
+typedef struct __attribute__((packed))
+{
+	uint32_t commands;
+	uint32_t errors; // Any status other than GOOD.
+	uint64_t bytes; // Transferred in DATA IN and DATA OUT phases.
+
+	// Selection to status. Buckets stop counting at 0xFFFF.
+	uint16_t latency[CONFIG_STATS_BUCKETS];
+
+	// Time the SD card spent transferring or programming sectors during
+	// the command.
+	uint16_t sdBusy[CONFIG_STATS_BUCKETS];
+} CommandStats;
+
+// Maximum records in a CONFIG_TRACE response.
+#define CONFIG_TRACE_RECORDS 30
+
+typedef struct __attribute__((packed))
+{
+	uint32_t count; // Records written since power-on.
+	uint16_t slots; // Ring size. Slot (count % slots) is the oldest record.
+	uint16_t reserved;
+} TraceHeader;
+
+typedef struct __attribute__((packed))
+{
+	uint32_t cycles; // BUS_CLK cycle counter. Wraps every 85s at 50MHz.
+	uint8_t event; // enum trace_event, see SCSI2SD/src/trace.h
+	uint8_t irq; // Non-zero if recorded by traceIrq.
+	uint16_t reserved;
+} TraceRecord;
+
 typedef enum
 {
 	CONFIG_STATUS_GOOD,
@@ -131,6 +131,17 @@ ConfigUtil::fromBytes(const uint8_t* data)
 	result.bytesPerSector = toLE16(result.bytesPerSector);
 	result.sectorsPerTrack = toLE16(result.sectorsPerTrack);
 	result.headsPerCylinder = toLE16(result.headsPerCylinder);
+	result.optimalTransferGranularity =
+		toLE16(result.optimalTransferGranularity);
+	result.optimalTransferLength = toLE32(result.optimalTransferLength);
+	result.maxTransferLength = toLE32(result.maxTransferLength);
+	for (int i = 0; i < CONFIG_MAX_LUNS - 1; ++i)
+	{
+		LunConfig& lun(result.luns[i]);
+		lun.bytesPerSector = toLE16(lun.bytesPerSector);
+		lun.sdSectorStart = toLE32(lun.sdSectorStart);
+		lun.scsiSectors = toLE32(lun.scsiSectors);
+	}
 	return result;
 }
 
@@ -144,6 +155,17 @@ ConfigUtil::toBytes(const TargetConfig& _config)
 	config.bytesPerSector = fromLE16(config.bytesPerSector);
 	config.sectorsPerTrack = fromLE16(config.sectorsPerTrack);
 	config.headsPerCylinder = fromLE16(config.headsPerCylinder);
+	config.optimalTransferGranularity =
+		fromLE16(config.optimalTransferGranularity);
+	config.optimalTransferLength = fromLE32(config.optimalTransferLength);
+	config.maxTransferLength = fromLE32(config.maxTransferLength);
+	for (int i = 0; i < CONFIG_MAX_LUNS - 1; ++i)
+	{
+		LunConfig& lun(config.luns[i]);
+		lun.bytesPerSector = fromLE16(lun.bytesPerSector);
+		lun.sdSectorStart = fromLE32(lun.sdSectorStart);
+		lun.scsiSectors = fromLE32(lun.scsiSectors);
+	}
 
 	const uint8_t* begin = reinterpret_cast<const uint8_t*>(&config);
 	return std::vector<uint8_t>(begin, begin + sizeof(config));
@@ -190,6 +212,61 @@ ConfigUtil::toXML(const TargetConfig& config)
 			(config.flags & CONFIG_DISABLE_GLITCH ? "true" : "false") <<
 			"</disableGlitchFilter>\n" <<
 
+		"	<!-- ********************************************************\n" <<
+		"	Report GOOD status as soon as WRITE data is buffered, and\n" <<
+		"	write it to the SD card in the background. Buffered data is lost\n" <<
+		"	if power is removed before the host sends SYNCHRONIZE CACHE.\n" <<
+		"	May also be changed by the host via the Caching mode page.\n" <<
+		"	********************************************************* -->\n" <<
+		"	<enableWriteCache>" <<
+			(config.flags & CONFIG_ENABLE_WRITE_CACHE ? "true" : "false") <<
+			"</enableWriteCache>\n" <<
+
+		"	<!-- ********************************************************\n" <<
+		"	Accept SCSI-2 tagged commands. Queued READ commands are\n" <<
+		"	reordered by address, and the device disconnects from the bus\n" <<
+		"	while they wait. Requires enableSCSI2.\n" <<
+		"	********************************************************* -->\n" <<
+		"	<enableTCQ>" <<
+			(config.flags & CONFIG_ENABLE_TCQ ? "true" : "false") <<
+			"</enableTCQ>\n" <<
+
+		"	<!-- ********************************************************\n" <<
+		"	Check the CRC16 of every sector read from the SD card, and\n" <<
+		"	read it again if it doesn't match. Helps with long or noisy\n" <<
+		"	SD card extension cables.\n" <<
+		"	********************************************************* -->\n" <<
+		"	<enableSDCRC>" <<
+			(config.flags & CONFIG_ENABLE_SD_CRC ? "true" : "false") <<
+			"</enableSDCRC>\n" <<
+
+		"	<!-- ********************************************************\n" <<
+		"	Erase the SD card sectors on FORMAT UNIT. Writes to erased\n" <<
+		"	sectors are faster on most cards. The erase continues in the\n" <<
+		"	background after the command completes.\n" <<
+		"	********************************************************* -->\n" <<
+		"	<enableFormatErase>" <<
+			(config.flags2 & CONFIG_ENABLE_FORMAT_ERASE ? "true" : "false") <<
+			"</enableFormatErase>\n" <<
+
+		"	<!-- ********************************************************\n" <<
+		"	Store sectors back to back on the SD card, instead of starting\n" <<
+		"	each one on a 512-byte boundary. Saves space and SD card\n" <<
+		"	transfers for sector sizes that aren't a multiple of 512.\n" <<
+		"	Changing this makes existing data unreadable.\n" <<
+		"	********************************************************* -->\n" <<
+		"	<packedSectors>" <<
+			(config.flags2 & CONFIG_ENABLE_PACKED_SECTORS ? "true" : "false") <<
+			"</packedSectors>\n" <<
+
+		"	<!-- ********************************************************\n" <<
+		"	Number of 512-byte SD sectors this target may keep in the\n" <<
+		"	block cache for PRE-FETCH and LOCK UNLOCK CACHE. 0 to 8. The\n" <<
+		"	cache is shared by all targets.\n" <<
+		"	********************************************************* -->\n" <<
+		"	<cacheSectors>" << std::dec << static_cast<int>(config.cacheSectors) <<
+			"</cacheSectors>\n" <<
+
 		"\n" <<
 		"	<!-- ********************************************************\n" <<
 		"	Space separated list. Available options:\n" <<
@@ -235,6 +312,49 @@ ConfigUtil::toXML(const TargetConfig& config)
 		"	<bytesPerSector>" << std::dec << config.bytesPerSector << "</bytesPerSector>\n" <<
 		"	<sectorsPerTrack>" << std::dec << config.sectorsPerTrack<< "</sectorsPerTrack>\n" <<
 		"	<headsPerCylinder>" << std::dec << config.headsPerCylinder << "</headsPerCylinder>\n" <<
+		"\n\n" <<
+		"	<!-- ********************************************************\n" <<
+		"	Transfer lengths reported in the Block Limits VPD page, in\n" <<
+		"	sectors. Some hosts size their reads and writes from these.\n" <<
+		"	0 uses values based on the SD card allocation unit size,\n" <<
+		"	and no limit for maxTransferLength.\n" <<
+		"	********************************************************* -->\n" <<
+		"	<optimalTransferGranularity>" << std::dec << config.optimalTransferGranularity << "</optimalTransferGranularity>\n" <<
+		"	<optimalTransferLength>" << std::dec << config.optimalTransferLength << "</optimalTransferLength>\n" <<
+		"	<maxTransferLength>" << std::dec << config.maxTransferLength << "</maxTransferLength>\n" <<
+		"\n\n" <<
+		"	<!-- ********************************************************\n" <<
+		"	Additional logical units 1 to 7 on this SCSI ID. LUN 0 uses\n" <<
+		"	the settings above. The identification strings are shared.\n" <<
+		"	<lun number=\"1\">\n" <<
+		"		<deviceType>0x0</deviceType>\n" <<
+		"		<sdSectorStart>0</sdSectorStart>\n" <<
+		"		<scsiSectors>0</scsiSectors>\n" <<
+		"		<bytesPerSector>512</bytesPerSector>\n" <<
+		"		<enableWriteCache>false</enableWriteCache>\n" <<
+		"	</lun>\n" <<
+		"	********************************************************* -->\n";
+
+	for (int i = 0; i < CONFIG_MAX_LUNS - 1; ++i)
+	{
+		const LunConfig& lun(config.luns[i]);
+		if (!(lun.flags & CONFIG_LUN_ENABLED)) continue;
+
+		s <<
+			"	<lun number=\"" << std::dec << (i + 1) << "\">\n" <<
+			"		<deviceType>0x" <<
+				std::hex << static_cast<int>(lun.deviceType) <<
+				"</deviceType>\n" <<
+			"		<sdSectorStart>" << std::dec << lun.sdSectorStart << "</sdSectorStart>\n" <<
+			"		<scsiSectors>" << std::dec << lun.scsiSectors << "</scsiSectors>\n" <<
+			"		<bytesPerSector>" << std::dec << lun.bytesPerSector << "</bytesPerSector>\n" <<
+			"		<enableWriteCache>" <<
+				(lun.flags & CONFIG_LUN_WRITE_CACHE ? "true" : "false") <<
+				"</enableWriteCache>\n" <<
+			"	</lun>\n";
+	}
+
+	s <<
 		"\n\n" <<
 		"	<!-- ********************************************************\n" <<
 		"	Drive identification information. The SCSI2SD doesn't\n" <<
@@ -296,6 +416,60 @@ static uint64_t parseInt(wxXmlNode* node, uint64_t limit)
 	return result;
 }
 
+static void
+parseLun(wxXmlNode* node, TargetConfig& config)
+{
+	int number;
+	{
+		std::stringstream s;
+		s << node->GetAttribute("number", "0");
+		s >> number;
+		if (!s || number < 1 || number >= CONFIG_MAX_LUNS)
+		{
+			throw std::runtime_error("Invalid lun number attr");
+		}
+	}
+
+	LunConfig& lun(config.luns[number - 1]);
+	lun.flags = CONFIG_LUN_ENABLED;
+	lun.deviceType = config.deviceType;
+	lun.bytesPerSector = 512;
+
+	wxXmlNode *child = node->GetChildren();
+	while (child)
+	{
+		if (child->GetName() == "deviceType")
+		{
+			lun.deviceType = parseInt(child, 0xFF);
+		}
+		else if (child->GetName() == "sdSectorStart")
+		{
+			lun.sdSectorStart = parseInt(child, 0xFFFFFFFF);
+		}
+		else if (child->GetName() == "scsiSectors")
+		{
+			lun.scsiSectors = parseInt(child, 0xFFFFFFFF);
+		}
+		else if (child->GetName() == "bytesPerSector")
+		{
+			lun.bytesPerSector = parseInt(child, 8192);
+		}
+		else if (child->GetName() == "enableWriteCache")
+		{
+			std::string s(child->GetNodeContent().mb_str());
+			if (s == "true")
+			{
+				lun.flags |= CONFIG_LUN_WRITE_CACHE;
+			}
+			else
+			{
+				lun.flags = lun.flags & ~CONFIG_LUN_WRITE_CACHE;
+			}
+		}
+		child = child->GetNext();
+	}
+}
+
 static TargetConfig
 parseTarget(wxXmlNode* node)
 {
@@ -371,6 +545,70 @@ parseTarget(wxXmlNode* node)
 				result.flags = result.flags & ~CONFIG_DISABLE_GLITCH;
 			}
 		}
+		else if (child->GetName() == "enableWriteCache")
+		{
+			std::string s(child->GetNodeContent().mb_str());
+			if (s == "true")
+			{
+				result.flags |= CONFIG_ENABLE_WRITE_CACHE;
+			}
+			else
+			{
+				result.flags = result.flags & ~CONFIG_ENABLE_WRITE_CACHE;
+			}
+		}
+		else if (child->GetName() == "enableTCQ")
+		{
+			std::string s(child->GetNodeContent().mb_str());
+			if (s == "true")
+			{
+				result.flags |= CONFIG_ENABLE_TCQ;
+			}
+			else
+			{
+				result.flags = result.flags & ~CONFIG_ENABLE_TCQ;
+			}
+		}
+		else if (child->GetName() == "enableSDCRC")
+		{
+			std::string s(child->GetNodeContent().mb_str());
+			if (s == "true")
+			{
+				result.flags |= CONFIG_ENABLE_SD_CRC;
+			}
+			else
+			{
+				result.flags = result.flags & ~CONFIG_ENABLE_SD_CRC;
+			}
+		}
+		else if (child->GetName() == "enableFormatErase")
+		{
+			std::string s(child->GetNodeContent().mb_str());
+			if (s == "true")
+			{
+				result.flags2 |= CONFIG_ENABLE_FORMAT_ERASE;
+			}
+			else
+			{
+				result.flags2 = result.flags2 & ~CONFIG_ENABLE_FORMAT_ERASE;
+			}
+		}
+		else if (child->GetName() == "packedSectors")
+		{
+			std::string s(child->GetNodeContent().mb_str());
+			if (s == "true")
+			{
+				result.flags2 |= CONFIG_ENABLE_PACKED_SECTORS;
+			}
+			else
+			{
+				result.flags2 = result.flags2 & ~CONFIG_ENABLE_PACKED_SECTORS;
+			}
+		}
+		else if (child->GetName() == "cacheSectors")
+		{
+			result.cacheSectors = parseInt(child, CONFIG_CACHE_SECTORS);
+		}
 		else if (child->GetName() == "quirks")
 		{
 			std::stringstream s(std::string(child->GetNodeContent().mb_str()));
@@ -411,6 +649,22 @@ parseTarget(wxXmlNode* node)
 		{
 			result.headsPerCylinder = parseInt(child, 255);
 		}
+		else if (child->GetName() == "optimalTransferGranularity")
+		{
+			result.optimalTransferGranularity = parseInt(child, 0xFFFF);
+		}
+		else if (child->GetName() == "optimalTransferLength")
+		{
+			result.optimalTransferLength = parseInt(child, 0xFFFFFFFF);
+		}
+		else if (child->GetName() == "maxTransferLength")
+		{
+			result.maxTransferLength = parseInt(child, 0xFFFFFFFF);
+		}
+		else if (child->GetName() == "lun")
+		{
+			parseLun(child, result);
+		}
 		else if (child->GetName() == "vendor")
 		{
 			std::string s(child->GetNodeContent().mb_str());
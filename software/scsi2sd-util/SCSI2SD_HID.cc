@@ -26,6 +26,7 @@
 
 #include <wx/utils.h>
 
+#include <algorithm>
 #include <cassert>
 #include <stdexcept>
 #include <sstream>
@@ -384,6 +385,115 @@ HID::scsiSelfTest()
 	return (out.size() >= 1) && (out[0] == CONFIG_STATUS_GOOD);
 }
 
+bool
+HID::readStats(
+	int targetIndex, int cmdClass, bool clear, CommandStats& stats)
+{
+	std::vector<uint8_t> cmd
+	{
+		CONFIG_STATS,
+		static_cast<uint8_t>(targetIndex),
+		static_cast<uint8_t>(cmdClass),
+		static_cast<uint8_t>(clear ? 1 : 0)
+	};
+	std::vector<uint8_t> out;
+	try
+	{
+		sendHIDPacket(cmd, out, (1 + sizeof(stats) + 61) / 62);
+	}
+	catch (std::runtime_error& e)
+	{
+		return false;
+	}
+
+	if ((out.size() < 1 + sizeof(stats)) || (out[0] != CONFIG_STATUS_GOOD))
+	{
+		return false;
+	}
+	memcpy(&stats, &out[1], sizeof(stats));
+	return true;
+}
+
+bool
+HID::readTraceSlots(
+	bool pause,
+	uint16_t first,
+	TraceHeader& header,
+	std::vector<TraceRecord>& records)
+{
+	std::vector<uint8_t> cmd
+	{
+		CONFIG_TRACE,
+		static_cast<uint8_t>(pause ? 1 : 0),
+		static_cast<uint8_t>(first >> 8),
+		static_cast<uint8_t>(first)
+	};
+	std::vector<uint8_t> out;
+	try
+	{
+		sendHIDPacket(
+			cmd,
+			out,
+			(1 + sizeof(header) +
+				CONFIG_TRACE_RECORDS * sizeof(TraceRecord) + 61) / 62);
+	}
+	catch (std::runtime_error& e)
+	{
+		return false;
+	}
+
+	if ((out.size() < 1 + sizeof(header)) || (out[0] != CONFIG_STATUS_GOOD))
+	{
+		return false;
+	}
+	memcpy(&header, &out[1], sizeof(header));
+
+	size_t offset = 1 + sizeof(header);
+	while (offset + sizeof(TraceRecord) <= out.size())
+	{
+		TraceRecord rec;
+		memcpy(&rec, &out[offset], sizeof(rec));
+		records.push_back(rec);
+		offset += sizeof(rec);
+	}
+	return true;
+}
+
+bool
+HID::readTrace(std::vector<TraceRecord>& records)
+{
+	TraceHeader header;
+	std::vector<TraceRecord> ring;
+	if (!readTraceSlots(true, 0, header, ring))
+	{
+		return false;
+	}
+	while ((ring.size() < header.slots) &&
+		readTraceSlots(true, ring.size(), header, ring))
+	{
+		if (ring.size() % CONFIG_TRACE_RECORDS) break;
+	}
+
+	// Resume recording.
+	TraceHeader resumed;
+	std::vector<TraceRecord> unused;
+	readTraceSlots(false, header.slots, resumed, unused);
+
+	records.clear();
+	if (header.count < header.slots)
+	{
+		size_t count = std::min<size_t>(header.count, ring.size());
+		records.insert(records.end(), ring.begin(), ring.begin() + count);
+	}
+	else if (ring.size() == header.slots)
+	{
+		size_t oldest = header.count % header.slots;
+		records.insert(records.end(), ring.begin() + oldest, ring.end());
+		records.insert(records.end(), ring.begin(), ring.begin() + oldest);
+	}
+	return true;
+}
+
 
 void
 HID::sendHIDPacket(
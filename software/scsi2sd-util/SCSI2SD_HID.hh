@@ -19,6 +19,7 @@
 #define SCSI2SD_HID_H
 
 #include "hidapi.h"
+#include "scsi2sd.h"
 
 #if __cplusplus >= 201103L
 #include <cstdint>
@@ -60,6 +61,15 @@ public:
 
 	bool scsiSelfTest();
 
+	// Returns false if the firmware doesn't support CONFIG_STATS.
+	bool readStats(
+		int targetIndex, int cmdClass, bool clear, CommandStats& stats);
+
+	// Reads the whole CONFIG_TRACE ring, oldest record first. Recording
+	// is paused during the dump. Returns false if the firmware was built
+	// without TRACE_RAM.
+	bool readTrace(std::vector<TraceRecord>& records);
+
 	void enterBootloader();
 
 	void readFlashRow(int array, int row, std::vector<uint8_t>& out);
@@ -72,6 +82,11 @@ private:
 	HID(hid_device_info* hidInfo);
 	void destroy();
 	void readDebugData();
+	bool readTraceSlots(
+		bool pause,
+		uint16_t first,
+		TraceHeader& header,
+		std::vector<TraceRecord>& records);
 	void readHID(uint8_t* buffer, size_t len);
 	void sendHIDPacket(
 		const std::vector<uint8_t>& cmd,
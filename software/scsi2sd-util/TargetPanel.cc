@@ -72,7 +72,7 @@ TargetPanel::TargetPanel(wxWindow* parent, const TargetConfig& initialConfig) :
 	myNumSectorValidator(new wxIntegerValidator<uint32_t>),
 	mySizeValidator(new wxFloatingPointValidator<float>(2))
 {
-	wxFlexGridSizer *fgs = new wxFlexGridSizer(13, 3, 9, 25);
+	wxFlexGridSizer *fgs = new wxFlexGridSizer(19, 3, 9, 25);
 
 	fgs->Add(new wxStaticText(this, wxID_ANY, wxT("")));
 	myEnableCtrl =
@@ -164,6 +164,78 @@ TargetPanel::TargetPanel(wxWindow* parent, const TargetConfig& initialConfig) :
 	fgs->Add(myGlitchCtrl);
 	Bind(wxEVT_CHECKBOX, &TargetPanel::onInput<wxCommandEvent>, this, ID_glitchCtrl);
 
+	fgs->Add(new wxStaticText(this, wxID_ANY, wxT("")));
+	myWriteCacheCtrl =
+		new wxCheckBox(
+			this,
+			ID_writeCacheCtrl,
+			wxT("Enable write cache"));
+	myWriteCacheCtrl->SetToolTip(wxT("Complete writes before the data reaches the SD card. Data may be lost on power failure."));
+	fgs->Add(myWriteCacheCtrl);
+	fgs->Add(new wxStaticText(this, wxID_ANY, wxT("")));
+	Bind(wxEVT_CHECKBOX, &TargetPanel::onInput<wxCommandEvent>, this, ID_writeCacheCtrl);
+
+	fgs->Add(new wxStaticText(this, wxID_ANY, wxT("")));
+	myTCQCtrl =
+		new wxCheckBox(
+			this,
+			ID_tcqCtrl,
+			wxT("Enable tagged queuing"));
+	myTCQCtrl->SetToolTip(wxT("Accept SCSI-2 tagged commands, and reorder queued reads. Requires SCSI2 mode."));
+	fgs->Add(myTCQCtrl);
+	fgs->Add(new wxStaticText(this, wxID_ANY, wxT("")));
+	Bind(wxEVT_CHECKBOX, &TargetPanel::onInput<wxCommandEvent>, this, ID_tcqCtrl);
+
+	fgs->Add(new wxStaticText(this, wxID_ANY, wxT("")));
+	mySDCRCCtrl =
+		new wxCheckBox(
+			this,
+			ID_sdCRCCtrl,
+			wxT("Check SD card CRC"));
+	mySDCRCCtrl->SetToolTip(wxT("Check the CRC of all data read from the SD card, and read it again on errors. Helps with long SD card extension cables."));
+	fgs->Add(mySDCRCCtrl);
+	fgs->Add(new wxStaticText(this, wxID_ANY, wxT("")));
+	Bind(wxEVT_CHECKBOX, &TargetPanel::onInput<wxCommandEvent>, this, ID_sdCRCCtrl);
+
+	fgs->Add(new wxStaticText(this, wxID_ANY, wxT("")));
+	myFormatEraseCtrl =
+		new wxCheckBox(
+			this,
+			ID_formatEraseCtrl,
+			wxT("Erase SD card on FORMAT UNIT"));
+	myFormatEraseCtrl->SetToolTip(wxT("Erase the SD card sectors when the host formats the drive. Writes to erased sectors are faster on most SD cards."));
+	fgs->Add(myFormatEraseCtrl);
+	fgs->Add(new wxStaticText(this, wxID_ANY, wxT("")));
+	Bind(wxEVT_CHECKBOX, &TargetPanel::onInput<wxCommandEvent>, this, ID_formatEraseCtrl);
+
+	fgs->Add(new wxStaticText(this, wxID_ANY, wxT("")));
+	myPackedCtrl =
+		new wxCheckBox(
+			this,
+			ID_packedCtrl,
+			wxT("Pack sectors"));
+	myPackedCtrl->SetToolTip(wxT("Store sectors back to back on the SD card, instead of starting each one on a 512-byte boundary. Saves space for sector sizes that aren't a multiple of 512. Changing this makes existing data unreadable."));
+	fgs->Add(myPackedCtrl);
+	fgs->Add(new wxStaticText(this, wxID_ANY, wxT("")));
+	Bind(wxEVT_CHECKBOX, &TargetPanel::onInput<wxCommandEvent>, this, ID_packedCtrl);
+
+	fgs->Add(new wxStaticText(this, wxID_ANY, wxT("Block cache sectors")));
+	myCacheSectorsCtrl =
+		new wxSpinCtrl
+			(this,
+			ID_cacheSectorsCtrl,
+			wxEmptyString,
+			wxDefaultPosition,
+			wxDefaultSize,
+			wxSP_ARROW_KEYS,
+			0,
+			CONFIG_CACHE_SECTORS,
+			0);
+	myCacheSectorsCtrl->SetToolTip(wxT("Number of 512-byte sectors the host can load into the cache with PRE-FETCH and LOCK UNLOCK CACHE. Cached sectors are read without accessing the SD card. The cache is shared by all targets."));
+	fgs->Add(myCacheSectorsCtrl);
+	fgs->Add(new wxStaticText(this, wxID_ANY, wxT("")));
+	Bind(wxEVT_SPINCTRL, &TargetPanel::onInput<wxSpinEvent>, this, ID_cacheSectorsCtrl);
+
 	fgs->Add(new wxStaticText(this, wxID_ANY, wxT("SD card start sector")));
 	wxWrapSizer* startContainer = new wxWrapSizer();
 	myStartSDSectorCtrl =
@@ -338,6 +410,12 @@ TargetPanel::evaluate()
 		myUnitAttCtrl->Enable(enabled);
 		myScsi2Ctrl->Enable(enabled);
 		myGlitchCtrl->Enable(enabled);
+		myWriteCacheCtrl->Enable(enabled);
+		myTCQCtrl->Enable(enabled);
+		mySDCRCCtrl->Enable(enabled);
+		myFormatEraseCtrl->Enable(enabled);
+		myPackedCtrl->Enable(enabled);
+		myCacheSectorsCtrl->Enable(enabled);
 		myStartSDSectorCtrl->Enable(enabled && !myAutoStartSectorCtrl->IsChecked());
 		myAutoStartSectorCtrl->Enable(enabled);
 		mySectorSizeCtrl->Enable(enabled);
@@ -572,7 +650,18 @@ TargetPanel::getConfig() const
 		(myParityCtrl->IsChecked() ? CONFIG_ENABLE_PARITY : 0) |
 		(myUnitAttCtrl->IsChecked() ? CONFIG_ENABLE_UNIT_ATTENTION : 0) |
 		(myScsi2Ctrl->IsChecked() ? CONFIG_ENABLE_SCSI2 : 0) |
-		(myGlitchCtrl->IsChecked() ? CONFIG_DISABLE_GLITCH : 0);
+		(myGlitchCtrl->IsChecked() ? CONFIG_DISABLE_GLITCH : 0) |
+		(myWriteCacheCtrl->IsChecked() ? CONFIG_ENABLE_WRITE_CACHE : 0) |
+		(myTCQCtrl->IsChecked() ? CONFIG_ENABLE_TCQ : 0) |
+		(mySDCRCCtrl->IsChecked() ? CONFIG_ENABLE_SD_CRC : 0);
+
+	config.flags2 =
+		(config.flags2 &
+			~(CONFIG_ENABLE_FORMAT_ERASE | CONFIG_ENABLE_PACKED_SECTORS)) |
+		(myFormatEraseCtrl->IsChecked() ? CONFIG_ENABLE_FORMAT_ERASE : 0) |
+		(myPackedCtrl->IsChecked() ? CONFIG_ENABLE_PACKED_SECTORS : 0);
+
+	config.cacheSectors = myCacheSectorsCtrl->GetValue();
 
 	auto startSDSector = CtrlGetValue<uint32_t>(myStartSDSectorCtrl);
 	config.sdSectorStart = startSDSector.first;
@@ -608,6 +697,12 @@ TargetPanel::setConfig(const TargetConfig& config)
 	myUnitAttCtrl->SetValue(config.flags & CONFIG_ENABLE_UNIT_ATTENTION);
 	myScsi2Ctrl->SetValue(config.flags & CONFIG_ENABLE_SCSI2);
 	myGlitchCtrl->SetValue(config.flags & CONFIG_DISABLE_GLITCH);
+	myWriteCacheCtrl->SetValue(config.flags & CONFIG_ENABLE_WRITE_CACHE);
+	myTCQCtrl->SetValue(config.flags & CONFIG_ENABLE_TCQ);
+	mySDCRCCtrl->SetValue(config.flags & CONFIG_ENABLE_SD_CRC);
+	myFormatEraseCtrl->SetValue(config.flags2 & CONFIG_ENABLE_FORMAT_ERASE);
+	myPackedCtrl->SetValue(config.flags2 & CONFIG_ENABLE_PACKED_SECTORS);
+	myCacheSectorsCtrl->SetValue(config.cacheSectors);
 
 	{
 		std::stringstream ss; ss << config.sdSectorStart;
@@ -657,11 +752,21 @@ TargetPanel::getSDSectorRange() const
 	uint16_t scsiSectorSize = CtrlGetValue<uint16_t>(mySectorSizeCtrl).first;
 
 	const int sdSector = 512; // Always 512 for SDHC/SDXC
-	result.second = result.first +
-		(
-			((uint64_t(numSCSISectors) * scsiSectorSize) + (sdSector - 1))
-				/ sdSector
-		);
+	if (myPackedCtrl->IsChecked())
+	{
+		result.second = result.first +
+			(
+				((uint64_t(numSCSISectors) * scsiSectorSize) + (sdSector - 1))
+					/ sdSector
+			);
+	}
+	else
+	{
+		// Each sector starts on a new SD sector.
+		result.second = result.first +
+			uint64_t(numSCSISectors) *
+				((scsiSectorSize + (sdSector - 1)) / sdSector);
+	}
 	return result;
 }
 
@@ -81,6 +81,12 @@ private:
 		ID_unitAttCtrl,
 		ID_scsi2Ctrl,
 		ID_glitchCtrl,
+		ID_writeCacheCtrl,
+		ID_tcqCtrl,
+		ID_sdCRCCtrl,
+		ID_formatEraseCtrl,
+		ID_packedCtrl,
+		ID_cacheSectorsCtrl,
 		ID_startSDSectorCtrl,
 		ID_autoStartSectorCtrl,
 		ID_sectorSizeCtrl,
@@ -116,6 +122,12 @@ private:
 	wxCheckBox* myUnitAttCtrl;
 	wxCheckBox* myScsi2Ctrl;
 	wxCheckBox* myGlitchCtrl;
+	wxCheckBox* myWriteCacheCtrl;
+	wxCheckBox* myTCQCtrl;
+	wxCheckBox* mySDCRCCtrl;
+	wxCheckBox* myFormatEraseCtrl;
+	wxCheckBox* myPackedCtrl;
+	wxSpinCtrl* myCacheSectorsCtrl;
 
 	wxIntegerValidator<uint32_t>* myStartSDSectorValidator;
 	wxTextCtrl* myStartSDSectorCtrl;
@@ -276,6 +276,20 @@ public:
 			"SCSI Standalone Self-Test",
 			"SCSI Standalone Self-Test");
 
+		menuDebug->AppendSeparator();
+		menuDebug->Append(
+			ID_Stats,
+			"Show &Statistics",
+			"Show command latency and throughput counters");
+		menuDebug->Append(
+			ID_StatsReset,
+			"&Reset Statistics",
+			"Show, then clear, command latency and throughput counters");
+		menuDebug->Append(
+			ID_SaveTrace,
+			"Save T&race...",
+			"Save the firmware trace ring, for tools/traceDecode.pl");
+
 		wxMenu *menuHelp = new wxMenu();
 		menuHelp->Append(wxID_ABOUT);
 
@@ -446,7 +460,10 @@ private:
 		ID_SCSILog,
 		ID_SelfTest,
 		ID_SaveFile,
-		ID_OpenFile
+		ID_OpenFile,
+		ID_Stats,
+		ID_StatsReset,
+		ID_SaveTrace
 	};
 
 	void OnID_ConfigDefaults(wxCommandEvent& event)
@@ -545,6 +562,164 @@ private:
 		myLogWindow->Show();
 	}
 
+	void OnID_Stats(wxCommandEvent& event)
+	{
+		logStats(false);
+	}
+
+	void OnID_StatsReset(wxCommandEvent& event)
+	{
+		logStats(true);
+	}
+
+	void OnID_SaveTrace(wxCommandEvent& event)
+	{
+		TimerLock lock(myTimer);
+
+		std::vector<TraceRecord> records;
+		if (!myHID || !myHID->readTrace(records))
+		{
+			wxMessageBox(
+				"The firmware must be built with TRACE_RAM defined.",
+				"Trace not available",
+				wxOK | wxICON_ERROR);
+			return;
+		}
+
+		wxFileDialog dlg(
+			this,
+			"Save trace",
+			"",
+			"",
+			"Trace files (*.bin)|*.bin",
+			wxFD_SAVE | wxFD_OVERWRITE_PROMPT);
+		if (dlg.ShowModal() == wxID_CANCEL) return;
+
+		wxFileOutputStream file(dlg.GetPath());
+		if (!file.IsOk())
+		{
+			wxLogError("Cannot save trace to file '%s'.", dlg.GetPath());
+			return;
+		}
+		if (!records.empty())
+		{
+			file.Write(&records[0], records.size() * sizeof(TraceRecord));
+		}
+		wxLogMessage(
+			this,
+			"Saved %d trace records to %s",
+			static_cast<int>(records.size()),
+			dlg.GetPath());
+	}
+
+	static std::string statsTime(uint32_t us)
+	{
+		std::stringstream ss;
+		if (us >= 1000)
+		{
+			ss << (us / 1000) << "ms";
+		}
+		else
+		{
+			ss << us << "us";
+		}
+		return ss.str();
+	}
+
+	// Upper bound of the CONFIG_STATS_BUCKETS bucket holding the given
+	// percentile.
+	static std::string statsPercentile(const uint16_t* hist, int percent)
+	{
+		uint64_t total = 0;
+		for (int i = 0; i < CONFIG_STATS_BUCKETS; ++i) total += hist[i];
+
+		uint64_t n = (total * percent + 99) / 100;
+		uint64_t sum = 0;
+		int i;
+		for (i = 0; i < CONFIG_STATS_BUCKETS - 1; ++i)
+		{
+			sum += hist[i];
+			if (sum >= n) break;
+		}
+		if (i == CONFIG_STATS_BUCKETS - 1)
+		{
+			return ">= " + statsTime(1u << (i - 1));
+		}
+		return "< " + statsTime(1u << i);
+	}
+
+	static void statsHistogram(
+		std::stringstream& ss, const char* name, const uint16_t* hist)
+	{
+		ss << "  " << name <<
+			": p50 " << statsPercentile(hist, 50) <<
+			", p99 " << statsPercentile(hist, 99) << std::endl;
+		ss << "   ";
+		for (int i = 0; i < CONFIG_STATS_BUCKETS; ++i)
+		{
+			if (!hist[i]) continue;
+
+			if (i == 0)
+			{
+				ss << " <1us";
+			}
+			else if (i == CONFIG_STATS_BUCKETS - 1)
+			{
+				ss << " >=" << statsTime(1u << (i - 1));
+			}
+			else
+			{
+				ss << " " << statsTime(1u << (i - 1));
+			}
+			ss << ":" << hist[i];
+			if (hist[i] == 0xFFFF) ss << "+";
+		}
+		ss << std::endl;
+	}
+
+	void logStats(bool clear)
+	{
+		myLogWindow->Show();
+		if (!myHID)
+		{
+			wxLogMessage(this, "Statistics: No SCSI2SD device");
+			return;
+		}
+
+		static const char* classNames[CONFIG_STATS_CLASSES] =
+		{
+			"READ", "WRITE", "Other"
+		};
+
+		std::stringstream ss;
+		ss << "Statistics since power-on";
+		if (clear) ss << " (now cleared)";
+		ss << std::endl;
+
+		for (int target = 0; target < MAX_SCSI_TARGETS; ++target)
+		{
+			for (int cmdClass = 0; cmdClass < CONFIG_STATS_CLASSES; ++cmdClass)
+			{
+				CommandStats stats;
+				if (!myHID->readStats(target, cmdClass, clear, stats))
+				{
+					wxLogMessage(this,
+						"Statistics: Not supported by this firmware");
+					return;
+				}
+				if (!stats.commands) continue;
+
+				ss << "Target " << target << " " << classNames[cmdClass] <<
+					": " << stats.commands << " commands, " <<
+					stats.errors << " errors, " <<
+					(stats.bytes / 1024) << "kB" << std::endl;
+				statsHistogram(ss, "Selection to status", stats.latency);
+				statsHistogram(ss, "SD busy", stats.sdBusy);
+			}
+		}
+		wxLogMessage(this, "%s", ss.str());
+	}
+
 	void doFirmwareUpdate()
 	{
 		wxFileDialog dlg(
@@ -1631,6 +1806,9 @@ wxBEGIN_EVENT_TABLE(AppFrame, wxFrame)
 	EVT_MENU(AppFrame::ID_ConfigDefaults, AppFrame::OnID_ConfigDefaults)
 	EVT_MENU(AppFrame::ID_Firmware, AppFrame::OnID_Firmware)
 	EVT_MENU(AppFrame::ID_LogWindow, AppFrame::OnID_LogWindow)
+	EVT_MENU(AppFrame::ID_Stats, AppFrame::OnID_Stats)
+	EVT_MENU(AppFrame::ID_StatsReset, AppFrame::OnID_StatsReset)
+	EVT_MENU(AppFrame::ID_SaveTrace, AppFrame::OnID_SaveTrace)
 	EVT_MENU(AppFrame::ID_SaveFile, AppFrame::OnID_SaveFile)
 	EVT_MENU(AppFrame::ID_OpenFile, AppFrame::OnID_OpenFile)
 	EVT_MENU(wxID_EXIT, AppFrame::OnExitEvt)
@@ -0,0 +1,39 @@
+#!/bin/sh
+#	Copyright (C) 2015 Michael McMaster <michael@codesrc.com>
+#
+#	This file is part of SCSI2SD.
+#
+#	SCSI2SD is free software: you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation, either version 3 of the License, or
+#	(at your option) any later version.
+#
+#	SCSI2SD is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with SCSI2SD.  If not, see <http://www.gnu.org/licenses/>.
+
+# Measure SCSI bus throughput with READ BUFFER, independent of the SD card.
+# Requires sg_rbuf from sg3_utils, and a Linux sg device.
+# Run once against the old firmware and once against the new firmware,
+# and compare the output.
+#
+# Usage: readBufferBench.sh /dev/sgN [total bytes]
+
+DEV=$1
+TOTAL=${2:-16m}
+
+if [ -z "$DEV" ]; then
+	echo "Usage: $0 /dev/sgN [total bytes]" >&2
+	exit 1
+fi
+
+printf "%8s  %s\n" "Buffer" "Throughput"
+for SIZE in 512 1024 2048 4088 4096 8192 12288 16384; do
+	RESULT=`sg_rbuf --buffer=$SIZE --size=$TOTAL --time "$DEV" 2>&1 |
+		sed -n 's/.*, *\([0-9.]* MB\/sec\).*/\1/p'`
+	printf "%8d  %s\n" $SIZE "${RESULT:-failed}"
+done
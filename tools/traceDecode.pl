@@ -0,0 +1,151 @@
+#!/usr/bin/perl
+#	Copyright (C) 2015 Michael McMaster <michael@codesrc.com>
+#
+#	This file is part of SCSI2SD.
+#
+#	SCSI2SD is free software: you can redistribute it and/or modify
+#	it under the terms of the GNU General Public License as published by
+#	the Free Software Foundation, either version 3 of the License, or
+#	(at your option) any later version.
+#
+#	SCSI2SD is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#	GNU General Public License for more details.
+#
+#	You should have received a copy of the GNU General Public License
+#	along with SCSI2SD.  If not, see <http://www.gnu.org/licenses/>.
+
+# Decode firmware trace events. See software/SCSI2SD/src/trace.h
+#
+# Usage: traceDecode.pl [--swo] [--mhz N] [--header trace.h] < trace
+#
+# By default the input is a TRACE_RAM dump saved with the
+# "Debug -> Save Trace..." menu of scsi2sd-util. Each event is printed with
+# its time, and the time spent in each spin loop is summarised at the end.
+# A spin loop runs from its trace_spin* event to the next event recorded
+# outside an ISR, so any ISRs that ran during the loop are included.
+#
+# With --swo the input is the raw SWV stream from a TRACE build. It has no
+# timestamps, so only the event names are printed.
+
+use strict;
+use warnings;
+use File::Basename;
+use Getopt::Long;
+
+my $swo = 0;
+my $mhz = 50; # BUS_CLK
+my $header = dirname($0) . '/../software/SCSI2SD/src/trace.h';
+GetOptions(
+	'swo' => \$swo,
+	'mhz=f' => \$mhz,
+	'header=s' => \$header) or die "Usage: $0 [--swo] [--mhz N] [--header trace.h]\n";
+
+my %names;
+open(my $hdr, '<', $header) or die "Cannot open $header: $!\n";
+my $next = 0;
+my $inEnum = 0;
+while (<$hdr>)
+{
+	$inEnum = 1 if /^enum trace_event/;
+	next unless $inEnum;
+	last if /^}/;
+	/^\s*trace_(\w+)(\s*=\s*(\w+))?\s*,/ or next;
+	$next = hex($3) if defined $3;
+	$names{$next} = $1;
+	$next++;
+}
+close($hdr);
+
+sub eventName
+{
+	my ($id) = @_;
+	return $names{$id} // sprintf("unk: 0x%X", $id);
+}
+
+binmode(STDIN);
+
+if ($swo)
+{
+	# ITM stimulus port 0 and 1 headers, followed by the event byte.
+	while (!eof(STDIN))
+	{
+		my $ch = ord(getc(STDIN));
+		if ($ch == 1 || $ch == 9)
+		{
+			last if eof(STDIN);
+			my $id = ord(getc(STDIN));
+			print "ISR: " if $ch == 9;
+			print eventName($id), "\n";
+		}
+		else
+		{
+			print "<dropped>\n";
+		}
+	}
+	exit 0;
+}
+
+# TraceRecord in include/scsi2sd.h. Little-endian.
+my @records;
+my $rec;
+while (read(STDIN, $rec, 8) == 8)
+{
+	my ($cycles, $id, $irq) = unpack('VCC', $rec);
+	push @records, [$cycles, $id, $irq];
+}
+exit 0 unless @records;
+
+# The cycle counter is 32 bits, so only differences are meaningful.
+sub elapsedUs
+{
+	my ($from, $to) = @_;
+	return (($to - $from) & 0xFFFFFFFF) / $mhz;
+}
+
+my $now = 0;
+my $prev = $records[0][0];
+my %spins;
+my $spin;
+for my $r (@records)
+{
+	my ($cycles, $id, $irq) = @$r;
+	my $delta = elapsedUs($prev, $cycles);
+	$now += $delta;
+	$prev = $cycles;
+
+	printf("%12.2f %+10.2f %s%s\n",
+		$now, $delta, $irq ? "ISR: " : "", eventName($id));
+
+	next if $irq;
+
+	if (defined $spin)
+	{
+		my $s = $spins{$spin->[1]} //= { count => 0, total => 0, max => 0 };
+		my $us = elapsedUs($spin->[0], $cycles);
+		$s->{count}++;
+		$s->{total} += $us;
+		$s->{max} = $us if $us > $s->{max};
+		undef $spin;
+	}
+	if ((eventName($id) =~ /^spin/) && (eventName($id) ne 'spinDone'))
+	{
+		$spin = [$cycles, $id];
+	}
+}
+
+printf("\nTrace covers %.2fus\n\n", $now);
+printf("%-24s %8s %12s %10s %10s %6s\n",
+	"Spin loop", "Count", "Total (us)", "Mean (us)", "Max (us)", "Time");
+for my $id (sort { $spins{$b}{total} <=> $spins{$a}{total} } keys %spins)
+{
+	my $s = $spins{$id};
+	printf("%-24s %8d %12.2f %10.2f %10.2f %5.1f%%\n",
+		eventName($id),
+		$s->{count},
+		$s->{total},
+		$s->{total} / $s->{count},
+		$s->{max},
+		$now ? $s->{total} * 100 / $now : 0);
+}